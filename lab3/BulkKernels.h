@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Doubles per vector. GCC lowers simd_double to the widest vector
+// registers the target has: two SSE2 registers on plain x86-64, one
+// AVX register with -mavx.
+#define SIMD_DOUBLES 4
+
+// Only element alignment is assumed, so a column can be processed
+// from any id on.
+typedef double simd_double
+    __attribute__((vector_size(SIMD_DOUBLES * sizeof(double)),
+                   aligned(sizeof(double))));
+
+static_assert(sizeof(std::atomic<double>) == sizeof(double),
+              "columns of atomic doubles must be plain double arrays");
+
+/*
+ * ------------------------------------------------------------------
+ * plainColumn --
+ *
+ *      The doubles of a column, for the kernels below. Only for use
+ *      inside the update windows of every item touched, so that
+ *      readers retry rather than use what the kernel is writing.
+ *
+ * ------------------------------------------------------------------
+ */
+static inline double*
+plainColumn(std::atomic<double>* column)
+{
+    return reinterpret_cast<double*>(column);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * simdFill / simdCopy / simdScale --
+ *
+ *      values[i] = value, = source[i], or *= factor, for every i in
+ *      [0, n).
+ *
+ * ------------------------------------------------------------------
+ */
+static inline void
+simdFill(double* values, size_t n, double value)
+{
+    simd_double v = value - (simd_double) {};
+    size_t i = 0;
+    for (; i + SIMD_DOUBLES <= n; i += SIMD_DOUBLES)
+        *reinterpret_cast<simd_double*>(values + i) = v;
+    for (; i < n; i++)
+        values[i] = value;
+}
+
+static inline void
+simdCopy(double* values, const double* source, size_t n)
+{
+    size_t i = 0;
+    for (; i + SIMD_DOUBLES <= n; i += SIMD_DOUBLES)
+        *reinterpret_cast<simd_double*>(values + i) =
+            *reinterpret_cast<const simd_double*>(source + i);
+    for (; i < n; i++)
+        values[i] = source[i];
+}
+
+static inline void
+simdScale(double* values, size_t n, double factor)
+{
+    size_t i = 0;
+    for (; i + SIMD_DOUBLES <= n; i += SIMD_DOUBLES) {
+        simd_double *v = reinterpret_cast<simd_double*>(values + i);
+        *v = *v * factor;
+    }
+    for (; i < n; i++)
+        values[i] *= factor;
+}
@@ -0,0 +1,173 @@
+#include <cassert>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+
+using namespace std;
+
+
+CheckpointWriter::
+CheckpointWriter() : fd(-1)
+{
+}
+
+CheckpointWriter::
+~CheckpointWriter()
+{
+    // Abandoned before finish: drop the partial file.
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmpPath.c_str());
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * begin --
+ *
+ *      Start writing a checkpoint for path, beginning with header.
+ *
+ * Results:
+ *      false if the file could not be created or written.
+ *
+ * ------------------------------------------------------------------
+ */
+bool CheckpointWriter::begin(const char* checkpointPath,
+                             const CheckpointHeader &header)
+{
+    assert(fd < 0);
+    path = checkpointPath;
+    tmpPath = path + ".tmp";
+    fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("CheckpointWriter: open failed");
+        return false;
+    }
+    chunk.reserve(CHECKPOINT_CHUNK);
+    return write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header);
+}
+
+bool CheckpointWriter::flush()
+{
+    const char *data = reinterpret_cast<const char *>(chunk.data());
+    size_t left = chunk.size() * sizeof(CheckpointItem);
+    chunk.clear();
+    while (left > 0) {
+        ssize_t n = write(fd, data, left);
+        if (n < 0) {
+            perror("CheckpointWriter: write failed");
+            return false;
+        }
+        data += n;
+        left -= n;
+    }
+    return true;
+}
+
+bool CheckpointWriter::add(const CheckpointItem &item)
+{
+    chunk.push_back(item);
+    return chunk.size() < CHECKPOINT_CHUNK || flush();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * finish --
+ *
+ *      Make the checkpoint durable and put it in place of whatever
+ *      path held before, syncing the directory so that the rename
+ *      survives a crash too.
+ *
+ * Results:
+ *      false if that failed. Unless it was only the directory sync,
+ *      path is then left as it was.
+ *
+ * ------------------------------------------------------------------
+ */
+bool CheckpointWriter::finish()
+{
+    bool done = flush() && fdatasync(fd) == 0;
+    close(fd);
+    fd = -1;
+    if (!done || rename(tmpPath.c_str(), path.c_str()) < 0) {
+        perror("CheckpointWriter: finish failed");
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." :
+                 slash == 0 ? "/" : path.substr(0, slash);
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    done = dirFd >= 0 && fsync(dirFd) == 0;
+    if (dirFd >= 0) {
+        close(dirFd);
+    }
+    if (!done) {
+        perror("CheckpointWriter: directory sync failed");
+        return false;
+    }
+    return true;
+}
+
+
+CheckpointImage::
+CheckpointImage() : base(nullptr), length(0)
+{
+}
+
+CheckpointImage::
+~CheckpointImage()
+{
+    if (base != nullptr) {
+        munmap(base, length);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * map --
+ *
+ *      Map the checkpoint at path, which must hold capacity items.
+ *
+ * Results:
+ *      false if there is no such checkpoint.
+ *
+ * ------------------------------------------------------------------
+ */
+bool CheckpointImage::map(const char* path, int capacity)
+{
+    assert(base == nullptr);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    size_t expected = sizeof(CheckpointHeader) +
+                      (size_t) capacity * sizeof(CheckpointItem);
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size != expected) {
+        close(fd);
+        return false;
+    }
+    void *mem = mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("CheckpointImage: mmap failed");
+        return false;
+    }
+
+    const CheckpointHeader *h = static_cast<const CheckpointHeader*>(mem);
+    if (h->magic != CHECKPOINT_MAGIC || h->layout != CHECKPOINT_LAYOUT ||
+        h->capacity != capacity) {
+        munmap(mem, expected);
+        return false;
+    }
+    base = mem;
+    length = expected;
+    return true;
+}
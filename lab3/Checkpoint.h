@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// "ESCK", and the version of the layout below.
+#define CHECKPOINT_MAGIC  0x4b435345u
+#define CHECKPOINT_LAYOUT 1
+
+// Items a CheckpointWriter buffers per write.
+#define CHECKPOINT_CHUNK  4096
+
+/*
+ * ------------------------------------------------------------------
+ * CheckpointHeader --
+ *
+ *      The start of a checkpoint file. It is followed by capacity
+ *      CheckpointItems, one per item id, so the file can be mapped
+ *      and indexed directly.
+ *
+ *      logged     -- whether the store had a write-ahead log.
+ *      lsn        -- the last LSN logged when the checkpoint began.
+ *      pricingLsn -- the LSN of the store-wide pricing that was
+ *                    saved.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t layout;
+    int32_t capacity;
+    int32_t logged;
+    uint64_t lsn;
+    uint64_t pricingLsn;
+    double shippingCost;
+    double storeDiscount;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CheckpointItem --
+ *
+ *      The saved state of one item id. lsn is the LSN of the last
+ *      logged mutation reflected in it. valid is 0 if the store did
+ *      not carry the id.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CheckpointItem {
+    int32_t valid;
+    int32_t quantity;
+    double price;
+    double discount;
+    uint64_t lsn;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CheckpointWriter --
+ *
+ *      Writes a checkpoint file: the header, then every item in id
+ *      order. The file is written under a temporary name and only
+ *      renamed over path once it is complete and on disk, so path
+ *      always holds a whole checkpoint.
+ *
+ * ------------------------------------------------------------------
+ */
+class CheckpointWriter {
+    private:
+    int fd;
+    std::string path;
+    std::string tmpPath;
+    std::vector<CheckpointItem> chunk;
+
+    bool flush();
+
+    public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter &) = delete;
+
+    bool begin(const char* path, const CheckpointHeader &header);
+    bool add(const CheckpointItem &item);
+    bool finish();
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CheckpointImage --
+ *
+ *      A checkpoint file mapped read-only into memory. Mapping it
+ *      reads nothing; pages are faulted in as items are looked up.
+ *
+ * ------------------------------------------------------------------
+ */
+class CheckpointImage {
+    private:
+    void* base;
+    size_t length;
+
+    public:
+    CheckpointImage();
+    ~CheckpointImage();
+
+    CheckpointImage(const CheckpointImage&) = delete;
+    CheckpointImage& operator=(const CheckpointImage &) = delete;
+
+    bool map(const char* path, int capacity);
+    bool mapped() const { return base != nullptr; }
+
+    const CheckpointHeader& header() const
+    {
+        return *static_cast<const CheckpointHeader*>(base);
+    }
+
+    const CheckpointItem* items() const
+    {
+        return reinterpret_cast<const CheckpointItem*>(&header() + 1);
+    }
+};
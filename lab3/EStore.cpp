@@ -1,319 +1,3244 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 
+#include "BulkKernels.h"
 #include "EStore.h"
+#include "ShardedStore.h"
 
 using namespace std;
 
 
-Item::
-Item() : valid(false)
-{smutex_init(&itemMtx); }
+EStore::EStore(bool enableFineMode, bool enableOptimistic,
+               bool enableCombining, int numShards, int capacity,
+               bool enablePromotion)
+    : fineMode(enableFineMode || enableOptimistic || enableCombining ||
+               numShards > 0),
+      optimistic(enableOptimistic), combining(enableCombining),
+      promotion(enablePromotion && numShards == 0), sales(capacity),
+      sharded(numShards > 0 ? new ShardedStore(numShards, capacity, &sales)
+                            : nullptr),
+      pricingVersion(0), shippingCost(3.0), storeDiscount(0.0),
+      pricingLsn(0),
+      items(capacity),
+      wal(nullptr), replayLsn(0),
+      totalWaiters(0), wakeStats(), orderCounters(),
+      combineCounters(), hotEvents(), hotStats(),
+      globalOrderWaiters(nullptr), holdWheel(holdTick()), lastHoldToken(0),
+      holdThreadStarted(false), holdsStopping(false), holdCounters()
+{
+    smutex_init(&mtx);
+    smutex_init(&orderWaitMtx);
+    smutex_init(&hotMtx);
+    smutex_init(&holdMtx);
+    scond_init(&holdCond);
+}
+
+EStore::~EStore()
+{
+    smutex_lock(&holdMtx);
+    holdsStopping = true;
+    scond_signal(&holdCond, &holdMtx);
+    smutex_unlock(&holdMtx);
+    if (holdThreadStarted) {
+        sthread_join(holdThread);
+    }
+    for (auto &held : holds) {
+        for (const OrderLine &line : held.second->order) {
+            line.item->pins.fetch_sub(1, memory_order_release);
+        }
+        delete held.second;
+    }
+    smutex_destroy(&holdMtx);
+    scond_destroy(&holdCond);
+
+    delete sharded;
+    delete wal;
+    smutex_destroy(&mtx);
+    smutex_destroy(&orderWaitMtx);
+    smutex_destroy(&hotMtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reclaimItem --
+ *
+ *      Free a removed item for EpochDomain::retire, unless a blocked
+ *      buyer still holds a pin on it.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+reclaimItem(void *object)
+{
+    Item *item = static_cast<Item*>(object);
+    if (item->pins.load(memory_order_acquire) > 0) {
+        return false;
+    }
+    delete item;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reclaimStats --
+ *
+ *      Return how many removed items were retired and freed.
+ *
+ * ------------------------------------------------------------------
+ */
+ReclaimStats EStore::reclaimStats()
+{
+    return epochs.stats();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * openLog --
+ *
+ *      Recover the store from the write-ahead log at path, then log
+ *      every later mutation to it. Call before the store is shared
+ *      with other threads. Not supported in sharded mode.
+ *
+ *      A mutation is logged while it is applied, under the lock that
+ *      orders it, and the method that made it returns only after its
+ *      records are on disk; concurrent callers share the fdatasync
+ *      (see WriteAheadLog).
+ *
+ * Results:
+ *      false if the log could not be opened.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::openLog(const char* path)
+{
+    assert(sharded == nullptr && wal == nullptr);
+
+    // Only what the checkpoint (if any) may not reflect is read.
+    uint64_t from = 0;
+    if (image.mapped()) {
+        if (!image.header().logged) {
+            fprintf(stderr, "EStore: cannot replay %s: the checkpoint "
+                    "was taken without a log\n", path);
+            return false;
+        }
+        from = image.header().lsn;
+    }
+
+    WriteAheadLog *log = new WriteAheadLog();
+    vector<WalRecord> records;
+    if (!log->open(path, from, records)) {
+        delete log;
+        return false;
+    }
+
+    // Replay with logging still off.
+    for (size_t i = 0; i < records.size(); i++) {
+        replayLsn = from + i + 1;
+        if (!replayed(records[i], replayLsn)) {
+            replay(records[i]);
+        }
+    }
+    replayLsn = 0;
+    wal = log;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replayed --
+ *
+ *      Return whether the record with the given LSN is already
+ *      reflected in the checkpoint the store was restored from.
+ *
+ *      A checkpoint is taken while the store keeps changing, so it
+ *      does not show the store as of any one LSN. Each saved item
+ *      (and the saved pricing) does carry the LSN of the last
+ *      mutation it reflects, though, and everything up to the
+ *      checkpoint's own LSN was reflected before it began.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::replayed(const WalRecord &record, uint64_t lsn)
+{
+    if (!image.mapped()) {
+        return false;
+    }
+    if (lsn <= image.header().lsn) {
+        return true;
+    }
+    if (record.type == WAL_PRICING) {
+        return lsn <= pricingLsn.load(memory_order_relaxed);
+    }
+    EpochGuard guard(epochs);
+    Item *item = items.find(record.item_id);
+    return item != nullptr && lsn <= item->lsn().load(memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replay --
+ *
+ *      Apply one recovered record to the store.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::replay(const WalRecord &record)
+{
+    switch (record.type) {
+    case WAL_ADD_ITEM:
+        addItem(record.item_id, record.count, record.price, record.discount);
+        break;
+    case WAL_REMOVE_ITEM:
+        removeItem(record.item_id);
+        break;
+    case WAL_ADD_STOCK:
+        addStock(record.item_id, record.count);
+        break;
+    case WAL_PRICE_ITEM:
+        priceItem(record.item_id, record.price);
+        break;
+    case WAL_DISCOUNT_ITEM:
+        discountItem(record.item_id, record.discount);
+        break;
+    case WAL_PRICING:
+        smutex_lock(&mtx);
+        publishPricing(record.price, record.discount);
+        smutex_unlock(&mtx);
+        break;
+    case WAL_BUY: {
+        EpochGuard guard(epochs);
+        Item *item = items.inRange(record.item_id) ?
+            items.find(record.item_id) : nullptr;
+        if (item == nullptr) {
+            break;
+        }
+        smutex_t *lock = acquireItem(*item);
+        item->beginUpdate();
+        item->quantity() -= record.count;
+        item->lsn().store(replayLsn, memory_order_relaxed);
+        item->endUpdate();
+        smutex_unlock(lock);
+        break;
+    }
+    default:
+        assert(false);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * logMutation --
+ *
+ *      Append a record describing a mutation that is being applied,
+ *      if the store has a log. Caller must hold the lock that orders
+ *      the mutation.
+ *
+ * Results:
+ *      The record's LSN, or while the log is being replayed, the LSN
+ *      of the record being replayed. 0 without a log.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t EStore::logMutation(WalRecordType type, int item_id, int count,
+                             double price, double discount)
+{
+    if (wal == nullptr) {
+        return replayLsn;
+    }
+    WalRecord record = WalRecord();
+    record.type = type;
+    record.item_id = item_id;
+    record.count = count;
+    record.price = price;
+    record.discount = discount;
+    return wal->append(record);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * logItemMutation --
+ *
+ *      logMutation for a change to one item, which also becomes the
+ *      item's lsn. Caller must be inside the item's update window.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::logItemMutation(Item &item, WalRecordType type, int count,
+                             double price, double discount)
+{
+    item.lsn().store(logMutation(type, item.id, count, price, discount),
+                     memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commitLog --
+ *
+ *      Wait until the mutations the calling thread logged are on
+ *      disk. Called without any lock held, just before returning.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::commitLog()
+{
+    if (wal != nullptr) {
+        wal->commit();
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commitCombined --
+ *
+ *      Like commitLog, for an operation another thread applied (and
+ *      so logged) on our behalf.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::commitCombined(const CombineOp &op)
+{
+    if (wal != nullptr && op.logged) {
+        wal->syncAll();
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * walStats --
+ *
+ *      Return how many records were logged and how many flushes it
+ *      took to make them durable.
+ *
+ * ------------------------------------------------------------------
+ */
+WalStats EStore::walStats()
+{
+    return wal != nullptr ? wal->stats() : WalStats();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * openCheckpoint --
+ *
+ *      Restore the store from the checkpoint at path. Call first, on
+ *      a new store, and before openLog, which then only replays the
+ *      mutations the checkpoint does not reflect. Not supported in
+ *      sharded mode.
+ *
+ *      The file is mapped rather than read: the store is serviceable
+ *      as soon as this returns, however many items it holds, and
+ *      each item is loaded by its first lookup (see ItemTable).
+ *
+ * Results:
+ *      false if path holds no checkpoint for a store of this size.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::openCheckpoint(const char* path)
+{
+    assert(sharded == nullptr && wal == nullptr && !image.mapped());
+    if (!image.map(path, items.size())) {
+        return false;
+    }
+
+    const CheckpointHeader &header = image.header();
+    smutex_lock(&mtx);
+    publishPricing(header.shippingCost, header.storeDiscount);
+    pricingLsn.store(header.pricingLsn, memory_order_relaxed);
+    smutex_unlock(&mtx);
+    items.attachImage(image.items());
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * checkpoint --
+ *
+ *      Save every item, and the store-wide pricing, to a checkpoint
+ *      file at path, replacing the one there. Not supported in
+ *      sharded mode.
+ *
+ *      This runs alongside any other operation and takes none of
+ *      the locks they hold for long: each item is copied as a
+ *      seqlock snapshot, like a quote, and only an empty slot takes
+ *      its shard's lock (see saveItem). The items are therefore not
+ *      all saved as of the same instant, which is why each one is
+ *      saved with its LSN (see replayed).
+ *
+ * Results:
+ *      false if the checkpoint could not be written.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::checkpoint(const char* path)
+{
+    assert(sharded == nullptr);
+
+    // Taken first: every mutation logged up to here is reflected in
+    // what is read below.
+    CheckpointHeader header = CheckpointHeader();
+    header.magic = CHECKPOINT_MAGIC;
+    header.layout = CHECKPOINT_LAYOUT;
+    header.capacity = items.size();
+    header.logged = wal != nullptr;
+    header.lsn = wal != nullptr ? wal->appendedLsn() : 0;
+
+    Pricing pricing;
+    do {
+        pricing = readPricing();
+        header.pricingLsn = pricingLsn.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while (!pricingUnchanged(pricing));
+    header.shippingCost = pricing.shippingCost;
+    header.storeDiscount = pricing.storeDiscount;
+
+    CheckpointWriter writer;
+    if (!writer.begin(path, header)) {
+        return false;
+    }
+    for (int id = 0; id < items.size(); id++) {
+        if (!writer.add(saveItem(id))) {
+            return false;
+        }
+    }
+    // Recovery replays the log from header.lsn on, but the items
+    // saved above may already reflect mutations logged after it.
+    // Every record appended so far must be on disk before the
+    // checkpoint is, or a crash could keep half of an order whose
+    // record was lost.
+    if (wal != nullptr) {
+        wal->syncAll();
+    }
+    return writer.finish();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * saveItem --
+ *
+ *      Return a consistent copy of the item with this id for a
+ *      checkpoint. Held units are saved as stock: holds do not
+ *      survive a restart (see reserve).
+ *
+ *      Items in the table are read as seqlock snapshots, without a
+ *      lock. An empty slot is read again under its shard's lock:
+ *      insertItem logs a new item before publishing it, so without
+ *      the lock an item whose ADD_ITEM record is older than the
+ *      checkpoint's LSN (and so is not replayed) could be saved as
+ *      not carried.
+ *
+ * ------------------------------------------------------------------
+ */
+CheckpointItem EStore::saveItem(int item_id)
+{
+    EpochGuard guard(epochs);
+    const CheckpointItem *pending = items.pendingImage(item_id);
+    Item *item = items.findLoaded(item_id);
+    if (item == nullptr) {
+        ItemShard *shard = items.shard(item_id);
+        smutex_lock(&shard->mtx);
+        pending = items.pendingImage(item_id);
+        item = items.findLoaded(item_id);
+        smutex_unlock(&shard->mtx);
+    }
+    if (item == nullptr) {
+        // Still as the last checkpoint left it, or not carried.
+        return pending != nullptr ? *pending : CheckpointItem();
+    }
+
+    CheckpointItem saved;
+    while (true) {
+        unsigned version = item->version.load(memory_order_acquire);
+        if (version & 1) {
+            sthread_yield();
+            continue;
+        }
+        saved.valid = item->valid.load(memory_order_relaxed);
+        saved.quantity = item->quantity().load(memory_order_relaxed) +
+                         item->held().load(memory_order_relaxed);
+        saved.price = item->price().load(memory_order_relaxed);
+        saved.discount = item->discount().load(memory_order_relaxed);
+        saved.lsn = item->lsn().load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (item->version.load(memory_order_relaxed) == version) {
+            return saved;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unitCost --
+ *
+ *      Return what one unit of the item costs under the given
+ *      store-wide pricing: its price after the item and store
+ *      discounts, plus shipping. Caller must hold the item's lock.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::unitCost(const Item &item, const Pricing &pricing) const
+{
+    return item.price() * (1 - item.discount()) * (1 - pricing.storeDiscount) +
+           pricing.shippingCost;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readPricing --
+ *
+ *      Read the shipping cost and store discount as one consistent
+ *      snapshot, without taking a lock. The store-wide setters
+ *      publish through a seqlock (see publishPricing), so retry
+ *      while a change is in progress or if one happened during the
+ *      read.
+ *
+ * Results:
+ *      The snapshot, tagged with the version it was read at.
+ *
+ * ------------------------------------------------------------------
+ */
+Pricing EStore::readPricing() const
+{
+    Pricing pricing;
+    while (true) {
+        pricing.version = pricingVersion.load(memory_order_acquire);
+        if (pricing.version & 1) {
+            sthread_yield();
+            continue;
+        }
+        pricing.shippingCost = shippingCost.load(memory_order_relaxed);
+        pricing.storeDiscount = storeDiscount.load(memory_order_relaxed);
+        if (pricingUnchanged(pricing)) {
+            return pricing;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pricingUnchanged --
+ *
+ *      Return whether the store-wide pricing is still the snapshot
+ *      that was read.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::pricingUnchanged(const Pricing &pricing) const
+{
+    atomic_thread_fence(memory_order_acquire);
+    return pricingVersion.load(memory_order_relaxed) == pricing.version;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * publishPricing --
+ *
+ *      Replace the store-wide pricing. The version is odd while the
+ *      two values are being written. Caller must hold mtx, which
+ *      serializes writers.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::publishPricing(double newShippingCost, double newStoreDiscount)
+{
+    unsigned version = pricingVersion.load(memory_order_relaxed);
+    pricingVersion.store(version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    shippingCost.store(newShippingCost, memory_order_relaxed);
+    storeDiscount.store(newStoreDiscount, memory_order_relaxed);
+    pricingLsn.store(logMutation(WAL_PRICING, 0, 0, newShippingCost,
+                                 newStoreDiscount), memory_order_relaxed);
+    pricingVersion.store(version + 2, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeItemWaiters --
+ *
+ *      Called after a change to the item that may let blocked
+ *      customers buy it. If the item was removed, wake all of its
+ *      waiters so they can give up. Otherwise, if it is in stock,
+ *      wake only the waiters whose budget now covers the item's
+ *      unit cost; the waiter list is sorted by budget, so this
+ *      stops at the first one that still cannot afford it.
+ *
+ *      In coarse mode, every other blocked customer would have been
+ *      woken by a broadcast on a store-wide condition variable, so
+ *      count them as avoided wakeups. Caller must hold the item's
+ *      lock.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::wakeItemWaiters(Item &item)
+{
+    int woken = signalItemWaiters(item, readPricing());
+    if (!fineMode) {
+        wakeStats.avoidedWakeups += totalWaiters - woken;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signalItemWaiters --
+ *
+ *      The targeted part of wakeItemWaiters, under the given
+ *      pricing, without the statistics.
+ *
+ * Results:
+ *      The number of waiters woken.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::signalItemWaiters(Item &item, const Pricing &pricing)
+{
+    if (!item.valid) {
+        return signalWaiters(item.waitList);
+    }
+    if (item.quantity() > 0) {
+        return signalAffordableWaiters(item.waitList, unitCost(item, pricing),
+                                       item.quantity());
+    }
+    return 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeAffordableWaiters --
+ *
+ *      Called after a store-wide price drop. Only customers blocked
+ *      on an item that is still carried and in stock, and whose
+ *      budget covers its new unit cost, can possibly buy it now, so
+ *      wake those and leave everyone else asleep. Caller must hold
+ *      mtx.
+ *
+ *      In fine mode, signal the global list of blocked orders.
+ *
+ * Results:
+ *      The number of waiters woken, for the caller to pass to
+ *      finishBulk.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::wakeAffordableWaiters()
+{
+    if (fineMode) {
+        smutex_lock(&orderWaitMtx);
+        int woken = signalWaiters(globalOrderWaiters);
+        smutex_unlock(&orderWaitMtx);
+        return woken;
+    }
+
+    Pricing pricing = readPricing();
+    int woken = 0;
+    for (int s = 0; s < ITEM_TABLE_SHARDS; s++) {
+        if (items.shardAt(s)->waiters == 0) {
+            continue;
+        }
+        for (int id = s; id < items.size(); id += ITEM_TABLE_SHARDS) {
+            // Items with waiters were loaded by them.
+            Item *item = items.findLoaded(id);
+            if (item != nullptr && item->waiters > 0 && item->valid &&
+                item->quantity() > 0) {
+                woken += signalAffordableWaiters(item->waitList,
+                                                 unitCost(*item, pricing),
+                                                 item->quantity());
+            }
+        }
+    }
+    return woken;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeupStats --
+ *
+ *      Return a copy of the wakeup counters.
+ *
+ * ------------------------------------------------------------------
+ */
+WakeupStats EStore::wakeupStats()
+{
+    smutex_lock(&mtx);
+    WakeupStats stats = wakeStats;
+    smutex_unlock(&mtx);
+    return stats;
+}
+
+
+/*
+ * ------------------------------------------------------------------
+ * buyItem --
+ *
+ *      Attempt to buy the item from the store.
+ *
+ *      An item can be bought if:
+ *          - The store carries it.
+ *          - The item is in stock.
+ *          - The cost of the item plus the cost of shipping is no
+ *            more than the budget.
+ *
+ *      If the store *does not* carry this item, simply return and
+ *      do nothing. Do not attempt to buy the item.
+ *
+ *      If the store *does* carry the item, but it is not in stock
+ *      or its cost is over budget, block until both conditions are
+ *      met (at which point the item should be bought) or the store
+ *      removes the item from sale (at which point this method
+ *      returns).
+ *
+ *      The overall cost of a purchase for a single item is defined
+ *      as the current cost of the item times 1 - the store
+ *      discount, plus the flat overall store shipping fee.
+ *
+ *      A purchase that can go through right away does not take
+ *      mtx (see tryBuyItem). Only a customer that has to wait does.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::buyItem(int item_id, double budget)
+{
+    buyItemWaiting(item_id, budget, nullptr);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemUntil --
+ *
+ *      Like buyItem, but give up waiting at deadline (see
+ *      sthread_deadline), so that a request that cannot be met
+ *      does not hold on to the calling thread. The item is checked
+ *      once more after the deadline passes; an abandoned wait is
+ *      counted in WakeupStats::timeouts.
+ *
+ * Results:
+ *      PURCHASE_BOUGHT, PURCHASE_NOT_CARRIED if the store does not
+ *      carry the item (or stopped carrying it while we waited), or
+ *      PURCHASE_TIMED_OUT.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus EStore::buyItemUntil(int item_id, double budget,
+                                    const struct timespec &deadline)
+{
+    return buyItemWaiting(item_id, budget, &deadline);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemWaiting --
+ *
+ *      Buy the item as described for buyItem, waiting until
+ *      deadline at most if it is not null.
+ *
+ * Results:
+ *      See buyItemUntil.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus EStore::buyItemWaiting(int item_id, double budget,
+                                      const struct timespec* deadline)
+{
+    assert(!fineModeEnabled());
+
+    Item *found;
+    BuyResult result;
+    {
+        EpochGuard guard(epochs);
+
+        //item not in store
+        found = items.find(item_id);
+        if (found == nullptr) {
+            sales.recordFailure(item_id);
+            return PURCHASE_NOT_CARRIED;
+        }
+
+        // Fast path: in stock and affordable, no lock needed.
+        result = promotion ? tryBuyContended(*found, budget)
+                           : tryBuyItem(*found, budget);
+        if (result == BUY_NOT_CARRIED) {
+            sales.recordFailure(item_id);
+            return PURCHASE_NOT_CARRIED;
+        }
+        if (result == BUY_DONE) {
+            commitLog();
+            return PURCHASE_BOUGHT;
+        }
+
+        // We may sleep, so keep the item alive with a pin rather
+        // than by staying in the epoch.
+        found->pins++;
+    }
+
+    Item &item = *found;
+    ItemShard *shard = items.shard(item_id);
+    Waiter waiter(1);
+    WaiterLink *link = &waiter.links[0];
+    link->unitBudget = budget;
+    bool woken = false;
+    bool expired = false;
+
+    // Everything that can make the item buyable (or removed) happens
+    // under mtx, and the buyers that race with us on the fast path
+    // only ever take stock away. So a BUY_MUST_WAIT decided while
+    // holding mtx stays true until someone who will wake us changes
+    // the item.
+    smutex_lock(&mtx);
+    while ((result = tryBuyItem(item, budget)) == BUY_MUST_WAIT) {
+        if (expired) {
+            wakeStats.timeouts++;
+            break;
+        }
+        if (woken) {
+            wakeStats.spuriousWakeups++;
+        }
+        wakeStats.waits++;
+        waiter.signaled = false;
+        linkWaiter(&item.waitList, link);
+        item.waiters++;
+        shard->waiters++;
+        totalWaiters++;
+
+        smutex_unlock(&mtx);
+        woken = waiter.wait(deadline);
+        expired = !woken;
+        smutex_lock(&mtx);
+
+        unlinkWaiter(&item.waitList, link);
+        item.waiters--;
+        shard->waiters--;
+        totalWaiters--;
+        if (woken) {
+            wakeStats.wakeups++;
+        }
+    }
+    smutex_unlock(&mtx);
+    if (result != BUY_DONE) {
+        sales.recordFailure(item_id);
+    }
+    item.pins.fetch_sub(1, memory_order_release);
+    commitLog();
+    return result == BUY_DONE ? PURCHASE_BOUGHT :
+           result == BUY_NOT_CARRIED ? PURCHASE_NOT_CARRIED :
+           PURCHASE_TIMED_OUT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryBuyItem --
+ *
+ *      Try to buy one unit of the item without blocking and without
+ *      taking mtx.
+ *
+ *      Read the item's fields and the store-wide pricing as
+ *      seqlock snapshots. If the snapshot says the item can be
+ *      bought, claim the item by moving its version from the one
+ *      that was read to odd with a compare-and-swap: that only
+ *      succeeds if nobody changed the item since the read. Check
+ *      that the pricing did not change either, take the unit, and
+ *      release the item with endUpdate. If anything changed, read
+ *      again.
+ *
+ * Results:
+ *      BUY_DONE if a unit was bought, BUY_NOT_CARRIED if the item
+ *      was removed from sale, and BUY_MUST_WAIT if it is out of
+ *      stock or over budget. *contended, if given, is set if
+ *      another thread got in the way and the item had to be read
+ *      again.
+ *
+ * ------------------------------------------------------------------
+ */
+BuyResult EStore::tryBuyItem(Item &item, double budget, bool* contended)
+{
+    for (bool retry = false; true; retry = true) {
+        if (retry && contended != nullptr) {
+            *contended = true;
+        }
+        Pricing pricing = readPricing();
+        unsigned version = item.version.load(memory_order_acquire);
+        if (version & 1) {
+            sthread_yield();
+            continue;
+        }
+        bool valid = item.valid.load(memory_order_relaxed);
+        int quantity = item.quantity().load(memory_order_relaxed);
+        double cost = item.price().load(memory_order_relaxed) *
+                      (1 - item.discount().load(memory_order_relaxed)) *
+                      (1 - pricing.storeDiscount) + pricing.shippingCost;
+        atomic_thread_fence(memory_order_acquire);
+        if (item.version.load(memory_order_relaxed) != version) {
+            continue;
+        }
+
+        if (!valid) {
+            return BUY_NOT_CARRIED;
+        }
+        if (quantity == 0 || cost > budget) {
+            return BUY_MUST_WAIT;
+        }
+        if (!item.tryBeginUpdate(version)) {
+            continue;
+        }
+        if (!pricingUnchanged(pricing)) {
+            item.endUpdate();
+            continue;
+        }
+        item.quantity().store(quantity - 1, memory_order_relaxed);
+        logItemMutation(item, WAL_BUY, 1, 0.0, 0.0);
+        item.endUpdate();
+        sales.recordSale(item.id, 1, cost);
+        return BUY_DONE;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryBuyContended --
+ *
+ *      tryBuyItem for the lock-free path of a coarse store with
+ *      promotion enabled. The buyers of a promoted item line up on
+ *      its dedicated lock and take turns, instead of all retrying
+ *      their compare-and-swap against each other. The lock guards
+ *      nothing else: suppliers still change the item under mtx.
+ *
+ *      A buyer that found the dedicated lock busy, or had to retry
+ *      on an item that is not promoted, counts as contention (see
+ *      noteContention), and the item is promoted or demoted
+ *      accordingly.
+ *
+ * Results:
+ *      As for tryBuyItem.
+ *
+ * ------------------------------------------------------------------
+ */
+BuyResult EStore::tryBuyContended(Item &item, double budget)
+{
+    HotItem *hot = promotedTo(item);
+    bool busy = false;
+    BuyResult result;
+    if (hot != nullptr) {
+        busy = !smutex_trylock(&hot->mtx);
+        if (busy) {
+            smutex_lock(&hot->mtx);
+        }
+        result = tryBuyItem(item, budget);
+        smutex_unlock(&hot->mtx);
+    } else {
+        result = tryBuyItem(item, budget, &busy);
+    }
+
+    int heat = noteContention(item, busy);
+    if (hot == nullptr && heat >= HOT_ITEM_PROMOTE) {
+        setPromoted(item, hotSlot(item), true);
+    } else if (hot != nullptr && heat == 0) {
+        setPromoted(item, hot, false);
+    }
+    return result;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItem --
+ *
+ *      Attempt to buy all of the specified items at once. If the
+ *      order cannot be bought, give up and return without buying
+ *      anything. Otherwise buy the entire order at once.
+ *
+ *      The entire order can be bought if:
+ *          - The store carries all items.
+ *          - All items are in stock.
+ *          - The cost of the the entire order (cost of items plus
+ *            shipping for each item) is no more than the budget.
+ *
+ *      If multiple customers are attempting to buy at the same
+ *      time and their orders are mutually exclusive (i.e., the
+ *      two customers are not trying to buy any of the same items),
+ *      then their orders must be processed at the same time.
+ *
+ *      The whole order is priced with one consistent snapshot of
+ *      the store discount and shipping cost, and is only bought if
+ *      that snapshot is still current when it commits (see
+ *      tryTakeOrder).
+ *
+ *      The cost of a purchase of many items is the sum of the
+ *      costs of purchasing each item individually. The purchase
+ *      cost of an individual item is covered above in the
+ *      description of buyItem.
+ *
+ *      Challenge: For bonus points, implement a version of this
+ *      method that will wait until the order can be fulfilled
+ *      instead of giving up. The implementation should be efficient
+ *      in that it should not wake up threads unecessarily. For
+ *      instance, if an item decreases in price, only threads that
+ *      are waiting to buy an order that includes that item should be
+ *      signaled (though all such threads should be signaled).
+ *
+ *      Challenge: For bonus points, ensure that the shipping cost
+ *      and store discount does not change while processing an
+ *      order.
+ *
+ *      An id listed more than once buys that many units of the
+ *      item.
+ *
+ * Results:
+ *      true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::buyManyItems(vector<int>* item_ids, double budget)
+{
+    bool bought;
+    if (sharded != nullptr) {
+        bought = sharded->buyManyItems(*item_ids, budget);
+    } else {
+        assert(fineModeEnabled());
+
+        EpochGuard guard(epochs);
+        vector<OrderLine> order;
+        bought = prepareOrder(*item_ids, order) &&
+                 (optimistic ? buyOrderOptimistic(order, budget)
+                             : buyOrderLocked(order, budget));
+    }
+
+    if (bought) {
+        commitLog();
+    } else {
+        recordFailedOrder(*item_ids);
+    }
+    return bought;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyOrderLocked --
+ *
+ *      Buy a canonical order while holding the locks of all of its
+ *      items for the whole cost computation.
+ *
+ * Results:
+ *      true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::buyOrderLocked(const vector<OrderLine> &order, double budget)
+{
+    Pricing pricing;
+    if (order.size() == 1) {
+        // The one lock can be flat-combined.
+        Item &item = *order[0].item;
+        CombineOp op(COMBINE_BUY);
+        op.order = &order;
+        op.budget = budget;
+        if (!lockItem(item, op)) {
+            commitCombined(op);
+            return op.bought;
+        }
+        bool bought = item.valid && tryTakeOrder(order, budget, pricing);
+        unlockItem(item);
+        return bought;
+    }
+
+    lockOrder(order);
+    bool bought = orderCarried(order) && tryTakeOrder(order, budget, pricing);
+    unlockOrder(order);
+    return bought;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * orderCarried / orderBuyable / takeOrder --
+ *
+ *      Check whether the store carries every item of a canonical
+ *      order, check whether the order is in stock and within the
+ *      budget under the given pricing, and take the order's units
+ *      out of stock, counting them as sold at that pricing. Caller
+ *      must hold the locks of all of the order's items.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::orderCarried(const vector<OrderLine> &order)
+{
+    for (const OrderLine &line : order) {
+        if (!line.item->valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool EStore::orderBuyable(const vector<OrderLine> &order,
+                          const Pricing &pricing, double budget)
+{
+    double totalCost = 0.0;
+    for (const OrderLine &line : order) {
+        Item &item = *line.item;
+        if (item.quantity() < line.count) {
+            return false;
+        }
+        totalCost += line.count * unitCost(item, pricing);
+    }
+    return totalCost <= budget;
+}
+
+void EStore::takeOrder(const vector<OrderLine> &order, const Pricing &pricing)
+{
+    for (const OrderLine &line : order) {
+        line.item->beginUpdate();
+        line.item->quantity() -= line.count;
+        logItemMutation(*line.item, WAL_BUY, line.count, 0.0, 0.0);
+        line.item->endUpdate();
+        sales.recordSale(line.item_id, line.count,
+                         line.count * unitCost(*line.item, pricing));
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * recordFailedOrder --
+ *
+ *      Count a failed purchase attempt against every distinct item
+ *      of an order.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::recordFailedOrder(const vector<int> &item_ids)
+{
+    vector<int> ids(item_ids);
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    for (int id : ids) {
+        sales.recordFailure(id);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryTakeOrder --
+ *
+ *      Buy a canonical order if it is in stock and within budget.
+ *      The whole order is priced with one snapshot of the store-wide
+ *      pricing, and the purchase only goes through if that snapshot
+ *      is still current when the units are taken; otherwise the
+ *      order is priced again. Caller must hold the locks of all of
+ *      the order's items.
+ *
+ * Results:
+ *      true if the order was bought. pricing is the snapshot the
+ *      decision was made with.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::tryTakeOrder(const vector<OrderLine> &order, double budget,
+                          Pricing &pricing)
+{
+    while (true) {
+        pricing = readPricing();
+        if (!orderBuyable(order, pricing, budget)) {
+            return false;
+        }
+        if (pricingUnchanged(pricing)) {
+            takeOrder(order, pricing);
+            return true;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * versionsUnchanged --
+ *
+ *      Return whether every item of the order still has the version
+ *      recorded for it in versions.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+versionsUnchanged(const vector<OrderLine> &order,
+                  const vector<unsigned> &versions)
+{
+    atomic_thread_fence(memory_order_acquire);
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i].item->version.load(memory_order_relaxed) != versions[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readOrder --
+ *
+ *      Read every item of a canonical order without taking a lock,
+ *      recording each item's version in versions, and price the
+ *      order with the given pricing snapshot.
+ *
+ * Results:
+ *      false if an item changed while it was being read, in which
+ *      case the snapshot is meaningless. Otherwise true: the items
+ *      had the values in snapshot all at the same instant.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::readOrder(const vector<OrderLine> &order, const Pricing &pricing,
+                       vector<unsigned> &versions, OrderSnapshot &snapshot)
+{
+    snapshot.carried = true;
+    snapshot.inStock = true;
+    snapshot.cost = 0.0;
+    for (size_t i = 0; i < order.size(); i++) {
+        Item &item = *order[i].item;
+        unsigned version;
+        while ((version = item.version.load(memory_order_acquire)) & 1) {
+            // A writer is in the middle of changing the item.
+            sthread_yield();
+        }
+        versions[i] = version;
+        if (!item.valid.load(memory_order_relaxed)) {
+            snapshot.carried = false;
+        }
+        if (item.quantity().load(memory_order_relaxed) < order[i].count) {
+            snapshot.inStock = false;
+        }
+        snapshot.cost += order[i].count *
+                         (item.price().load(memory_order_relaxed) *
+                          (1 - item.discount().load(memory_order_relaxed)) *
+                          (1 - pricing.storeDiscount) + pricing.shippingCost);
+    }
+    return versionsUnchanged(order, versions);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyOrderOptimistic --
+ *
+ *      Buy a canonical order without holding any lock while its
+ *      cost is computed.
+ *
+ *      Read phase: read every item of the order along with its
+ *      version, then check that no version changed. If none did,
+ *      all the values were current at the same instant, so an
+ *      order that is out of stock or over budget can be turned
+ *      down right away without taking a single lock. That is the
+ *      common case.
+ *
+ *      Commit phase: lock the items (in the global order) and check
+ *      that their versions are still the ones read. If so, nothing
+ *      changed since the read phase and the units can be taken
+ *      out. Otherwise unlock, count an abort and retry.
+ *
+ *      After OPTIMISTIC_RETRIES aborts, fall back to buyOrderLocked
+ *      so that a heavily updated order still makes progress.
+ *
+ * Results:
+ *      true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::buyOrderOptimistic(const vector<OrderLine> &order, double budget)
+{
+    vector<unsigned> versions(order.size());
+
+    orderCounters.orders++;
+    for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+        Pricing pricing = readPricing();
+        OrderSnapshot snapshot;
+        if (!readOrder(order, pricing, versions, snapshot)) {
+            orderCounters.aborts++;
+            continue;
+        }
+
+        if (!snapshot.carried || !snapshot.inStock ||
+            snapshot.cost > budget) {
+            orderCounters.rejected++;
+            return false;
+        }
+
+        lockOrder(order);
+        if (!versionsUnchanged(order, versions) ||
+            !pricingUnchanged(pricing)) {
+            unlockOrder(order);
+            orderCounters.aborts++;
+            continue;
+        }
+
+        takeOrder(order, pricing);
+        unlockOrder(order);
+        orderCounters.commits++;
+        return true;
+    }
+
+    orderCounters.fallbacks++;
+    bool bought = buyOrderLocked(order, budget);
+    if (bought) {
+        orderCounters.commits++;
+    } else {
+        orderCounters.rejected++;
+    }
+    return bought;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * orderStats --
+ *
+ *      Return a copy of the optimistic order counters.
+ *
+ * ------------------------------------------------------------------
+ */
+OrderStats EStore::orderStats()
+{
+    if (sharded != nullptr) {
+        return sharded->orderStats();
+    }
+
+    OrderStats stats;
+    stats.orders = orderCounters.orders;
+    stats.commits = orderCounters.commits;
+    stats.rejected = orderCounters.rejected;
+    stats.aborts = orderCounters.aborts;
+    stats.fallbacks = orderCounters.fallbacks;
+    stats.waits = orderCounters.waits;
+    stats.wakeups = orderCounters.wakeups;
+    stats.spuriousWakeups = orderCounters.spuriousWakeups;
+    stats.timeouts = orderCounters.timeouts;
+    return stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * combineStats --
+ *
+ *      Return a copy of the flat-combining counters.
+ *
+ * ------------------------------------------------------------------
+ */
+CombineStats EStore::combineStats()
+{
+    CombineStats stats;
+    stats.published = combineCounters.published;
+    stats.passes = combineCounters.passes;
+    stats.applied = combineCounters.applied;
+    return stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemSales / topSellers / revenueByInterval --
+ *
+ *      Return what was sold of one item, the n items that brought
+ *      in the most revenue (most first), and the revenue of each of
+ *      the last intervals SALES_INTERVAL_NS intervals (the current
+ *      one first). None of them blocks buyers; sales made while
+ *      they run may or may not be counted.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemSales EStore::itemSales(int item_id)
+{
+    return sales.item(item_id);
+}
+
+vector<ItemSales> EStore::topSellers(int n)
+{
+    return sales.top(n);
+}
+
+vector<double> EStore::revenueByInterval(int intervals)
+{
+    return sales.revenue(intervals);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * promoteItem / demoteItem --
+ *
+ *      Give an item its dedicated lock ahead of time, say before a
+ *      sale on it starts, or take it away. Only with promotion
+ *      enabled. The item's contention counter is set as if it had
+ *      just become hot (cold), so a promoted item is demoted after
+ *      HOT_ITEM_PROMOTE uncontended acquisitions at the earliest.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::promoteItem(int item_id)
+{
+    if (!promotion) {
+        return;
+    }
+
+    EpochGuard guard(epochs);
+    Item *item = items.find(item_id);
+    if (item == nullptr) {
+        return;
+    }
+    item->contention.store(HOT_ITEM_PROMOTE, memory_order_relaxed);
+    if (!fineMode) {
+        setPromoted(*item, hotSlot(*item), true);
+        return;
+    }
+
+    smutex_t *stripe = items.lock(item_id);
+    smutex_lock(stripe);
+    if (promotedTo(*item) == nullptr) {
+        HotItem *hot = hotSlot(*item);
+        smutex_lock(&hot->mtx);
+        setPromoted(*item, hot, true);
+        smutex_unlock(&hot->mtx);
+    }
+    smutex_unlock(stripe);
+}
+
+void EStore::demoteItem(int item_id)
+{
+    if (!promotion) {
+        return;
+    }
+
+    EpochGuard guard(epochs);
+    Item *item = items.find(item_id);
+    if (item == nullptr) {
+        return;
+    }
+    item->contention.store(0, memory_order_relaxed);
+    HotItem *hot = promotedTo(*item);
+    if (!fineMode) {
+        if (hot != nullptr) {
+            setPromoted(*item, hot, false);
+        }
+        return;
+    }
+
+    smutex_t *stripe = items.lock(item_id);
+    smutex_lock(stripe);
+    hot = promotedTo(*item);
+    if (hot != nullptr) {
+        smutex_lock(&hot->mtx);
+        setPromoted(*item, hot, false);
+        smutex_unlock(&hot->mtx);
+    }
+    smutex_unlock(stripe);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hotItems / hotItemEvents / hotItemStats --
+ *
+ *      Return the ids of the items that are promoted right now, in
+ *      increasing order; the latest promotions and demotions (at
+ *      most HOT_ITEM_EVENTS), oldest first; and how many there have
+ *      been in all.
+ *
+ * ------------------------------------------------------------------
+ */
+vector<int> EStore::hotItems()
+{
+    smutex_lock(&hotMtx);
+    vector<int> ids(hotIds);
+    smutex_unlock(&hotMtx);
+
+    // Items removed while promoted are still listed.
+    EpochGuard guard(epochs);
+    vector<int> hot;
+    for (int id : ids) {
+        Item *item = items.find(id);
+        if (item != nullptr && promotedTo(*item) != nullptr) {
+            hot.push_back(id);
+        }
+    }
+    sort(hot.begin(), hot.end());
+    return hot;
+}
+
+vector<HotItemEvent> EStore::hotItemEvents()
+{
+    smutex_lock(&hotMtx);
+    long total = hotStats.promotions + hotStats.demotions;
+    vector<HotItemEvent> events;
+    for (long e = max(0L, total - HOT_ITEM_EVENTS); e < total; e++) {
+        events.push_back(hotEvents[e % HOT_ITEM_EVENTS]);
+    }
+    smutex_unlock(&hotMtx);
+    return events;
+}
+
+HotItemStats EStore::hotItemStats()
+{
+    smutex_lock(&hotMtx);
+    HotItemStats stats = hotStats;
+    smutex_unlock(&hotMtx);
+    return stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reserve --
+ *
+ *      Take the given items out of stock for one customer for
+ *      ttlNanos nanoseconds, without buying them. Until the hold is
+ *      committed (and the units bought), released, or it expires,
+ *      nobody else can buy them. A released or expired hold puts
+ *      its units back in stock and wakes the blocked buyers they
+ *      can serve, as addStock would.
+ *
+ *      Each hold pins its items and is filed in holdWheel by the
+ *      tick it expires at, so an outstanding hold costs a few words
+ *      and a slot-list link whatever its ttl. Holds are not logged:
+ *      after a restart, held units are back in stock (see saveItem),
+ *      and a commit is logged as a purchase.
+ *
+ * Results:
+ *      The hold's token, or 0 if the store does not carry one of
+ *      the items or does not have enough of them in stock.
+ *
+ * ------------------------------------------------------------------
+ */
+HoldToken EStore::reserve(const vector<int> &item_ids, long ttlNanos)
+{
+    assert(sharded == nullptr);
+
+    Hold *hold = new Hold();
+    bool reserved;
+    {
+        EpochGuard guard(epochs);
+        reserved = prepareOrder(item_ids, hold->order);
+        if (reserved) {
+            lockHold(hold->order);
+            reserved = orderCarried(hold->order);
+            // In coarse mode, lock-free buyers (see tryBuyItem) take
+            // stock without mtx, so check each line's stock only
+            // once its update has begun and shut them out, and put
+            // back the lines taken if a later one falls short. They
+            // only ever take stock away, so nobody blocked on an
+            // item can miss the units put back.
+            size_t taken = 0;
+            for (const OrderLine &line : hold->order) {
+                if (!reserved) {
+                    break;
+                }
+                line.item->beginUpdate();
+                reserved = line.item->quantity() >= line.count;
+                if (reserved) {
+                    line.item->quantity() -= line.count;
+                    line.item->held() += line.count;
+                    taken++;
+                }
+                line.item->endUpdate();
+            }
+            for (size_t i = 0; i < hold->order.size(); i++) {
+                const OrderLine &line = hold->order[i];
+                if (reserved) {
+                    line.item->pins++;
+                } else if (i < taken) {
+                    line.item->beginUpdate();
+                    line.item->quantity() += line.count;
+                    line.item->held() -= line.count;
+                    line.item->endUpdate();
+                }
+            }
+            unlockHold(hold->order);
+        }
+    }
+    if (!reserved) {
+        delete hold;
+        return 0;
+    }
+
+    uint64_t expires = holdTick() + max(ttlNanos, 0L) / HOLD_TICK_NS + 1;
+    smutex_lock(&holdMtx);
+    HoldToken token = hold->token = ++lastHoldToken;
+    holds[token] = hold;
+    bool sooner = expires < holdWheel.nextEvent();
+    holdWheel.schedule(hold, expires);
+    if (!holdThreadStarted) {
+        holdThreadStarted = true;
+        sthread_create(&holdThread, expireHolds, this);
+    } else if (sooner) {
+        scond_signal(&holdCond, &holdMtx);
+    }
+    smutex_unlock(&holdMtx);
+    holdCounters.reserved++;
+    return token;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commit --
+ *
+ *      Buy the units of an outstanding hold, at the prices of the
+ *      moment, whatever the customer's budget. If one of its items
+ *      was removed since, the hold is released instead, as an
+ *      order with a removed item is not bought.
+ *
+ * Results:
+ *      true if the units were bought; false if the hold was not
+ *      outstanding or was released.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::commit(HoldToken token)
+{
+    Hold *hold = claimHold(token);
+    if (hold == nullptr) {
+        return false;
+    }
+
+    lockHold(hold->order);
+    bool carried = orderCarried(hold->order);
+    if (carried) {
+        Pricing pricing = readPricing();
+        for (const OrderLine &line : hold->order) {
+            line.item->beginUpdate();
+            line.item->held() -= line.count;
+            logItemMutation(*line.item, WAL_BUY, line.count, 0.0, 0.0);
+            line.item->endUpdate();
+            sales.recordSale(line.item_id, line.count,
+                             line.count * unitCost(*line.item, pricing));
+        }
+        for (const OrderLine &line : hold->order) {
+            line.item->pins.fetch_sub(1, memory_order_release);
+        }
+        unlockHold(hold->order);
+        delete hold;
+        holdCounters.committed++;
+        commitLog();
+        return true;
+    }
+    unlockHold(hold->order);
+
+    returnHold(hold);
+    holdCounters.released++;
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * release --
+ *
+ *      Give the units of an outstanding hold back to the store.
+ *
+ * Results:
+ *      false if the hold was not outstanding.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::release(HoldToken token)
+{
+    Hold *hold = claimHold(token);
+    if (hold == nullptr) {
+        return false;
+    }
+    returnHold(hold);
+    holdCounters.released++;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * holdStats --
+ *
+ *      Return a copy of the hold counters (see HoldStats).
+ *
+ * ------------------------------------------------------------------
+ */
+HoldStats EStore::holdStats()
+{
+    HoldStats stats;
+    stats.reserved = holdCounters.reserved;
+    stats.committed = holdCounters.committed;
+    stats.released = holdCounters.released;
+    stats.expired = holdCounters.expired;
+    smutex_lock(&holdMtx);
+    stats.outstanding = holds.size();
+    smutex_unlock(&holdMtx);
+    return stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * holdTick --
+ *
+ *      Return the current tick of the hold wheel: the monotonic
+ *      clock (which scond_timedwait waits on) in HOLD_TICK_NS.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t EStore::holdTick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) / HOLD_TICK_NS;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * expireHolds --
+ *
+ *      The hold thread. The argument is the store.
+ *
+ *      Sleep until the wheel's next event (or until woken for an
+ *      earlier one), advance the wheel to the current tick, and
+ *      give back the holds that expired. The holds are taken out of
+ *      the table under holdMtx, so a racing commit or release finds
+ *      them gone, and their units are returned after letting go of
+ *      it.
+ *
+ * Results:
+ *      Returns when the store is destroyed.
+ *
+ * ------------------------------------------------------------------
+ */
+void* EStore::expireHolds(void* arg)
+{
+    EStore *store = static_cast<EStore*>(arg);
+    vector<WheelTimer*> expired;
+
+    smutex_lock(&store->holdMtx);
+    while (!store->holdsStopping) {
+        uint64_t next = store->holdWheel.nextEvent();
+        if (next == UINT64_MAX) {
+            scond_wait(&store->holdCond, &store->holdMtx);
+        } else if (next > holdTick()) {
+            uint64_t ns = next * HOLD_TICK_NS;
+            struct timespec deadline;
+            deadline.tv_sec = ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            scond_timedwait(&store->holdCond, &store->holdMtx, &deadline);
+        }
+        if (store->holdsStopping) {
+            break;
+        }
+
+        store->holdWheel.advance(holdTick(), expired);
+        if (expired.empty()) {
+            continue;
+        }
+        for (WheelTimer *timer : expired) {
+            store->holds.erase(static_cast<Hold*>(timer)->token);
+        }
+        smutex_unlock(&store->holdMtx);
+
+        for (WheelTimer *timer : expired) {
+            store->returnHold(static_cast<Hold*>(timer));
+        }
+        store->holdCounters.expired += expired.size();
+        expired.clear();
+        smutex_lock(&store->holdMtx);
+    }
+    smutex_unlock(&store->holdMtx);
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockHold / unlockHold --
+ *
+ *      Take (release) what protects the items of a hold: the
+ *      store monitor lock in coarse mode, the items' locks in fine
+ *      mode (see lockOrder).
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::lockHold(const vector<OrderLine> &order)
+{
+    if (fineMode) {
+        lockOrder(order);
+    } else {
+        smutex_lock(&mtx);
+    }
+}
+
+void EStore::unlockHold(const vector<OrderLine> &order)
+{
+    if (fineMode) {
+        unlockOrder(order);
+    } else {
+        smutex_unlock(&mtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * claimHold --
+ *
+ *      Take an outstanding hold out of the table and the wheel, so
+ *      that the caller alone settles it.
+ *
+ * Results:
+ *      The hold, or null if it is not outstanding.
+ *
+ * ------------------------------------------------------------------
+ */
+Hold* EStore::claimHold(HoldToken token)
+{
+    smutex_lock(&holdMtx);
+    auto found = holds.find(token);
+    Hold *hold = nullptr;
+    if (found != holds.end()) {
+        hold = found->second;
+        holds.erase(found);
+        holdWheel.cancel(hold);
+    }
+    smutex_unlock(&holdMtx);
+    return hold;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * returnHold --
+ *
+ *      Put the units of a claimed hold back in stock, wake the
+ *      buyers blocked on its items that they can now serve, and
+ *      free the hold. Items removed since get nothing back.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::returnHold(Hold* hold)
+{
+    lockHold(hold->order);
+    for (const OrderLine &line : hold->order) {
+        Item &item = *line.item;
+        if (!item.valid) {
+            continue;
+        }
+        item.beginUpdate();
+        item.quantity() += line.count;
+        item.held() -= line.count;
+        item.endUpdate();
+        wakeItemWaiters(item);
+    }
+    unlockHold(hold->order);
+
+    for (const OrderLine &line : hold->order) {
+        line.item->pins.fetch_sub(1, memory_order_release);
+    }
+    delete hold;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsBlocking --
+ *
+ *      Like buyManyItems, but if the store carries every item of
+ *      the order and the order cannot be bought yet, block until it
+ *      can (and buy it) or until one of its items is removed from
+ *      sale (and return without buying anything).
+ *
+ *      A blocked customer registers a Waiter. The waiter is linked
+ *      into the waiter list of every item of the order (see
+ *      linkOrderWaiter), so a restock, removal, price drop or
+ *      discount increase on an item signals only orders that
+ *      include it and that the change may bring within budget. It
+ *      is also linked into the global waiter list, which is
+ *      signaled when the shipping cost drops or the store discount
+ *      rises.
+ *
+ *      The order is checked and the waiter registered while holding
+ *      all of the order's item locks, so a change to one of the
+ *      items cannot be missed. For store-wide changes the final
+ *      check happens under orderWaitMtx, which the store-wide
+ *      setters take before signaling.
+ *
+ * Results:
+ *      true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::buyManyItemsBlocking(vector<int>* item_ids, double budget)
+{
+    return buyManyItemsWaiting(item_ids, budget, nullptr) == PURCHASE_BOUGHT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsUntil --
+ *
+ *      Like buyManyItemsBlocking, but give up waiting at deadline
+ *      (see buyItemUntil). An abandoned wait is counted in
+ *      OrderStats::timeouts.
+ *
+ * Results:
+ *      PURCHASE_BOUGHT, PURCHASE_NOT_CARRIED if the store does not
+ *      carry one of the items, or PURCHASE_TIMED_OUT.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus EStore::buyManyItemsUntil(vector<int>* item_ids, double budget,
+                                         const struct timespec &deadline)
+{
+    return buyManyItemsWaiting(item_ids, budget, &deadline);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsWaiting --
+ *
+ *      Buy the items as described for buyManyItemsBlocking,
+ *      waiting until deadline at most if it is not null.
+ *
+ * Results:
+ *      See buyManyItemsUntil.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus EStore::buyManyItemsWaiting(vector<int>* item_ids,
+                                           double budget,
+                                           const struct timespec* deadline)
+{
+    if (sharded != nullptr) {
+        PurchaseStatus status =
+            sharded->buyManyItemsBlocking(*item_ids, budget, deadline);
+        if (status != PURCHASE_BOUGHT) {
+            recordFailedOrder(*item_ids);
+        }
+        return status;
+    }
+
+    assert(fineModeEnabled());
+
+    vector<OrderLine> order;
+    {
+        EpochGuard guard(epochs);
+        if (!prepareOrder(*item_ids, order)) {
+            recordFailedOrder(*item_ids);
+            return PURCHASE_NOT_CARRIED;
+        }
+
+        if (optimistic && buyOrderOptimistic(order, budget)) {
+            commitLog();
+            return PURCHASE_BOUGHT;
+        }
+
+        // We may sleep, so keep the items alive with pins rather
+        // than by staying in the epoch.
+        for (const OrderLine &line : order) {
+            line.item->pins++;
+        }
+    }
+
+    PurchaseStatus status = buyOrderBlocking(order, budget, deadline);
+    for (const OrderLine &line : order) {
+        line.item->pins.fetch_sub(1, memory_order_release);
+    }
+    if (status == PURCHASE_BOUGHT) {
+        commitLog();
+    } else {
+        recordFailedOrder(*item_ids);
+    }
+    return status;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyOrderBlocking --
+ *
+ *      Buy a canonical order, waiting until it is in stock and
+ *      within budget, or until deadline if it is not null. Once the
+ *      deadline passes the order is tried once more before giving
+ *      up. Caller must hold a pin on every item of the order.
+ *
+ * Results:
+ *      PURCHASE_BOUGHT, PURCHASE_NOT_CARRIED if the store does not
+ *      carry one of the items, or PURCHASE_TIMED_OUT.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus EStore::buyOrderBlocking(const vector<OrderLine> &order,
+                                        double budget,
+                                        const struct timespec* deadline)
+{
+    Waiter waiter(order.size() + 1);
+    WaiterLink *globalLink = &waiter.links.back();
+    bool woken = false;
+    bool expired = false;
+
+    lockOrder(order);
+    while (true) {
+        if (!orderCarried(order)) {
+            unlockOrder(order);
+            return PURCHASE_NOT_CARRIED;
+        }
+
+        Pricing pricing;
+        bool bought = tryTakeOrder(order, budget, pricing);
+        if (!bought && expired) {
+            orderCounters.timeouts++;
+            unlockOrder(order);
+            return PURCHASE_TIMED_OUT;
+        }
+        if (!bought) {
+            smutex_lock(&orderWaitMtx);
+            bought = tryTakeOrder(order, budget, pricing);
+            if (!bought) {
+                waiter.signaled = false;
+                linkWaiter(&globalOrderWaiters, globalLink);
+                linkOrderWaiter(order, pricing, budget, waiter);
+            }
+            smutex_unlock(&orderWaitMtx);
+        }
+        if (bought) {
+            unlockOrder(order);
+            return PURCHASE_BOUGHT;
+        }
+
+        if (woken) {
+            orderCounters.spuriousWakeups++;
+        }
+        orderCounters.waits++;
+        unlockOrder(order);
+
+        woken = waiter.wait(deadline);
+        expired = !woken;
+        if (woken) {
+            orderCounters.wakeups++;
+        }
+
+        lockOrder(order);
+        for (size_t i = 0; i < order.size(); i++) {
+            unlinkWaiter(&order[i].item->waitList, &waiter.links[i]);
+        }
+        smutex_lock(&orderWaitMtx);
+        unlinkWaiter(&globalOrderWaiters, globalLink);
+        smutex_unlock(&orderWaitMtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * linkOrderWaiter --
+ *
+ *      Link a blocked order into the waiter list of each of its
+ *      items. The unitBudget of the link for an item is what is
+ *      left of the budget after paying for the rest of the order at
+ *      today's prices, per unit of the item, so a change to the
+ *      item alone only wakes the order if it brings the whole order
+ *      within budget. It is rounded up a little, so that rounding
+ *      errors can only cause a spurious wakeup, never a lost one.
+ *
+ *      The rest of the order may get cheaper too, though, and two
+ *      cuts that are each too small for their own item's link can
+ *      together bring the order within budget. So the link of an
+ *      order with more than one item also covers anything below
+ *      the item's unit cost today: any cost drop on one of its
+ *      items wakes the order, which then links itself again at the
+ *      new prices. Caller must hold the locks of all of the order's
+ *      items.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::linkOrderWaiter(const vector<OrderLine> &order,
+                             const Pricing &pricing, double budget,
+                             Waiter &waiter)
+{
+    vector<double> unit(order.size());
+    vector<double> lineCost(order.size());
+    double totalCost = 0.0;
+    for (size_t i = 0; i < order.size(); i++) {
+        unit[i] = unitCost(*order[i].item, pricing);
+        lineCost[i] = order[i].count * unit[i];
+        totalCost += lineCost[i];
+    }
+
+    for (size_t i = 0; i < order.size(); i++) {
+        WaiterLink *link = &waiter.links[i];
+        link->count = order[i].count;
+        link->unitBudget = (budget - (totalCost - lineCost[i])) /
+                           order[i].count + BUDGET_SLACK;
+        if (order.size() > 1) {
+            link->unitBudget = max(link->unitBudget,
+                                   nextafter(unit[i], -HUGE_VAL));
+        }
+        linkWaiter(&order[i].item->waitList, link);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * prepareOrder --
+ *
+ *      Turn a customer's list of item ids into a canonical order:
+ *      one OrderLine per distinct id, sorted by id, counting how
+ *      many times the id was listed. Lookups go through the item
+ *      table without a lock; slots never move, so the Item
+ *      pointers stay valid.
+ *
+ * Results:
+ *      false if the store never carried one of the items.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::prepareOrder(const vector<int> &item_ids, vector<OrderLine> &order)
+{
+    vector<int> ids(item_ids);
+    sort(ids.begin(), ids.end());
+
+    order.clear();
+    for (int id : ids) {
+        if (!order.empty() && order.back().item_id == id) {
+            order.back().count++;
+            continue;
+        }
+        Item *item = items.find(id);
+        if (item == nullptr) {
+            return false;
+        }
+        order.push_back(OrderLine{id, 1, item});
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * orderLocks --
+ *
+ *      Return the indices of the lock stripes of the items of an
+ *      order, in increasing order and without duplicates: items
+ *      whose ids share a stripe share its lock.
+ *
+ * ------------------------------------------------------------------
+ */
+static vector<int>
+orderLocks(const vector<OrderLine> &order)
+{
+    vector<int> stripes;
+    stripes.reserve(order.size());
+    for (const OrderLine &line : order) {
+        stripes.push_back(ItemTable::lockIndex(line.item_id));
+    }
+    sort(stripes.begin(), stripes.end());
+    stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+    return stripes;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockOrder / unlockOrder --
+ *
+ *      Acquire (release) the locks of every item in a canonical
+ *      order. Lock stripes are always taken in increasing index
+ *      order, and then the dedicated locks of promoted items (see
+ *      promotedLocks), which is the one global order for holding
+ *      more than one item lock, so overlapping orders cannot
+ *      deadlock.
+ *
+ * ------------------------------------------------------------------
+ */
+static vector<Item*>
+orderItems(const vector<OrderLine> &order)
+{
+    vector<Item*> found;
+    found.reserve(order.size());
+    for (const OrderLine &line : order) {
+        found.push_back(line.item);
+    }
+    return found;
+}
+
+void EStore::lockOrder(const vector<OrderLine> &order)
+{
+    for (int stripe : orderLocks(order)) {
+        smutex_lock(items.lockAt(stripe));
+    }
+    if (promotion) {
+        for (smutex_t *lock : promotedLocks(orderItems(order))) {
+            smutex_lock(lock);
+        }
+    }
+}
+
+void EStore::unlockOrder(const vector<OrderLine> &order)
+{
+    if (combining) {
+        for (const OrderLine &line : order) {
+            combinePending(*line.item);
+        }
+    }
+    if (promotion) {
+        vector<smutex_t*> locks = promotedLocks(orderItems(order));
+        for (auto it = locks.rbegin(); it != locks.rend(); ++it) {
+            smutex_unlock(*it);
+        }
+    }
+    vector<int> stripes = orderLocks(order);
+    for (auto it = stripes.rbegin(); it != stripes.rend(); ++it) {
+        smutex_unlock(items.lockAt(*it));
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryLockCurrent / lockCurrent --
+ *
+ *      Take the item's lock, whichever it is (see itemLock). If the
+ *      item was promoted or demoted while we went for the lock we
+ *      read, that is no longer its lock: let go and take the new
+ *      one.
+ *
+ * Results:
+ *      tryLockCurrent returns false, holding nothing, if the lock
+ *      was busy.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::tryLockCurrent(Item &item)
+{
+    while (true) {
+        smutex_t *lock = itemLock(&item);
+        if (!smutex_trylock(lock)) {
+            return false;
+        }
+        if (itemLock(&item) == lock) {
+            return true;
+        }
+        smutex_unlock(lock);
+    }
+}
+
+void EStore::lockCurrent(Item &item)
+{
+    while (true) {
+        smutex_t *lock = itemLock(&item);
+        smutex_lock(lock);
+        if (itemLock(&item) == lock) {
+            return;
+        }
+        smutex_unlock(lock);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * acquireItem --
+ *
+ *      Take the item's lock. With promotion enabled in fine mode,
+ *      try it first, count whether it was busy, and promote or
+ *      demote the item if that made it hot or cool (see retuneItem).
+ *
+ * Results:
+ *      The lock now held, to release with smutex_unlock.
+ *
+ * ------------------------------------------------------------------
+ */
+smutex_t* EStore::acquireItem(Item &item)
+{
+    if (!promotion || !fineMode) {
+        lockCurrent(item);
+        return itemLock(&item);
+    }
+
+    bool busy = !tryLockCurrent(item);
+    if (busy) {
+        lockCurrent(item);
+    }
+    noteContention(item, busy);
+    return retuneItem(item);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * noteContention --
+ *
+ *      Count one acquisition of the item's lock (or, for a coarse
+ *      store's lock-free buyers, one attempt to buy it): the item's
+ *      contention counter goes up, to at most HOT_ITEM_PROMOTE, if
+ *      it was busy, and down, to no less than zero, if not. The
+ *      counter is updated without a read-modify-write and may lose
+ *      counts; it only needs to say roughly how hot the item is.
+ *
+ * Results:
+ *      The new value of the counter.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::noteContention(Item &item, bool busy)
+{
+    int heat = item.contention.load(memory_order_relaxed);
+    if (busy && heat < HOT_ITEM_PROMOTE) {
+        heat++;
+    } else if (!busy && heat > 0) {
+        heat--;
+    }
+    item.contention.store(heat, memory_order_relaxed);
+    return heat;
+}
 
-Item::
-~Item()
-{smutex_destroy(&itemMtx); }
+/*
+ * ------------------------------------------------------------------
+ * retuneItem --
+ *
+ *      Promote the item to its dedicated lock if its contention
+ *      counter reached HOT_ITEM_PROMOTE, or demote it back to its
+ *      lock stripe if the counter dropped to zero. Fine mode only;
+ *      caller holds the item's lock.
+ *
+ *      The flag that says which lock protects the item is only
+ *      changed by a thread holding both of them, so whoever holds
+ *      either one can rely on it. The promoter holds the stripe,
+ *      takes the dedicated lock, sets the flag and lets go of the
+ *      stripe. The demoter holds the dedicated lock and needs the
+ *      stripe, but stripes come before dedicated locks in the lock
+ *      order, so it only tries; the next acquisition tries again.
+ *
+ * Results:
+ *      The lock the caller holds on return: the item's lock as it
+ *      now is.
+ *
+ * ------------------------------------------------------------------
+ */
+smutex_t* EStore::retuneItem(Item &item)
+{
+    int heat = item.contention.load(memory_order_relaxed);
+    HotItem *hot = promotedTo(item);
+    smutex_t *stripe = items.lock(item.id);
 
+    if (hot == nullptr && heat >= HOT_ITEM_PROMOTE) {
+        hot = hotSlot(item);
+        smutex_lock(&hot->mtx);
+        setPromoted(item, hot, true);
+        smutex_unlock(stripe);
+        return &hot->mtx;
+    }
+    if (hot != nullptr && heat == 0 && smutex_trylock(stripe)) {
+        setPromoted(item, hot, false);
+        smutex_unlock(&hot->mtx);
+        return stripe;
+    }
+    return hot != nullptr ? &hot->mtx : stripe;
+}
 
-EStore::EStore(bool enableFineMode)
-    : fineMode(enableFineMode), shippingCost(3.0), storeDiscount(0.0)
+/*
+ * ------------------------------------------------------------------
+ * hotSlot --
+ *
+ *      Return the item's HotItem, allocating it the first time.
+ *
+ * ------------------------------------------------------------------
+ */
+HotItem* EStore::hotSlot(Item &item)
 {
-    smutex_init(&mtx);
-    scond_init(&cond);
+    HotItem *hot = item.hot.load(memory_order_acquire);
+    if (hot == nullptr) {
+        HotItem *fresh = new HotItem();
+        if (item.hot.compare_exchange_strong(hot, fresh,
+                                             memory_order_acq_rel)) {
+            hot = fresh;
+        } else {
+            delete fresh;
+        }
+    }
+    return hot;
 }
 
-EStore::~EStore()
+/*
+ * ------------------------------------------------------------------
+ * setPromoted --
+ *
+ *      Switch the item's dedicated lock on or off, and record the
+ *      event. In fine mode, caller holds both the stripe and the
+ *      dedicated lock. Nothing happens if the lock already was.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::setPromoted(Item &item, HotItem* hot, bool promoted)
 {
-    smutex_destroy(&mtx);
-    scond_destroy(&cond);
+    if (hot->active.exchange(promoted, memory_order_acq_rel) == promoted) {
+        return;
+    }
+
+    long now = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    smutex_lock(&hotMtx);
+    long events = hotStats.promotions + hotStats.demotions;
+    hotEvents[events % HOT_ITEM_EVENTS] = HotItemEvent{item.id, promoted, now};
+    auto listed = find(hotIds.begin(), hotIds.end(), item.id);
+    if (promoted) {
+        hotStats.promotions++;
+        if (listed == hotIds.end()) {
+            hotIds.push_back(item.id);
+        }
+    } else {
+        hotStats.demotions++;
+        if (listed != hotIds.end()) {
+            hotIds.erase(listed);
+        }
+    }
+    smutex_unlock(&hotMtx);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * promotedLocks --
+ *
+ *      Return the dedicated locks of the promoted items among found
+ *      (which may hold nulls and repeats), without duplicates and
+ *      in the order they must be taken in: after every lock stripe,
+ *      by address. Caller holds the stripes of all of the items, so
+ *      none of them can be promoted or demoted meanwhile.
+ *
+ * ------------------------------------------------------------------
+ */
+vector<smutex_t*> EStore::promotedLocks(const vector<Item*> &found)
+{
+    vector<smutex_t*> locks;
+    for (Item *item : found) {
+        HotItem *hot = item != nullptr ? promotedTo(*item) : nullptr;
+        if (hot != nullptr) {
+            locks.push_back(&hot->mtx);
+        }
+    }
+    sort(locks.begin(), locks.end());
+    locks.erase(unique(locks.begin(), locks.end()), locks.end());
+    return locks;
+}
 
 /*
  * ------------------------------------------------------------------
- * buyItem --
+ * lockItem --
  *
- *      Attempt to buy the item from the store.
+ *      Acquire the lock of one item in order to apply op to it.
  *
- *      An item can be bought if:
- *          - The store carries it.
- *          - The item is in stock.
- *          - The cost of the item plus the cost of shipping is no
- *            more than the budget.
+ *      In combining mode, the item's contention counter goes up each
+ *      time its lock is found busy and down each time it is found
+ *      free. Once it reaches HOT_ITEM_CONTENTION the item is hot:
+ *      rather than queueing for the lock, op is pushed onto the
+ *      item's combineList, and the thread waits for the lock holder
+ *      to apply it in unlockItem, or takes the lock itself if it
+ *      comes free first and applies every published operation,
+ *      including its own. A hot item's lock is thus handed over
+ *      once per batch of operations rather than once per operation,
+ *      and its fields stay in the cache of the combining thread.
  *
- *      If the store *does not* carry this item, simply return and
- *      do nothing. Do not attempt to buy the item.
+ * Results:
+ *      true if the caller now holds the item's lock and must apply
+ *      op itself (and call unlockItem). false if op has already
+ *      been applied by a combiner; its results are in op.
  *
- *      If the store *does* carry the item, but it is not in stock
- *      or its cost is over budget, block until both conditions are
- *      met (at which point the item should be bought) or the store
- *      removes the item from sale (at which point this method
- *      returns).
+ * ------------------------------------------------------------------
+ */
+bool EStore::lockItem(Item &item, CombineOp &op)
+{
+    if (!combining) {
+        acquireItem(item);
+        return true;
+    }
+
+    int heat = item.contention.load(memory_order_relaxed);
+    bool busy = !tryLockCurrent(item);
+    noteContention(item, busy);
+    if (!busy || heat < HOT_ITEM_CONTENTION) {
+        if (busy) {
+            lockCurrent(item);
+        }
+        if (promotion) {
+            retuneItem(item);
+        }
+        return true;
+    }
+
+    combineCounters.published++;
+    op.done.store(false, memory_order_relaxed);
+    op.next = item.combineList.load(memory_order_relaxed);
+    while (!item.combineList.compare_exchange_weak(
+               op.next, &op, memory_order_release, memory_order_relaxed)) {
+    }
+
+    while (!op.done.load(memory_order_acquire)) {
+        if (tryLockCurrent(item)) {
+            // op was published before we got the lock, so this
+            // applies it if nobody else has.
+            combinePending(item);
+            smutex_unlock(itemLock(&item));
+        } else {
+            sthread_yield();
+        }
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockItem --
  *
- *      The overall cost of a purchase for a single item is defined
- *      as the current cost of the item times 1 - the store
- *      discount, plus the flat overall store shipping fee.
+ *      Release the lock of one item, first applying any operations
+ *      published on it while the lock was held.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::unlockItem(Item &item)
+{
+    if (combining) {
+        combinePending(item);
+    }
+    smutex_unlock(itemLock(&item));
+}
+
+/*
+ * ------------------------------------------------------------------
+ * combinePending --
+ *
+ *      Apply every operation published on the item, oldest first,
+ *      and then wake the item's waiters once if any of them could
+ *      have made the item buyable. Caller must hold the item's lock.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::combinePending(Item &item)
+{
+    CombineOp *list = item.combineList.exchange(nullptr, memory_order_acquire);
+    if (list == nullptr) {
+        return;
+    }
+
+    // The list is newest first.
+    CombineOp *ops = nullptr;
+    while (list != nullptr) {
+        CombineOp *next = list->next;
+        list->next = ops;
+        ops = list;
+        list = next;
+    }
+
+    bool wake = false;
+    long applied = 0;
+    while (ops != nullptr) {
+        // The publisher may reuse op as soon as it is done.
+        CombineOp *op = ops;
+        ops = op->next;
+        wake |= applyCombined(item, *op);
+        op->done.store(true, memory_order_release);
+        applied++;
+    }
+    if (wake) {
+        wakeItemWaiters(item);
+    }
+    combineCounters.passes++;
+    combineCounters.applied += applied;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyCombined --
+ *
+ *      Apply one published operation, as buyOrderLocked, addStock
+ *      or priceItem would have. Caller must hold the item's lock.
+ *
+ * Results:
+ *      true if the item's waiters need waking.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::applyCombined(Item &item, CombineOp &op)
+{
+    if (op.kind == COMBINE_BUY) {
+        Pricing pricing;
+        op.bought = item.valid && tryTakeOrder(*op.order, op.budget, pricing);
+        op.logged = op.bought;
+        return false;
+    }
+    if (!item.valid) {
+        return false;
+    }
+
+    bool wake = false;
+    item.beginUpdate();
+    if (op.kind == COMBINE_ADD_STOCK) {
+        item.quantity() += op.count;
+        logItemMutation(item, WAL_ADD_STOCK, op.count, 0.0, 0.0);
+        wake = true;
+    } else {
+        wake = op.price < item.price();
+        item.price() = op.price;
+        logItemMutation(item, WAL_PRICE_ITEM, 0, op.price, 0.0);
+    }
+    op.logged = true;
+    item.endUpdate();
+    return wake;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * carries --
+ *
+ *      Return whether the store currently carries the item.
+ *
+ * Results:
+ *      true if the item was added and has not been removed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::carries(int item_id)
+{
+    if (sharded != nullptr) {
+        return sharded->carries(item_id);
+    }
+
+    EpochGuard guard(epochs);
+    Item *item = items.find(item_id);
+    if (item == nullptr) {
+        return false;
+    }
+
+    smutex_t *lock = acquireItem(*item);
+    bool valid = item->valid;
+    smutex_unlock(lock);
+    return valid;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quote --
+ *
+ *      Return what buying one unit of the item would cost right
+ *      now, without buying it. See quoteMany.
+ *
+ * Results:
+ *      false if the store does not carry the item. Otherwise true,
+ *      and the cost is stored in *cost.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::quote(int item_id, double* cost)
+{
+    vector<int> ids(1, item_id);
+    return quoteMany(ids, cost);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quoteMany --
+ *
+ *      Return what buying the given items at once (as buyManyItems
+ *      would) would cost right now, whether or not they are in
+ *      stock, without buying them.
+ *
+ *      Quotes never take a lock and never write to shared memory:
+ *      the items and the store-wide pricing are read as seqlock
+ *      snapshots, and read again if a writer got in the way. Any
+ *      number of quotes can run alongside each other and alongside
+ *      suppliers and buyers. This works in both coarse and fine
+ *      mode.
+ *
+ * Results:
+ *      false if the store does not carry one of the items.
+ *      Otherwise true, and the cost is stored in *cost.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::quoteMany(const vector<int> &item_ids, double* cost)
+{
+    if (sharded != nullptr) {
+        return sharded->quoteMany(item_ids, cost);
+    }
+
+    EpochGuard guard(epochs);
+    vector<OrderLine> order;
+    if (!prepareOrder(item_ids, order)) {
+        return false;
+    }
+
+    vector<unsigned> versions(order.size());
+    OrderSnapshot snapshot;
+    while (true) {
+        Pricing pricing = readPricing();
+        if (readOrder(order, pricing, versions, snapshot) &&
+            pricingUnchanged(pricing)) {
+            break;
+        }
+    }
+
+    if (!snapshot.carried) {
+        return false;
+    }
+    *cost = snapshot.cost;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * addItem --
+ *
+ *      Add the item to the store with the specified quantity,
+ *      price, and discount. If the store already carries an item
+ *      with the specified id, do nothing.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::addItem(int item_id, int quantity, double price, double discount)
+{
+    if (sharded != nullptr) {
+        sharded->addItem(item_id, quantity, price, discount);
+        return;
+    }
+
+    insertItem(item_id, quantity, price, discount);
+    commitLog();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * insertItem --
+ *
+ *      The work of addItem, without waiting for the log.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::insertItem(int item_id, int quantity, double price,
+                        double discount)
+{
+    if (!items.inRange(item_id)) {
+        return;
+    }
+
+    // Only insertions and removals in the same shard are serialized
+    // here; updates to items that are already present never take
+    // the shard lock.
+    ItemShard *shard = items.shard(item_id);
+    smutex_lock(&shard->mtx);
+    if (items.findLocked(item_id) != nullptr) {
+        smutex_unlock(&shard->mtx);
+        return;
+    }
+
+    // Nobody can see the item before it is published.
+    Item *item = items.newItem(item_id);
+    item->valid = true;
+    item->quantity() = quantity;
+    item->held() = 0;
+    item->price() = price;
+    item->discount() = discount;
+    logItemMutation(*item, WAL_ADD_ITEM, quantity, price, discount);
+    items.publish(item_id, item);
+    smutex_unlock(&shard->mtx);
+
+    epochs.reclaim();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * removeItem --
+ *
+ *      Remove the item from the store. The store no longer carries
+ *      this item. If the store is not carrying this item, do
+ *      nothing.
+ *
+ *      Wake any waiters.
+ *
+ *      The item is unlinked from the table and retired; it is freed
+ *      once no reader can still hold it and no blocked buyer has it
+ *      pinned. The id can then be added again.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::removeItem(int item_id)
+{
+    if (sharded != nullptr) {
+        sharded->removeItem(item_id);
+        return;
+    }
+
+    unlinkItem(item_id);
+    commitLog();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlinkItem --
+ *
+ *      The work of removeItem, without waiting for the log.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::unlinkItem(int item_id)
+{
+    if (!items.inRange(item_id)) {
+        return;
+    }
+
+    ItemShard *shard = items.shard(item_id);
+    smutex_lock(&shard->mtx);
+    Item *item = items.findLocked(item_id);
+    if (item == nullptr) {
+        smutex_unlock(&shard->mtx);
+        return;
+    }
+
+    // Threads that already found the item see it as not carried;
+    // nobody else finds it from here on.
+    smutex_t *lock = acquireItem(*item);
+    item->beginUpdate();
+    item->valid = false;
+    logItemMutation(*item, WAL_REMOVE_ITEM, 0, 0.0, 0.0);
+    item->endUpdate();
+    wakeItemWaiters(*item);
+    items.unlink(item_id);
+    smutex_unlock(lock);
+    smutex_unlock(&shard->mtx);
+
+    epochs.retire(item, reclaimItem);
+}
+
+
+/*
+ * ------------------------------------------------------------------
+ * addStock --
+ *
+ *      Increase the stock of the specified item by count. If the
+ *      store does not carry the item, do nothing. Wake any waiters.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::buyItem(int item_id, double budget)
+void EStore::addStock(int item_id, int count)
 {
-    assert(!fineModeEnabled());
-    smutex_lock(&mtx);
+    if (sharded != nullptr) {
+        sharded->addStock(item_id, count);
+        return;
+    }
 
-    //item not in store
-    if (items.find(item_id) == items.end()) {
-        smutex_unlock(&mtx);
+    EpochGuard guard(epochs);
+    Item *item = items.find(item_id);
+    if (item == nullptr) {
         return;
     }
 
-    Item &item = items[item_id];
-    while (!item.valid || item.quantity == 0 ||
-          (item.price * (1 - item.discount) + shippingCost) > budget) {
-        if (!item.valid) {
-            smutex_unlock(&mtx);
-            return;
-        }
-        scond_wait(&cond, &mtx);
+    CombineOp op(COMBINE_ADD_STOCK);
+    op.count = count;
+    if (!lockItem(*item, op)) {
+        commitCombined(op);
+        return;
+    }
+    if (!item->valid) {
+        unlockItem(*item);
+        return;
     }
 
-    // Buy item
-    item.quantity--;
-    smutex_unlock(&mtx);
+    item->beginUpdate();
+    item->quantity() += count;
+    logItemMutation(*item, WAL_ADD_STOCK, count, 0.0, 0.0);
+    item->endUpdate();
+    wakeItemWaiters(*item);
+    unlockItem(*item);
+    commitLog();
 }
+
 /*
  * ------------------------------------------------------------------
- * buyManyItem --
- *
- *      Attempt to buy all of the specified items at once. If the
- *      order cannot be bought, give up and return without buying
- *      anything. Otherwise buy the entire order at once.
- *
- *      The entire order can be bought if:
- *          - The store carries all items.
- *          - All items are in stock.
- *          - The cost of the the entire order (cost of items plus
- *            shipping for each item) is no more than the budget.
- *
- *      If multiple customers are attempting to buy at the same
- *      time and their orders are mutually exclusive (i.e., the
- *      two customers are not trying to buy any of the same items),
- *      then their orders must be processed at the same time.
- *
- *      For the purposes of this lab, it is OK for the store
- *      discount and shipping cost to change while an order is being
- *      processed.
- *
- *      The cost of a purchase of many items is the sum of the
- *      costs of purchasing each item individually. The purchase
- *      cost of an individual item is covered above in the
- *      description of buyItem.
+ * priceItem --
  *
- *      Challenge: For bonus points, implement a version of this
- *      method that will wait until the order can be fulfilled
- *      instead of giving up. The implementation should be efficient
- *      in that it should not wake up threads unecessarily. For
- *      instance, if an item decreases in price, only threads that
- *      are waiting to buy an order that includes that item should be
- *      signaled (though all such threads should be signaled).
+ *      Change the price on the item. If the store does not carry
+ *      the item, do nothing.
  *
- *      Challenge: For bonus points, ensure that the shipping cost
- *      and store discount does not change while processing an
- *      order.
+ *      If the item price decreased, wake any waiters.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::buyManyItems(vector<int>* item_ids, double budget)
+void EStore::priceItem(int item_id, double price)
 {
-    assert(fineModeEnabled());
-
-    double totalCost = 0.0;
-    vector<Item*> itemsToBuy;
-
-    for (int id : *item_ids) {
-        //item not found
-        if (items.find(id) == items.end()) {
-            return;
-        }
-        Item &item = items[id];
-            
-        //lock mutex
-        smutex_lock(&item.itemMtx);
-        
-        if (!item.valid || item.quantity == 0) {
-            for (Item* it : itemsToBuy) {
-                smutex_unlock(&it->itemMtx);
-            }
-            return;
-        }
-        totalCost += item.price * (1 - item.discount) + shippingCost;
-        itemsToBuy.push_back(&item);
+    if (sharded != nullptr) {
+        sharded->priceItem(item_id, price);
+        return;
     }
 
-    if (totalCost > budget) {
-        for (Item* it : itemsToBuy) {
-            smutex_unlock(&it->itemMtx); 
-        }
+    EpochGuard guard(epochs);
+    Item *found = items.find(item_id);
+    if (found == nullptr) {
         return;
     }
 
-    // Buy all items
-    for (Item *item : itemsToBuy) {
-        item->quantity--;
-        smutex_unlock(&item->itemMtx);
+    CombineOp op(COMBINE_PRICE);
+    op.price = price;
+    if (!lockItem(*found, op)) {
+        commitCombined(op);
+        return;
+    }
+    if (!found->valid) {
+        unlockItem(*found);
+        return;
     }
 
+    Item &item = *found;
+    bool decreased = price < item.price();
+    item.beginUpdate();
+    item.price() = price;
+    logItemMutation(item, WAL_PRICE_ITEM, 0, price, 0.0);
+    item.endUpdate();
+
+    if (decreased) {
+        wakeItemWaiters(item);
+    }
+    unlockItem(item);
+    commitLog();
 }
 
+
 /*
  * ------------------------------------------------------------------
- * addItem --
+ * discountItem --
  *
- *      Add the item to the store with the specified quantity,
- *      price, and discount. If the store already carries an item
- *      with the specified id, do nothing.
+ *      Change the discount on the item. If the store does not carry
+ *      the item, do nothing.
+ *
+ *      If the item discount increased, wake any waiters.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::addItem(int item_id, int quantity, double price, double discount)
+void EStore::discountItem(int item_id, double discount)
 {
-    smutex_lock(&mtx);
-    if (items.find(item_id) != items.end()) {
-        smutex_unlock(&mtx);
+    if (sharded != nullptr) {
+        sharded->discountItem(item_id, discount);
         return;
     }
 
-    Item newItem;
-    newItem.valid = true;
-    newItem.quantity = quantity;
-    newItem.price = price;
-    newItem.discount = discount;
-    items[item_id] = newItem;
-    
-    smutex_unlock(&mtx);
+    EpochGuard guard(epochs);
+    Item *found = items.find(item_id);
+    if (found == nullptr) {
+        return;
+    }
+
+    smutex_t *lock = acquireItem(*found);
+    if (!found->valid) {
+        smutex_unlock(lock);
+        return;
+    }
+
+    Item &item = *found;
+    bool increased = discount > item.discount();
+    item.beginUpdate();
+    item.discount() = discount;
+    logItemMutation(item, WAL_DISCOUNT_ITEM, 0, 0.0, discount);
+    item.endUpdate();
+
+    if (increased) {
+        wakeItemWaiters(item);
+    }
+    smutex_unlock(lock);
+    commitLog();
 }
 
 /*
  * ------------------------------------------------------------------
- * removeItem --
+ * priceItems --
  *
- *      Remove the item from the store. The store no longer carries
- *      this item. If the store is not carrying this item, do
- *      nothing.
+ *      Set the price of every given item (item_ids[i] to prices[i])
+ *      that the store carries. If an id is given more than once, the
+ *      last price counts.
  *
- *      Wake any waiters.
+ *      Bulk updates are applied one BULK_CHUNK-aligned range of ids
+ *      at a time (see updateChunk): one lock round trip and one
+ *      pass of targeted wakeups per chunk, rather than per item,
+ *      and one wait for the log for the whole batch.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::removeItem(int item_id)
+void EStore::priceItems(const vector<int> &item_ids,
+                        const vector<double> &prices)
 {
-    smutex_lock(&mtx);
-    if (items.find(item_id) == items.end()) {
-        smutex_unlock(&mtx);
+    assert(item_ids.size() == prices.size());
+    if (sharded != nullptr) {
+        for (size_t i = 0; i < item_ids.size(); i++) {
+            sharded->priceItem(item_ids[i], prices[i]);
+        }
         return;
     }
 
-    items[item_id].valid = false;
-    scond_broadcast(&cond, &mtx);
-    smutex_unlock(&mtx);
-}
+    // Visit the updates in id order; suppliers usually send them
+    // that way already.
+    vector<size_t> order;
+    order.reserve(item_ids.size());
+    for (size_t i = 0; i < item_ids.size(); i++) {
+        if (items.inRange(item_ids[i])) {
+            order.push_back(i);
+        }
+    }
+    if (!is_sorted(item_ids.begin(), item_ids.end())) {
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return item_ids[a] < item_ids[b];
+        });
+    }
 
+    int woken = 0;
+    BulkChunk chunk;
+    size_t i = 0;
+    while (i < order.size()) {
+        chunk.first = item_ids[order[i]] / BULK_CHUNK * BULK_CHUNK;
+        chunk.end = min(chunk.first + BULK_CHUNK, items.size());
+        chunk.ids.clear();
+        chunk.values.clear();
+        for (; i < order.size() && item_ids[order[i]] < chunk.end; i++) {
+            int id = item_ids[order[i]];
+            if (!chunk.ids.empty() && chunk.ids.back() == id) {
+                chunk.values.back() = prices[order[i]];
+                continue;
+            }
+            chunk.ids.push_back(id);
+            chunk.values.push_back(prices[order[i]]);
+        }
+        woken += updateChunk(BULK_PRICE, 0.0, chunk);
+    }
+    finishBulk(woken);
+}
 
 /*
  * ------------------------------------------------------------------
- * addStock --
+ * discountRange --
  *
- *      Increase the stock of the specified item by count. If the
- *      store does not carry the item, do nothing. Wake any waiters.
+ *      Set the discount of every carried item with an id from first
+ *      to last (inclusive) to discount. See priceItems.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::addStock(int item_id, int count)
+void EStore::discountRange(int first, int last, double discount)
 {
-    smutex_lock(&mtx);
-    if (items.find(item_id) == items.end() || !items[item_id].valid) {
-        smutex_unlock(&mtx);
+    if (sharded != nullptr) {
+        sharded->discountRange(first, last, discount);
         return;
     }
 
-    items[item_id].quantity += count;
-    scond_broadcast(&cond, &mtx);
-    smutex_unlock(&mtx);
+    first = max(first, 0);
+    last = min(last, items.size() - 1);
+    int woken = 0;
+    BulkChunk chunk;
+    for (int lo = first / BULK_CHUNK * BULK_CHUNK; lo <= last;
+         lo += BULK_CHUNK) {
+        chunk.first = max(lo, first);
+        chunk.end = min(lo + BULK_CHUNK, last + 1);
+        carriedIds(chunk);
+        woken += updateChunk(BULK_DISCOUNT, discount, chunk);
+    }
+    finishBulk(woken);
 }
 
 /*
  * ------------------------------------------------------------------
- * priceItem --
- *
- *      Change the price on the item. If the store does not carry
- *      the item, do nothing.
+ * scalePrices --
  *
- *      If the item price decreased, wake any waiters.
+ *      Multiply the price of every carried item by factor. See
+ *      priceItems.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void EStore::priceItem(int item_id, double price)
+void EStore::scalePrices(double factor)
 {
-    smutex_lock(&mtx);
-    if (items.find(item_id) == items.end() || !items[item_id].valid) {
-        smutex_unlock(&mtx);
+    if (sharded != nullptr) {
+        sharded->scalePrices(factor);
         return;
     }
 
-    if (price < items[item_id].price) {
-        scond_broadcast(&cond, &mtx);
+    int woken = 0;
+    BulkChunk chunk;
+    for (int lo = 0; lo < items.size(); lo += BULK_CHUNK) {
+        chunk.first = lo;
+        chunk.end = min(lo + BULK_CHUNK, items.size());
+        carriedIds(chunk);
+        woken += updateChunk(BULK_SCALE, factor, chunk);
     }
-
-    items[item_id].price = price;
-    smutex_unlock(&mtx);
+    finishBulk(woken);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * carriedIds --
+ *
+ *      Set chunk.ids to the ids in [chunk.first, chunk.end) that
+ *      the store carries (or may still load from its checkpoint).
+ *      This only reads the carried column, so empty stretches of a
+ *      large table are skipped cheaply.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::carriedIds(BulkChunk &chunk)
+{
+    const ItemColumns &columns = items.columns();
+    chunk.ids.clear();
+    for (int id = chunk.first; id < chunk.end; id++) {
+        if (columns.carried[id].load(memory_order_relaxed) ||
+            items.pendingImage(id) != nullptr) {
+            chunk.ids.push_back(id);
+        }
+    }
+}
 
 /*
  * ------------------------------------------------------------------
- * discountItem --
+ * updateChunk --
  *
- *      Change the discount on the item. If the store does not carry
- *      the item, do nothing.
+ *      Apply one chunk of a bulk update: BULK_PRICE sets each price
+ *      to chunk.values, BULK_DISCOUNT sets each discount to value,
+ *      BULK_SCALE multiplies each price by value.
  *
- *      If the item discount increased, wake any waiters.
+ *      The locks of the chunk's items are taken once (the chunk's
+ *      ids have distinct lock stripes, in increasing order), and
+ *      every item still carried enters its update window. If that
+ *      is every id of the chunk, the column is changed by one SIMD
+ *      kernel over the contiguous range; otherwise item by item.
+ *      The changes are logged with one append. Then, still under
+ *      the locks, only the waiters of items whose unit cost went
+ *      down, and whose budget now covers it, are signalled.
  *
  * Results:
- *      None.
+ *      The number of waiters woken.
  *
  * ------------------------------------------------------------------
  */
-void EStore::discountItem(int item_id, double discount)
+int EStore::updateChunk(BulkKind kind, double value, const BulkChunk &chunk)
 {
-    smutex_lock(&mtx);
-    if (items.find(item_id) == items.end() || !items[item_id].valid) {
-        smutex_unlock(&mtx);
-        return;
+    if (chunk.ids.empty()) {
+        return 0;
     }
 
-    if (discount > items[item_id].discount) {
-        scond_broadcast(&cond, &mtx);
+    // Items are looked up (and loaded) before any lock is taken:
+    // loading takes the shard lock, which comes first.
+    EpochGuard guard(epochs);
+    vector<Item*> found(chunk.ids.size());
+    for (size_t i = 0; i < chunk.ids.size(); i++) {
+        found[i] = items.find(chunk.ids[i]);
     }
 
-    items[item_id].discount = discount;
-    smutex_unlock(&mtx);
+    vector<smutex_t*> hotLocks;
+    if (fineMode) {
+        for (int id : chunk.ids) {
+            smutex_lock(items.lock(id));
+        }
+        if (promotion) {
+            hotLocks = promotedLocks(found);
+            for (smutex_t *lock : hotLocks) {
+                smutex_lock(lock);
+            }
+        }
+    } else {
+        smutex_lock(&mtx);
+    }
+
+    Pricing pricing = readPricing();
+    vector<size_t> live;
+    vector<double> oldCost(chunk.ids.size());
+    for (size_t i = 0; i < found.size(); i++) {
+        if (found[i] != nullptr && found[i]->valid) {
+            found[i]->beginUpdate();
+            if (found[i]->waitList != nullptr) {
+                oldCost[i] = unitCost(*found[i], pricing);
+            }
+            live.push_back(i);
+        }
+    }
+
+    const ItemColumns &columns = items.columns();
+    size_t n = chunk.end - chunk.first;
+    if (live.size() == n) {
+        // Dense: ids are exactly [first, end).
+        if (kind == BULK_PRICE) {
+            simdCopy(plainColumn(columns.price) + chunk.first,
+                     chunk.values.data(), n);
+        } else if (kind == BULK_DISCOUNT) {
+            simdFill(plainColumn(columns.discount) + chunk.first, n, value);
+        } else {
+            simdScale(plainColumn(columns.price) + chunk.first, n, value);
+        }
+    } else {
+        for (size_t i : live) {
+            Item &item = *found[i];
+            if (kind == BULK_PRICE) {
+                item.price() = chunk.values[i];
+            } else if (kind == BULK_DISCOUNT) {
+                item.discount() = value;
+            } else {
+                item.price() = item.price() * value;
+            }
+        }
+    }
+
+    if (wal != nullptr || replayLsn != 0) {
+        vector<WalRecord> records(live.size());
+        for (size_t k = 0; k < live.size(); k++) {
+            Item &item = *found[live[k]];
+            records[k].type = kind == BULK_DISCOUNT ? WAL_DISCOUNT_ITEM
+                                                    : WAL_PRICE_ITEM;
+            records[k].item_id = item.id;
+            records[k].price = item.price();
+            records[k].discount = item.discount();
+        }
+        uint64_t lsn = wal != nullptr ? wal->appendMany(records) : replayLsn;
+        for (size_t k = 0; k < live.size(); k++) {
+            found[live[k]]->lsn().store(wal != nullptr ? lsn + k : lsn,
+                                        memory_order_relaxed);
+        }
+    }
+
+    int woken = 0;
+    for (size_t i : live) {
+        Item &item = *found[i];
+        item.endUpdate();
+        if (item.waitList != nullptr && unitCost(item, pricing) < oldCost[i]) {
+            woken += signalItemWaiters(item, pricing);
+        }
+    }
+
+    if (fineMode) {
+        if (combining) {
+            for (Item *item : found) {
+                if (item != nullptr) {
+                    combinePending(*item);
+                }
+            }
+        }
+        for (auto it = hotLocks.rbegin(); it != hotLocks.rend(); ++it) {
+            smutex_unlock(*it);
+        }
+        for (auto it = chunk.ids.rbegin(); it != chunk.ids.rend(); ++it) {
+            smutex_unlock(items.lock(*it));
+        }
+    } else {
+        smutex_unlock(&mtx);
+    }
+    return woken;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * finishBulk --
+ *
+ *      Account for the wakeups of a whole bulk update, which a
+ *      store-wide broadcast would have done once, and wait for its
+ *      log records.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::finishBulk(int woken)
+{
+    if (!fineMode) {
+        smutex_lock(&mtx);
+        wakeStats.avoidedWakeups += totalWaiters - woken;
+        smutex_unlock(&mtx);
+    }
+    commitLog();
 }
 
 /*
@@ -330,13 +3255,22 @@ void EStore::discountItem(int item_id, double discount)
  */
 void EStore::setShippingCost(double cost)
 {
-    smutex_lock(&mtx);
-    if (cost < shippingCost) {
-        scond_broadcast(&cond, &mtx);
+    if (sharded != nullptr) {
+        sharded->setShippingCost(cost);
+        return;
     }
 
-    shippingCost = cost;
+    EpochGuard guard(epochs);
+    smutex_lock(&mtx);
+    bool decreased = cost < shippingCost;
+    publishPricing(cost, storeDiscount);
+    int woken = decreased ? wakeAffordableWaiters() : 0;
     smutex_unlock(&mtx);
+    if (decreased) {
+        finishBulk(woken);
+    } else {
+        commitLog();
+    }
 }
 
 /*
@@ -354,12 +3288,202 @@ void EStore::setShippingCost(double cost)
 
 void EStore::setStoreDiscount(double discount)
 {
-    smutex_lock(&mtx);
-    if (discount > storeDiscount) {
-        scond_broadcast(&cond, &mtx);
+    if (sharded != nullptr) {
+        sharded->setStoreDiscount(discount);
+        return;
     }
-    storeDiscount = discount;
+
+    EpochGuard guard(epochs);
+    smutex_lock(&mtx);
+    bool increased = discount > storeDiscount;
+    publishPricing(shippingCost, discount);
+    int woken = increased ? wakeAffordableWaiters() : 0;
     smutex_unlock(&mtx);
+    if (increased) {
+        finishBulk(woken);
+    } else {
+        commitLog();
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyBatch --
+ *
+ *      Carry out a batch of supplier requests, with the same effect
+ *      as making the corresponding calls one by one, in order.
+ *
+ *      Runs of ADD_STOCK, CHANGE_ITEM_PRICE and CHANGE_ITEM_DISCOUNT
+ *      are applied by updateItems, which takes each lock they need
+ *      once for the whole run and wakes each affected waiter list
+ *      once. Store-wide pricing changes are published as they come,
+ *      but only the last one's waiters are woken, once, at the end
+ *      of the batch. The whole batch waits for the log once.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::applyBatch(const vector<SupplierOp> &ops)
+{
+    if (sharded != nullptr) {
+        sharded->applyBatch(ops);
+        return;
+    }
+
+    int woken = 0;
+    bool pricingDropped = false;
+    size_t i = 0;
+    while (i < ops.size()) {
+        const SupplierOp &op = ops[i];
+        if (op.type == ADD_STOCK || op.type == CHANGE_ITEM_PRICE ||
+            op.type == CHANGE_ITEM_DISCOUNT) {
+            size_t end = i + 1;
+            while (end < ops.size() &&
+                   (ops[end].type == ADD_STOCK ||
+                    ops[end].type == CHANGE_ITEM_PRICE ||
+                    ops[end].type == CHANGE_ITEM_DISCOUNT)) {
+                end++;
+            }
+            woken += updateItems(&ops[i], end - i);
+            i = end;
+            continue;
+        }
+
+        switch (op.type) {
+        case ADD_ITEM:
+            insertItem(op.item_id, op.count, op.value, op.discount);
+            break;
+        case REMOVE_ITEM:
+            unlinkItem(op.item_id);
+            break;
+        case SET_SHIPPING_COST:
+            smutex_lock(&mtx);
+            pricingDropped |= op.value < shippingCost;
+            publishPricing(op.value, storeDiscount);
+            smutex_unlock(&mtx);
+            break;
+        case SET_STORE_DISCOUNT:
+            smutex_lock(&mtx);
+            pricingDropped |= op.value > storeDiscount;
+            publishPricing(shippingCost, op.value);
+            smutex_unlock(&mtx);
+            break;
+        default:
+            break;
+        }
+        i++;
+    }
+
+    if (pricingDropped) {
+        // This covers every waiter the item runs may have missed.
+        EpochGuard guard(epochs);
+        smutex_lock(&mtx);
+        woken += wakeAffordableWaiters();
+        smutex_unlock(&mtx);
+    }
+    finishBulk(woken);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * updateItems --
+ *
+ *      Apply count ADD_STOCK, CHANGE_ITEM_PRICE and
+ *      CHANGE_ITEM_DISCOUNT requests in order, holding the locks of
+ *      all of their items (each taken once, in stripe order) for the
+ *      whole run. Afterwards, the waiters of every item that
+ *      received stock, or got cheaper, are signalled in one pass per
+ *      item, under the item's final price.
+ *
+ * Results:
+ *      The number of waiters woken.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::updateItems(const SupplierOp* ops, size_t count)
+{
+    // Items are looked up before any lock is taken (see updateChunk).
+    EpochGuard guard(epochs);
+    vector<Item*> found(count);
+    vector<int> stripes;
+    for (size_t i = 0; i < count; i++) {
+        found[i] = items.find(ops[i].item_id);
+        if (found[i] != nullptr) {
+            stripes.push_back(ItemTable::lockIndex(ops[i].item_id));
+        }
+    }
+
+    vector<smutex_t*> hotLocks;
+    if (fineMode) {
+        sort(stripes.begin(), stripes.end());
+        stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+        for (int stripe : stripes) {
+            smutex_lock(items.lockAt(stripe));
+        }
+        if (promotion) {
+            hotLocks = promotedLocks(found);
+            for (smutex_t *lock : hotLocks) {
+                smutex_lock(lock);
+            }
+        }
+    } else {
+        smutex_lock(&mtx);
+    }
+
+    vector<Item*> affected;
+    for (size_t i = 0; i < count; i++) {
+        if (found[i] == nullptr || !found[i]->valid) {
+            continue;
+        }
+        Item &item = *found[i];
+        const SupplierOp &op = ops[i];
+        bool mayWake = false;
+        item.beginUpdate();
+        if (op.type == ADD_STOCK) {
+            mayWake = true;
+            item.quantity() += op.count;
+            logItemMutation(item, WAL_ADD_STOCK, op.count, 0.0, 0.0);
+        } else if (op.type == CHANGE_ITEM_PRICE) {
+            mayWake = op.value < item.price();
+            item.price() = op.value;
+            logItemMutation(item, WAL_PRICE_ITEM, 0, op.value, 0.0);
+        } else {
+            mayWake = op.value > item.discount();
+            item.discount() = op.value;
+            logItemMutation(item, WAL_DISCOUNT_ITEM, 0, 0.0, op.value);
+        }
+        item.endUpdate();
+
+        if (mayWake && item.waitList != nullptr &&
+            find(affected.begin(), affected.end(), &item) == affected.end()) {
+            affected.push_back(&item);
+        }
+    }
+
+    Pricing pricing = readPricing();
+    int woken = 0;
+    for (Item *item : affected) {
+        woken += signalItemWaiters(*item, pricing);
+    }
 
+    if (fineMode) {
+        if (combining) {
+            for (Item *item : found) {
+                if (item != nullptr) {
+                    combinePending(*item);
+                }
+            }
+        }
+        for (auto it = hotLocks.rbegin(); it != hotLocks.rend(); ++it) {
+            smutex_unlock(*it);
+        }
+        for (auto it = stripes.rbegin(); it != stripes.rend(); ++it) {
+            smutex_unlock(items.lockAt(*it));
+        }
+    } else {
+        smutex_unlock(&mtx);
+    }
+    return woken;
+}
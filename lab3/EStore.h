@@ -1,42 +1,346 @@
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <unordered_map>
 #include <vector>
 #include "sthread.h"
 #include "Request.h"
+#include "ItemTable.h"
+#include "Waiter.h"
+#include "Epoch.h"
+#include "WriteAheadLog.h"
+#include "Sales.h"
+#include "TimingWheel.h"
 
-/* 
+class ShardedStore;
+
+/*
+ * ------------------------------------------------------------------
+ * WakeupStats --
+ *
+ *      Counters describing how blocked buyers were woken up.
+ *
+ *      waits           -- times a buyer went to sleep on an item.
+ *      wakeups         -- times a sleeping buyer was woken up.
+ *      spuriousWakeups -- wakeups after which the buyer still could
+ *                         not buy the item and went back to sleep.
+ *      avoidedWakeups  -- sleeping buyers that a store-wide
+ *                         broadcast would have woken up, but that
+ *                         were left asleep because the change could
+ *                         not affect them.
+ *      timeouts        -- buyers (of buyItemUntil) that gave up
+ *                         waiting at their deadline.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WakeupStats {
+    long waits;
+    long wakeups;
+    long spuriousWakeups;
+    long avoidedWakeups;
+    long timeouts;
+};
+
+
+/*
  * ------------------------------------------------------------------
- * Item -- 
+ * OrderStats --
  *
- *      This class represents a type of item in the inventory of the
- *      estore.  It keeps track of the number of units in stock, the
- *      price of each unit, etc.
+ *      Counters for multi-item orders.
  *
- *      The current price of an individual item is defined as the
- *      normal price of the item (i.e. the price field of Item) times
- *      1 - the current discount (i.e. the discount field of Item).
- *      When a customer tries to buy an item, the current price of
- *      the item should be used to determine the cost of the overall
- *      purchase.
+ *      In optimistic mode:
+ *      orders    -- orders processed.
+ *      commits   -- orders bought.
+ *      rejected  -- orders turned down (not carried, out of stock
+ *                   or over budget).
+ *      aborts    -- attempts that saw an item change under them
+ *                   and were retried.
+ *      fallbacks -- orders that gave up on optimism after
+ *                   OPTIMISTIC_RETRIES aborts and took the locks.
  *
- *      If the particular item is not being offered by the store,
- *      then the valid field of the item in the inventory will be
- *      set to false.
+ *      For buyManyItemsBlocking and buyManyItemsUntil, waits,
+ *      wakeups, spuriousWakeups and timeouts count as in
+ *      WakeupStats.
  *
  * ------------------------------------------------------------------
  */
-class Item {
-    public:
-    bool valid;
-    int quantity;
-    double price;
+struct OrderStats {
+    long orders;
+    long commits;
+    long rejected;
+    long aborts;
+    long fallbacks;
+    long waits;
+    long wakeups;
+    long spuriousWakeups;
+    long timeouts;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * HotItemStats / HotItemEvent --
+ *
+ *      How often items were promoted to a dedicated lock for being
+ *      hot and demoted again once they cooled off, and one such
+ *      event: which item, which way, and when (steady clock, in
+ *      nanoseconds).
+ *
+ * ------------------------------------------------------------------
+ */
+struct HotItemStats {
+    long promotions;
+    long demotions;
+};
+
+struct HotItemEvent {
+    int item_id;
+    bool promoted;
+    long when;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CombineStats --
+ *
+ *      Counters for flat combining.
+ *
+ *      published -- operations handed to the holder of a hot item's
+ *                   lock instead of waiting for the lock.
+ *      passes    -- times a lock holder found published operations
+ *                   and applied them.
+ *      applied   -- operations applied in those passes.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CombineStats {
+    long published;
+    long passes;
+    long applied;
+};
+
+// Optimistic attempts per order before falling back to locking.
+#define OPTIMISTIC_RETRIES 8
+
+// Added to the per-item budget of a blocked order to absorb
+// floating point rounding.
+#define BUDGET_SLACK      1e-6
+
+// An item whose lock was found busy this many more times than free,
+// lately, is hot: operations on it are published for flat combining
+// instead of waiting for the lock.
+#define HOT_ITEM_CONTENTION 4
+
+// With promotion enabled, an item whose contention counter reaches
+// HOT_ITEM_PROMOTE is promoted to a dedicated lock, and demoted once
+// the counter has dropped back to zero.
+#define HOT_ITEM_PROMOTE  (2 * HOT_ITEM_CONTENTION)
+
+// Promotions and demotions remembered for hotItemEvents.
+#define HOT_ITEM_EVENTS   64
+
+// Ids per chunk of a bulk update. Must divide ITEM_LOCK_STRIPES, so
+// that the ids of a chunk have distinct, increasing lock stripes.
+#define BULK_CHUNK        256
+
+
+/*
+ * ------------------------------------------------------------------
+ * Pricing --
+ *
+ *      A consistent snapshot of the store-wide pricing parameters,
+ *      and the version of the pricing seqlock it was read at.
+ *
+ * ------------------------------------------------------------------
+ */
+struct Pricing {
+    double shippingCost;
+    double storeDiscount;
+    unsigned version;
+};
+
+
+// Outcome of a single-item purchase attempt that does not block.
+enum BuyResult {
+    BUY_DONE,
+    BUY_NOT_CARRIED,
+    BUY_MUST_WAIT
+};
+
+// Outcome of a purchase that waits no longer than a deadline.
+enum PurchaseStatus {
+    PURCHASE_BOUGHT,
+    PURCHASE_NOT_CARRIED,
+    PURCHASE_TIMED_OUT
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * OrderSnapshot --
+ *
+ *      What a canonical order looked like when it was read without
+ *      taking any lock: whether the store carried all of its items,
+ *      whether they were all in stock, and what the order cost.
+ *
+ * ------------------------------------------------------------------
+ */
+struct OrderSnapshot {
+    bool carried;
+    bool inStock;
+    double cost;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * OrderLine --
+ *
+ *      One line of a canonical multi-item order: an item and the
+ *      number of units of it the order buys.
+ *
+ * ------------------------------------------------------------------
+ */
+struct OrderLine {
+    int item_id;
+    int count;
+    Item* item;
+};
+
+
+// Length of one tick of the wheel that expires holds.
+#define HOLD_TICK_NS 1000000L
+
+// Names an outstanding hold; 0 is never a hold's token.
+typedef uint64_t HoldToken;
+
+/*
+ * ------------------------------------------------------------------
+ * Hold --
+ *
+ *      Stock set aside by EStore::reserve: the order it holds,
+ *      whose items it keeps pinned, and the timer that lets the
+ *      hold lapse if it is neither committed nor released first.
+ *
+ * ------------------------------------------------------------------
+ */
+struct Hold : WheelTimer {
+    HoldToken token;
+    std::vector<OrderLine> order;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * HoldStats --
+ *
+ *      reserved    -- holds granted.
+ *      committed   -- holds whose units were bought.
+ *      released    -- holds given back by release, or by a commit
+ *                     that found one of the items removed.
+ *      expired     -- holds that lapsed.
+ *      outstanding -- holds neither committed, released nor expired.
+ *
+ * ------------------------------------------------------------------
+ */
+struct HoldStats {
+    long reserved;
+    long committed;
+    long released;
+    long expired;
+    long outstanding;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * SupplierOp --
+ *
+ *      One supplier request, as part of a batch (EStore::applyBatch).
+ *
+ *      ADD_ITEM             -- item_id, count (quantity), value
+ *                              (price) and discount.
+ *      REMOVE_ITEM          -- item_id.
+ *      ADD_STOCK            -- item_id, count.
+ *      CHANGE_ITEM_PRICE    -- item_id, value.
+ *      CHANGE_ITEM_DISCOUNT -- item_id, value.
+ *      SET_SHIPPING_COST    -- value.
+ *      SET_STORE_DISCOUNT   -- value.
+ *
+ * ------------------------------------------------------------------
+ */
+struct SupplierOp {
+    SupplierRequestTypes type;
+    int item_id;
+    int count;
+    double value;
     double discount;
-    
-    smutex_t itemMtx;
+};
 
-    Item();
-    ~Item();
+/*
+ * ------------------------------------------------------------------
+ * BulkChunk --
+ *
+ *      The part of a bulk update (priceItems, discountRange,
+ *      scalePrices) that falls into the BULK_CHUNK-aligned id range
+ *      [first, end): the ids to change, in increasing order, and
+ *      for BULK_PRICE the new price of each.
+ *
+ * ------------------------------------------------------------------
+ */
+enum BulkKind {
+    BULK_PRICE,
+    BULK_DISCOUNT,
+    BULK_SCALE
+};
+
+struct BulkChunk {
+    int first;
+    int end;
+    std::vector<int> ids;
+    std::vector<double> values;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * CombineOp --
+ *
+ *      An operation on one item, published on the item's combineList
+ *      for whichever thread holds the item's lock to apply. The
+ *      publisher owns the record (it lives on its stack) and waits
+ *      until done is set; after that the combiner no longer touches
+ *      it.
+ *
+ *      COMBINE_BUY        -- buy the one-item order *order within
+ *                            budget; bought is the result.
+ *      COMBINE_ADD_STOCK  -- add count units.
+ *      COMBINE_PRICE      -- set the price to price.
+ *
+ *      logged is set if the combiner wrote the operation to the
+ *      write-ahead log, which the publisher must then wait for.
+ *
+ * ------------------------------------------------------------------
+ */
+enum CombineKind {
+    COMBINE_BUY,
+    COMBINE_ADD_STOCK,
+    COMBINE_PRICE
+};
+
+struct CombineOp {
+    CombineKind kind;
+    const std::vector<OrderLine>* order;
+    double budget;
+    int count;
+    double price;
+    bool bought;
+    bool logged;
+    std::atomic<bool> done;
+    CombineOp* next;
+
+    explicit CombineOp(CombineKind opKind)
+        : kind(opKind), order(nullptr), budget(0.0), count(0), price(0.0),
+          bought(false), logged(false), done(false), next(nullptr)
+    { }
 };
 
 
@@ -64,26 +368,263 @@ class Item {
  *          - discountItem
  *      that reference different item ids must process at the same
  *      time. The buyManyItems method only functions in this mode.
+ *      Each of these takes only the lock of the item it touches
+ *      (addItem also takes the lock of the item's shard), never
+ *      the store-wide mtx.
+ *
+ *      If optimistic is true (which implies fineMode), buyManyItems
+ *      computes the cost of an order without holding any lock and
+ *      only locks the items to validate and commit a purchase.
+ *
+ *      If combining is true (which implies fineMode), hot items are
+ *      flat-combined: single-item buys, addStock and priceItem on an
+ *      item whose lock keeps being found busy are published on the
+ *      item (see CombineOp) and applied in one pass by whoever holds
+ *      its lock, instead of queueing up for the lock one by one.
+ *
+ *      If promotion is true, the store watches how contended each
+ *      item is and promotes hot items to a dedicated lock (see
+ *      retuneItem), demoting them once they cool off. In fine mode
+ *      that lock replaces the item's lock stripe; in coarse mode it
+ *      lines up the buyers of the item that would otherwise race
+ *      for it on the lock-free path.
+ *
+ *      If numShards is positive (which implies fineMode), the store
+ *      shares nothing between threads: every operation is passed on
+ *      to a ShardedStore, whose owner threads each have a partition
+ *      of the items to themselves.
+ *
+ *      The store can carry item ids 0 to capacity - 1. Item data is
+ *      kept in columns (see ItemTable), and memory for ids that
+ *      were never added is not touched, so capacity can be in the
+ *      millions.
+ *
+ *      Every purchase is counted in per-thread sales counters (see
+ *      SalesCounters), which itemSales, topSellers and
+ *      revenueByInterval read without holding up buyers.
+ *
+ *      reserve sets stock aside for a customer until it commits or
+ *      releases the hold, or the hold expires. Expiry is driven by
+ *      a hierarchical timing wheel (see TimingWheel) that a
+ *      background thread, started with the first hold, advances.
+ *      Holds are not supported in sharded mode.
  *
  * ------------------------------------------------------------------
  */
 class EStore {
     private:
-    Item inventory[1000];
     const bool fineMode;
+    const bool optimistic;
+    const bool combining;
+    const bool promotion;
+
+    // Units, revenue and failed purchases per item. Declared before
+    // sharded, which records into it.
+    SalesCounters sales;
+
+    // The shard owners every operation is handed to in sharded
+    // mode, or null.
+    ShardedStore* const sharded;
     // TODO: More needed here.
-    double shippingCost;
-    double storeDiscount;
-    std::map<int, Item> items;
+
+    // Store-wide pricing, published through a seqlock: setters hold
+    // mtx and keep pricingVersion odd while they write, so readers
+    // can take a consistent snapshot without locking (readPricing).
+    std::atomic<unsigned> pricingVersion;
+    std::atomic<double> shippingCost;
+    std::atomic<double> storeDiscount;
+    std::atomic<uint64_t> pricingLsn;
+
+    // The checkpoint the store was restored from, if any. It backs
+    // items, so it is declared (and destroyed) before them.
+    CheckpointImage image;
+
+    ItemTable items;
+
+    // Protects lock-free readers of items from removed items being
+    // freed under them.
+    EpochDomain epochs;
+
+    // The durable log of every mutation, or null, and the LSN of
+    // the record being replayed while it is opened.
+    WriteAheadLog* wal;
+    uint64_t replayLsn;
 
     smutex_t mtx;
-    scond_t cond;
-    
+
+    // Number of customers currently blocked in buyItem, and the
+    // wakeup counters. Both protected by mtx.
+    int totalWaiters;
+    WakeupStats wakeStats;
+
+    struct {
+        std::atomic<long> orders;
+        std::atomic<long> commits;
+        std::atomic<long> rejected;
+        std::atomic<long> aborts;
+        std::atomic<long> fallbacks;
+        std::atomic<long> waits;
+        std::atomic<long> wakeups;
+        std::atomic<long> spuriousWakeups;
+        std::atomic<long> timeouts;
+    } orderCounters;
+
+    struct {
+        std::atomic<long> published;
+        std::atomic<long> passes;
+        std::atomic<long> applied;
+    } combineCounters;
+
+    // Ids promoted at some point (some may have been demoted or
+    // removed since), and the latest promotions and demotions.
+    // Protected by hotMtx.
+    smutex_t hotMtx;
+    std::vector<int> hotIds;
+    HotItemEvent hotEvents[HOT_ITEM_EVENTS];
+    HotItemStats hotStats;
+
+    // Orders blocked in buyManyItemsBlocking, signaled by store-wide
+    // price drops. Protected by orderWaitMtx.
+    smutex_t orderWaitMtx;
+    WaiterLink* globalOrderWaiters;
+
+    // Outstanding holds by token and the wheel that expires them,
+    // which holdThread advances once started. holdCond wakes it
+    // for an expiry earlier than it is sleeping until, and to stop.
+    // Protected by holdMtx, which is never held together with an
+    // item lock.
+    smutex_t holdMtx;
+    scond_t holdCond;
+    TimingWheel holdWheel;
+    std::unordered_map<HoldToken, Hold*> holds;
+    HoldToken lastHoldToken;
+    bool holdThreadStarted;
+    bool holdsStopping;
+    sthread_t holdThread;
+
+    struct {
+        std::atomic<long> reserved;
+        std::atomic<long> committed;
+        std::atomic<long> released;
+        std::atomic<long> expired;
+    } holdCounters;
+
     double calculateTotalCost(int item_id);
+    BuyResult tryBuyItem(Item &item, double budget,
+                         bool* contended = nullptr);
+    double unitCost(const Item &item, const Pricing &pricing) const;
+    Pricing readPricing() const;
+    bool pricingUnchanged(const Pricing &pricing) const;
+    void publishPricing(double newShippingCost, double newStoreDiscount);
+
+    // The lock protecting an item's fields: the store monitor lock
+    // in coarse mode; in fine mode the item's dedicated lock if it
+    // is promoted, else the lock stripe of its id. Which one only
+    // stays the same while the caller holds the stripe or the
+    // dedicated lock.
+    smutex_t* itemLock(Item* item)
+    {
+        if (!fineMode) {
+            return &mtx;
+        }
+        HotItem *hot = promotedTo(*item);
+        return hot != nullptr ? &hot->mtx : items.lock(item->id);
+    }
+
+    static HotItem* promotedTo(const Item &item)
+    {
+        HotItem *hot = item.hot.load(std::memory_order_acquire);
+        return hot != nullptr && hot->active.load(std::memory_order_acquire)
+               ? hot : nullptr;
+    }
+
+    // Take the item's lock, whichever it is (see itemLock), and
+    // return it. acquireItem also counts contention and may promote
+    // or demote the item, so the lock it returns is the one held.
+    bool tryLockCurrent(Item &item);
+    void lockCurrent(Item &item);
+    smutex_t* acquireItem(Item &item);
+    int noteContention(Item &item, bool busy);
+    smutex_t* retuneItem(Item &item);
+    HotItem* hotSlot(Item &item);
+    void setPromoted(Item &item, HotItem* hot, bool promoted);
+    static std::vector<smutex_t*> promotedLocks(
+        const std::vector<Item*> &found);
+    BuyResult tryBuyContended(Item &item, double budget);
+
+    // Take (release) the lock of one item. In combining mode, a
+    // thread that finds a hot item locked publishes op instead and
+    // lockItem returns false once the lock holder has applied it;
+    // unlockItem applies whatever was published before releasing.
+    bool lockItem(Item &item, CombineOp &op);
+    void unlockItem(Item &item);
+    void combinePending(Item &item);
+    bool applyCombined(Item &item, CombineOp &op);
+
+    uint64_t logMutation(WalRecordType type, int item_id, int count,
+                         double price, double discount);
+    void logItemMutation(Item &item, WalRecordType type, int count,
+                         double price, double discount);
+    void commitLog();
+    void commitCombined(const CombineOp &op);
+    bool replayed(const WalRecord &record, uint64_t lsn);
+    void replay(const WalRecord &record);
+    CheckpointItem saveItem(int item_id);
+
+    void carriedIds(BulkChunk &chunk);
+    int updateChunk(BulkKind kind, double value, const BulkChunk &chunk);
+    void finishBulk(int woken);
+
+    void insertItem(int item_id, int quantity, double price,
+                    double discount);
+    void unlinkItem(int item_id);
+    int updateItems(const SupplierOp* ops, size_t count);
+
+    void wakeItemWaiters(Item &item);
+    int signalItemWaiters(Item &item, const Pricing &pricing);
+    int wakeAffordableWaiters();
+
+    bool prepareOrder(const std::vector<int> &item_ids,
+                      std::vector<OrderLine> &order);
+    void lockOrder(const std::vector<OrderLine> &order);
+    void unlockOrder(const std::vector<OrderLine> &order);
+    bool buyOrderLocked(const std::vector<OrderLine> &order, double budget);
+    bool orderCarried(const std::vector<OrderLine> &order);
+    bool orderBuyable(const std::vector<OrderLine> &order,
+                      const Pricing &pricing, double budget);
+    void takeOrder(const std::vector<OrderLine> &order,
+                   const Pricing &pricing);
+    void recordFailedOrder(const std::vector<int> &item_ids);
+    bool tryTakeOrder(const std::vector<OrderLine> &order, double budget,
+                      Pricing &pricing);
+    void linkOrderWaiter(const std::vector<OrderLine> &order,
+                         const Pricing &pricing, double budget,
+                         Waiter &waiter);
+    bool buyOrderOptimistic(const std::vector<OrderLine> &order, double budget);
+    PurchaseStatus buyOrderBlocking(const std::vector<OrderLine> &order,
+                                    double budget,
+                                    const struct timespec* deadline);
+    PurchaseStatus buyItemWaiting(int item_id, double budget,
+                                  const struct timespec* deadline);
+    PurchaseStatus buyManyItemsWaiting(std::vector<int>* item_ids,
+                                       double budget,
+                                       const struct timespec* deadline);
+    bool readOrder(const std::vector<OrderLine> &order, const Pricing &pricing,
+                   std::vector<unsigned> &versions, OrderSnapshot &snapshot);
+
+    static uint64_t holdTick();
+    static void* expireHolds(void* arg);
+    void lockHold(const std::vector<OrderLine> &order);
+    void unlockHold(const std::vector<OrderLine> &order);
+    Hold* claimHold(HoldToken token);
+    void returnHold(Hold* hold);
     
     public:
 
-    explicit EStore(bool enableFineMode);
+    explicit EStore(bool enableFineMode, bool enableOptimistic = false,
+                    bool enableCombining = false, int numShards = 0,
+                    int capacity = ITEM_TABLE_SIZE,
+                    bool enablePromotion = false);
     ~EStore();
 
     // no default copy constructor and assignment operators. this will prevent some
@@ -97,10 +638,50 @@ class EStore {
     void addStock(int item_id, int count);
     void priceItem(int item_id, double price);
     void discountItem(int item_id, double discount);
+    void priceItems(const std::vector<int> &item_ids,
+                    const std::vector<double> &prices);
+    void discountRange(int first, int last, double discount);
+    void scalePrices(double factor);
     void setShippingCost(double price);
     void setStoreDiscount(double discount);
+    void applyBatch(const std::vector<SupplierOp> &ops);
+
+    bool buyManyItems(std::vector<int>* item_ids, double budget);
+    bool buyManyItemsBlocking(std::vector<int>* item_ids, double budget);
+    PurchaseStatus buyItemUntil(int item_id, double budget,
+                                const struct timespec &deadline);
+    PurchaseStatus buyManyItemsUntil(std::vector<int>* item_ids,
+                                     double budget,
+                                     const struct timespec &deadline);
+
+    HoldToken reserve(const std::vector<int> &item_ids, long ttlNanos);
+    bool commit(HoldToken token);
+    bool release(HoldToken token);
+    HoldStats holdStats();
+
+    bool carries(int item_id);
+    bool quote(int item_id, double* cost);
+    bool quoteMany(const std::vector<int> &item_ids, double* cost);
+
+    WakeupStats wakeupStats();
+    OrderStats orderStats();
+    CombineStats combineStats();
+    ReclaimStats reclaimStats();
+    WalStats walStats();
+
+    ItemSales itemSales(int item_id);
+    std::vector<ItemSales> topSellers(int n);
+    std::vector<double> revenueByInterval(int intervals);
+
+    void promoteItem(int item_id);
+    void demoteItem(int item_id);
+    std::vector<int> hotItems();
+    std::vector<HotItemEvent> hotItemEvents();
+    HotItemStats hotItemStats();
 
-    void buyManyItems(std::vector<int>* item_ids, double budget);
+    bool openLog(const char* path);
+    bool openCheckpoint(const char* path);
+    bool checkpoint(const char* path);
 
     bool fineModeEnabled() const { return fineMode; }
 };
@@ -0,0 +1,163 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Epoch.h"
+
+using namespace std;
+
+
+EpochDomain::
+EpochDomain()
+    : epoch(1), owners(MAX_EPOCH_THREADS), counters()
+{
+    for (EpochSlot &s : slots) {
+        s.local.store(0, memory_order_relaxed);
+        s.depth = 0;
+    }
+    smutex_init(&mtx);
+}
+
+EpochDomain::
+~EpochDomain()
+{
+    // Nobody can be reading any more.
+    for (Retired &r : limbo) {
+        bool freed = r.reclaim(r.object);
+        assert(freed);
+    }
+    smutex_destroy(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * slot --
+ *
+ *      Return the calling thread's EpochSlot, claiming one the first
+ *      time the thread uses the domain. The slot goes back to the
+ *      domain when the thread exits, outside of any critical
+ *      section, so it is free (local is 0) for the next thread.
+ *
+ *      More than MAX_EPOCH_THREADS threads using the domain at once
+ *      is fatal.
+ *
+ * ------------------------------------------------------------------
+ */
+EpochSlot &EpochDomain::slot()
+{
+    int index = owners.claim();
+    if (index < 0) {
+        fprintf(stderr, "EpochDomain: more than %d threads at once\n",
+                MAX_EPOCH_THREADS);
+        ::exit(-1);
+    }
+    return slots[index];
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enter / exit --
+ *
+ *      Enter (leave) a critical section. Pointers to shared objects
+ *      may only be loaded and used in between.
+ *
+ * ------------------------------------------------------------------
+ */
+void EpochDomain::enter()
+{
+    EpochSlot &s = slot();
+    if (s.depth++ == 0) {
+        s.local.store(epoch.load(memory_order_seq_cst),
+                      memory_order_relaxed);
+        // Publish local before loading any shared pointer.
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void EpochDomain::exit()
+{
+    EpochSlot &s = slot();
+    if (--s.depth == 0) {
+        s.local.store(0, memory_order_release);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * collect --
+ *
+ *      Advance the global epoch if every thread in a critical
+ *      section has seen it, then free what was retired two or more
+ *      epochs ago. Caller must hold mtx.
+ *
+ * ------------------------------------------------------------------
+ */
+void EpochDomain::collect()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned long e = epoch.load(memory_order_relaxed);
+    bool advance = true;
+    int n = owners.limit();
+    for (int i = 0; i < n && advance; i++) {
+        unsigned long local = slots[i].local.load(memory_order_acquire);
+        advance = local == 0 || local == e;
+    }
+    if (advance) {
+        epoch.store(++e, memory_order_seq_cst);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < limbo.size(); i++) {
+        Retired &r = limbo[i];
+        if (r.epoch + 2 <= e && r.reclaim(r.object)) {
+            counters.freed++;
+        } else {
+            limbo[kept++] = r;
+        }
+    }
+    limbo.resize(kept);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * retire --
+ *
+ *      Free object with reclaim once no reader can be using it. The
+ *      caller must already have made it unreachable.
+ *
+ * ------------------------------------------------------------------
+ */
+void EpochDomain::retire(void* object, reclaim_t reclaim)
+{
+    smutex_lock(&mtx);
+    atomic_thread_fence(memory_order_seq_cst);
+    limbo.push_back(Retired{object, reclaim, epoch.load(memory_order_relaxed)});
+    counters.retired++;
+    collect();
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reclaim --
+ *
+ *      Free whatever retired objects can be freed by now.
+ *
+ * ------------------------------------------------------------------
+ */
+void EpochDomain::reclaim()
+{
+    smutex_lock(&mtx);
+    if (!limbo.empty()) {
+        collect();
+    }
+    smutex_unlock(&mtx);
+}
+
+ReclaimStats EpochDomain::stats()
+{
+    smutex_lock(&mtx);
+    ReclaimStats stats = counters;
+    smutex_unlock(&mtx);
+    return stats;
+}
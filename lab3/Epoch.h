@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "sthread.h"
+#include "ItemTable.h"
+#include "ThreadSlots.h"
+
+// Most threads that can use one EpochDomain at once.
+#define MAX_EPOCH_THREADS 256
+
+// Frees a retired object, or returns false if it cannot be freed
+// yet (it is asked again later).
+typedef bool (*reclaim_t) (void *);
+
+/*
+ * ------------------------------------------------------------------
+ * ReclaimStats --
+ *
+ *      retired -- objects retired so far.
+ *      freed   -- retired objects freed so far. The difference is
+ *                 what is waiting for readers to move on.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ReclaimStats {
+    long retired;
+    long freed;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EpochSlot --
+ *
+ *      The epoch state of one thread: the global epoch it saw when
+ *      it entered its outermost critical section, or 0 while it is
+ *      outside of one. depth is only touched by the owning thread.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) EpochSlot {
+    std::atomic<unsigned long> local;
+    int depth;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EpochDomain --
+ *
+ *      Epoch-based reclamation. Readers bracket every use of a
+ *      shared object with enter and exit (see EpochGuard), which
+ *      costs them one store and a fence, and no lock. A writer that
+ *      has unlinked an object, so no new reader can find it, hands
+ *      it to retire instead of freeing it.
+ *
+ *      The global epoch only advances once every thread inside a
+ *      critical section has seen the current one. An object retired
+ *      in epoch e is freed once the epoch reaches e + 2: by then
+ *      every reader that could have found it before it was unlinked
+ *      has left its critical section.
+ *
+ *      Retiring and reclaiming take mtx; they happen once per
+ *      removed object, not once per read.
+ *
+ * ------------------------------------------------------------------
+ */
+class EpochDomain {
+    private:
+    struct Retired {
+        void* object;
+        reclaim_t reclaim;
+        unsigned long epoch;
+    };
+
+    std::atomic<unsigned long> epoch;
+    EpochSlot slots[MAX_EPOCH_THREADS];
+    ThreadSlots owners;
+
+    smutex_t mtx;
+    std::vector<Retired> limbo;
+    ReclaimStats counters;
+
+    EpochSlot &slot();
+    void collect();
+
+    public:
+    EpochDomain();
+    ~EpochDomain();
+
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain &) = delete;
+
+    void enter();
+    void exit();
+    void retire(void* object, reclaim_t reclaim);
+    void reclaim();
+    ReclaimStats stats();
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EpochGuard --
+ *
+ *      Keeps the calling thread inside an epoch critical section for
+ *      as long as the guard lives. Guards nest.
+ *
+ * ------------------------------------------------------------------
+ */
+class EpochGuard {
+    private:
+    EpochDomain &domain;
+
+    public:
+    explicit EpochGuard(EpochDomain &d) : domain(d) { domain.enter(); }
+    ~EpochGuard() { domain.exit(); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard &) = delete;
+};
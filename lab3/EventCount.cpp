@@ -0,0 +1,89 @@
+#include "EventCount.h"
+
+using namespace std;
+
+
+EventCount::
+EventCount()
+    : epoch(0), waiters(0)
+{
+    smutex_init(&mtx);
+    scond_init(&cond);
+}
+
+EventCount::
+~EventCount()
+{
+    smutex_destroy(&mtx);
+    scond_destroy(&cond);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * prepareWait / cancelWait --
+ *
+ *      Announce a wait, and take the announcement back if the
+ *      condition turned out to hold after all.
+ *
+ * Results:
+ *      prepareWait returns the key to pass to wait.
+ *
+ * ------------------------------------------------------------------
+ */
+unsigned EventCount::
+prepareWait()
+{
+    waiters.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return epoch.load(memory_order_relaxed);
+}
+
+void EventCount::
+cancelWait()
+{
+    waiters.fetch_sub(1, memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wait --
+ *
+ *      Sleep until the epoch is no longer key, then withdraw the
+ *      announcement. The epoch only moves under mtx, so a notify
+ *      after prepareWait is never missed.
+ *
+ * ------------------------------------------------------------------
+ */
+void EventCount::
+wait(unsigned key)
+{
+    smutex_lock(&mtx);
+    while (epoch.load(memory_order_relaxed) == key) {
+        scond_wait(&cond, &mtx);
+    }
+    smutex_unlock(&mtx);
+    waiters.fetch_sub(1, memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * notify --
+ *
+ *      Wake one waiter, if any announced a wait. A waiter woken for
+ *      a change another waiter then undoes (say, takes the one task
+ *      that was queued) just checks its condition and waits again.
+ *
+ * ------------------------------------------------------------------
+ */
+void EventCount::
+notify()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiters.load(memory_order_relaxed) == 0) {
+        return;
+    }
+    smutex_lock(&mtx);
+    epoch.fetch_add(1, memory_order_relaxed);
+    scond_signal(&cond, &mtx);
+    smutex_unlock(&mtx);
+}
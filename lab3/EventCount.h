@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include "sthread.h"
+
+/*
+ * ------------------------------------------------------------------
+ * EventCount --
+ *
+ *      Lets threads that poll a lock-free structure sleep until it
+ *      changes, without the threads that change it taking a lock
+ *      unless someone is asleep.
+ *
+ *      A waiter announces itself with prepareWait, which returns
+ *      the current epoch, then checks its condition once more: if
+ *      it now holds, it calls cancelWait, otherwise wait, which
+ *      sleeps until the epoch moves past the one returned. After
+ *      making the condition true, a notifier calls notify, which
+ *      bumps the epoch and wakes a sleeper, but only if somebody
+ *      announced a wait. The waiter's announcement and the
+ *      notifier's change are each followed by a full fence before
+ *      the other side is read, so either the waiter sees the change
+ *      or the notifier sees the waiter.
+ *
+ * ------------------------------------------------------------------
+ */
+class EventCount {
+    private:
+    std::atomic<unsigned> epoch;
+    std::atomic<int> waiters;
+    smutex_t mtx;
+    scond_t cond;
+
+    public:
+    EventCount();
+    ~EventCount();
+
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount &) = delete;
+
+    unsigned prepareWait();
+    void cancelWait();
+    void wait(unsigned key);
+    void notify();
+
+    // Threads between prepareWait and the end of their wait.
+    int waiting() { return waiters.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,132 @@
+#include <cassert>
+#include <cstdlib>
+#include "ItemTable.h"
+
+
+// calloc an array of n zeroed atomics. Zero is a valid value for
+// all of them, and untouched pages of a large table cost nothing.
+template <typename T>
+static std::atomic<T>*
+zeroed(int n)
+{
+    return static_cast<std::atomic<T>*>(calloc(n, sizeof(std::atomic<T>)));
+}
+
+
+Item::
+Item(int item_id, const ItemColumns* itemColumns)
+    : id(item_id), columns(itemColumns), valid(false), version(0),
+      waitList(nullptr), waiters(0), pins(0), combineList(nullptr),
+      contention(0), hot(nullptr)
+{
+}
+
+Item::
+~Item()
+{
+    delete hot.load(std::memory_order_relaxed);
+}
+
+
+ItemTable::
+ItemTable(int size)
+    : slots(zeroed<Item*>(size)), capacity(size),
+      locks(new ItemLock[ITEM_LOCK_STRIPES]), image(nullptr),
+      loaded(nullptr)
+{
+    cols.quantity = zeroed<int>(size);
+    cols.held = zeroed<int>(size);
+    cols.price = zeroed<double>(size);
+    cols.discount = zeroed<double>(size);
+    cols.lsn = zeroed<uint64_t>(size);
+    cols.carried = zeroed<bool>(size);
+    for (ItemShard &shard : shards) {
+        smutex_init(&shard.mtx);
+        shard.waiters = 0;
+    }
+    for (int i = 0; i < ITEM_LOCK_STRIPES; i++) {
+        smutex_init(&locks[i].mtx);
+    }
+}
+
+ItemTable::
+~ItemTable()
+{
+    for (ItemShard &shard : shards) {
+        smutex_destroy(&shard.mtx);
+    }
+    for (int i = 0; i < ITEM_LOCK_STRIPES; i++) {
+        smutex_destroy(&locks[i].mtx);
+    }
+    delete[] locks;
+    for (int i = 0; i < capacity; i++) {
+        delete slots[i].load(std::memory_order_relaxed);
+    }
+    free(slots);
+    free(cols.quantity);
+    free(cols.held);
+    free(cols.price);
+    free(cols.discount);
+    free(cols.lsn);
+    free(cols.carried);
+    free(loaded);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * attachImage --
+ *
+ *      Back the (still empty) table with the items of a mapped
+ *      checkpoint, which must outlive the table. Nothing is read
+ *      from it yet, and the loaded flags come from calloc, so this
+ *      touches no memory per item either.
+ *
+ * ------------------------------------------------------------------
+ */
+void ItemTable::attachImage(const CheckpointItem* items)
+{
+    assert(image == nullptr);
+    loaded = zeroed<bool>(capacity);
+    image = items;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * load --
+ *
+ *      Publish the checkpointed item with this id, unless it was
+ *      loaded already or the checkpoint does not carry it. locked
+ *      says whether the caller holds the id's shard lock.
+ *
+ * Results:
+ *      The item in the slot afterwards.
+ *
+ * ------------------------------------------------------------------
+ */
+Item* ItemTable::load(int item_id, bool locked)
+{
+    const CheckpointItem &saved = image[item_id];
+    if (!saved.valid || loaded[item_id].load(std::memory_order_acquire)) {
+        return slots[item_id].load(std::memory_order_acquire);
+    }
+
+    ItemShard *s = shard(item_id);
+    if (!locked) {
+        smutex_lock(&s->mtx);
+    }
+    if (!loaded[item_id].load(std::memory_order_relaxed)) {
+        Item *item = newItem(item_id);
+        item->valid = true;
+        item->quantity() = saved.quantity;
+        item->price() = saved.price;
+        item->discount() = saved.discount;
+        item->lsn() = saved.lsn;
+        publish(item_id, item);
+        loaded[item_id].store(true, std::memory_order_release);
+    }
+    Item *item = slots[item_id].load(std::memory_order_acquire);
+    if (!locked) {
+        smutex_unlock(&s->mtx);
+    }
+    return item;
+}
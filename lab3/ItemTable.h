@@ -0,0 +1,372 @@
+#pragma once
+
+#include <atomic>
+#include "sthread.h"
+#include "Checkpoint.h"
+
+// Number of item ids an ItemTable can hold unless told otherwise.
+// Must be larger than INVENTORY_SIZE in Request.h.
+#define ITEM_TABLE_SIZE   1024
+
+// Number of stripes the item ids are partitioned into for
+// insertions and removals.
+#define ITEM_TABLE_SHARDS 16
+
+// Number of mutexes the item ids are partitioned into for updates.
+#define ITEM_LOCK_STRIPES 4096
+
+#define CACHE_LINE_SIZE   64
+
+struct WaiterLink;
+struct CombineOp;
+
+/*
+ * ------------------------------------------------------------------
+ * HotItem --
+ *
+ *      The dedicated lock of an item that was promoted for being hot
+ *      (see EStore::retuneItem), on a cache line of its own. An item
+ *      gets one the first time it is promoted and keeps it, inactive
+ *      while demoted, until the item is freed, so threads that read
+ *      the pointer earlier can still lock it safely.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) HotItem {
+    smutex_t mtx;
+    std::atomic<bool> active;
+
+    HotItem() : active(false) { smutex_init(&mtx); }
+    ~HotItem() { smutex_destroy(&mtx); }
+
+    HotItem(const HotItem&) = delete;
+    HotItem& operator=(const HotItem &) = delete;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ItemColumns --
+ *
+ *      The data of every item, kept as one array per field and
+ *      indexed by item id (structure of arrays), so that a scan of
+ *      one field over many items reads nothing else.
+ *
+ *      carried says whether the id is in the table. It is set when
+ *      an item is published and cleared when it is unlinked, so
+ *      scans can skip ids the store does not carry without chasing
+ *      the slot's pointer.
+ *
+ *      held counts units taken out of quantity by outstanding holds
+ *      (see EStore::reserve). They are not for sale, but are still
+ *      the store's until the hold is committed.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemColumns {
+    std::atomic<int>* quantity;
+    std::atomic<int>* held;
+    std::atomic<double>* price;
+    std::atomic<double>* discount;
+    std::atomic<uint64_t>* lsn;
+    std::atomic<bool>* carried;
+};
+
+/* 
+ * ------------------------------------------------------------------
+ * Item -- 
+ *
+ *      This class represents a type of item in the inventory of the
+ *      estore.  It keeps track of the number of units in stock, the
+ *      price of each unit, etc.
+ *
+ *      The current price of an individual item is defined as the
+ *      normal price of the item (i.e. its price) times 1 - the
+ *      current discount (i.e. its discount). When a customer tries
+ *      to buy an item, the current price of the item should be used
+ *      to determine the cost of the overall purchase.
+ *
+ *      quantity, held, price, discount and lsn live in the
+ *      ItemTable's columns, at the item's id; the Item itself only
+ *      holds what synchronizes access to them. An id removed and
+ *      added again gets a new Item over the same columns.
+ *
+ *      If the particular item is not being offered by the store,
+ *      then the valid field of the item in the inventory will be
+ *      set to false. A removed item is also unlinked from the
+ *      ItemTable and freed once nobody can be using it any more, so
+ *      valid = false is only ever seen by threads that found the
+ *      item before it was removed. Since they see it, they never
+ *      change the columns through it, and discard whatever they
+ *      read from them, which may already belong to the item that
+ *      replaced it.
+ *
+ *      Lock-free readers are protected by the store's EpochDomain.
+ *      A thread that keeps an item across a wait, outside of any
+ *      epoch critical section, holds a pin on it instead; an item
+ *      is not freed while pinned.
+ *
+ *      valid, quantity, held, price and discount may only be changed
+ *      between beginUpdate and endUpdate. Those move version to an
+ *      odd number and back to an even one, so a reader that takes
+ *      no lock can tell whether it saw a consistent item: the
+ *      version must be even, and unchanged after the fields were
+ *      read (a seqlock). A writer claims the odd version with a
+ *      compare-and-swap, so writers exclude each other even when
+ *      one of them (a lock-free buyer, see tryBeginUpdate) does not
+ *      hold the item's lock.
+ *
+ *      lsn is the LSN of the last mutation of the item written to
+ *      the store's write-ahead log. It is changed along with the
+ *      fields it describes, so a checkpoint saves it consistently.
+ *
+ *      The item's lock is the ItemTable's lock stripe for its id,
+ *      so items do not each carry a mutex, and an Item fits in one
+ *      cache line. Only an item promoted for being hot gets a lock
+ *      of its own, in hot (see HotItem).
+ *
+ * ------------------------------------------------------------------
+ */
+class alignas(CACHE_LINE_SIZE) Item {
+    public:
+    const int id;
+    const ItemColumns* const columns;
+
+    std::atomic<bool> valid;
+    std::atomic<unsigned> version;
+
+    // Customers blocked on this item (in EStore::buyItem or
+    // EStore::buyManyItemsBlocking), sorted by budget, and how many
+    // of them there are. Protected by the item's lock.
+    WaiterLink* waitList;
+    int waiters;
+
+    std::atomic<int> pins;
+
+    // Operations published by threads that found the lock busy, for
+    // whoever holds it to apply (see EStore::lockItem), and how
+    // contended the lock has been lately.
+    std::atomic<CombineOp*> combineList;
+    std::atomic<int> contention;
+
+    // The item's dedicated lock, if it was ever promoted.
+    std::atomic<HotItem*> hot;
+
+    Item(int item_id, const ItemColumns* itemColumns);
+    ~Item();
+
+    std::atomic<int>& quantity() const { return columns->quantity[id]; }
+    std::atomic<int>& held() const { return columns->held[id]; }
+    std::atomic<double>& price() const { return columns->price[id]; }
+    std::atomic<double>& discount() const { return columns->discount[id]; }
+    std::atomic<uint64_t>& lsn() const { return columns->lsn[id]; }
+
+    void beginUpdate()
+    {
+        unsigned v = version.load(std::memory_order_relaxed);
+        while (!tryBeginUpdate(v)) {
+            if (v & 1)
+                sthread_yield();
+            v = version.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Claim the item for writing if its version is still v (which
+    // must be even).
+    bool tryBeginUpdate(unsigned v)
+    {
+        if ((v & 1) || !version.compare_exchange_weak(
+                v, v + 1, std::memory_order_acquire,
+                std::memory_order_relaxed))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    void endUpdate()
+    {
+        version.store(version.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+
+    Item(const Item&) = delete;
+    Item& operator=(const Item &) = delete;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * ItemShard --
+ *
+ *      One lock stripe of an ItemTable. Item id i belongs to shard
+ *      i % ITEM_TABLE_SHARDS.
+ *
+ *      mtx serializes the insertion of new items into the shard, so
+ *      adding an item never blocks updates to items that are
+ *      already in the table, nor insertions into other shards.
+ *
+ *      waiters counts the customers blocked on items of this shard,
+ *      which lets store-wide wakeups skip whole shards. It is
+ *      protected by the lock that protects the waiters themselves.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) ItemShard {
+    smutex_t mtx;
+    int waiters;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ItemLock --
+ *
+ *      One lock stripe for item updates: the lock of every item
+ *      whose id is congruent to the stripe's index modulo
+ *      ITEM_LOCK_STRIPES. Each gets a cache line of its own, so that
+ *      threads spinning on or waiting for the lock of one item do
+ *      not invalidate the lock of another.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) ItemLock {
+    smutex_t mtx;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * ItemTable --
+ *
+ *      A direct-indexed table of items: slot i of one contiguous
+ *      array points to the item with id i, or is null if the store
+ *      does not carry it. Lookups are a bounds check, an array index
+ *      and one load, and take no lock. The items' data is kept in
+ *      columns next to the slots (see ItemColumns).
+ *
+ *      The table is sized at construction. Slots, columns and
+ *      loaded flags come from calloc, so a table of millions of ids
+ *      costs nothing until they are used.
+ *
+ *      An item is published into its slot once it is filled in,
+ *      and unlinked from it when it is removed, both under the
+ *      shard's mtx. Unlinked items must be retired through an
+ *      EpochDomain rather than deleted, since lock-free readers may
+ *      still hold them.
+ *
+ *      Ids outside [0, capacity) can never be carried by the store.
+ *
+ *      The ids are also striped across ITEM_TABLE_SHARDS shards;
+ *      see ItemShard.
+ *
+ *      A table may be backed by a mapped checkpoint (attachImage).
+ *      Its items are then not loaded up front: the first lookup of
+ *      an id that is still as the checkpoint left it builds the item
+ *      from the image and publishes it. After that, and after any
+ *      removal, the slot alone says whether the id is carried.
+ *
+ * ------------------------------------------------------------------
+ */
+class ItemTable {
+    private:
+    std::atomic<Item*>* slots;
+    const int capacity;
+    ItemColumns cols;
+    ItemShard shards[ITEM_TABLE_SHARDS];
+    ItemLock* locks;
+
+    // The checkpoint the table was restored from, or null, and
+    // which of its items have been loaded into (or superseded in)
+    // the slots.
+    const CheckpointItem* image;
+    std::atomic<bool>* loaded;
+
+    Item* load(int item_id, bool locked);
+
+    public:
+    explicit ItemTable(int size = ITEM_TABLE_SIZE);
+    ~ItemTable();
+
+    ItemTable(const ItemTable&) = delete;
+    ItemTable& operator=(const ItemTable &) = delete;
+
+    bool inRange(int item_id) const
+    {
+        return item_id >= 0 && item_id < capacity;
+    }
+
+    // The item with this id, or nullptr if the store does not carry
+    // it. Caller must be in an epoch critical section; findLocked is
+    // for callers that hold the lock of the id's shard instead.
+    Item* find(int item_id)
+    {
+        if (!inRange(item_id))
+            return nullptr;
+        Item *item = slots[item_id].load(std::memory_order_acquire);
+        return item != nullptr || image == nullptr ? item
+                                                   : load(item_id, false);
+    }
+
+    Item* findLocked(int item_id)
+    {
+        Item *item = slots[item_id].load(std::memory_order_acquire);
+        return item != nullptr || image == nullptr ? item
+                                                   : load(item_id, true);
+    }
+
+    // The item in the slot, without loading it from the checkpoint.
+    Item* findLoaded(int item_id)
+    {
+        return slots[item_id].load(std::memory_order_acquire);
+    }
+
+    // The checkpointed state of the id if it has not been loaded
+    // yet, else null. Read it before the slot: once this returns
+    // null, the slot is up to date.
+    const CheckpointItem* pendingImage(int item_id)
+    {
+        if (image == nullptr ||
+            loaded[item_id].load(std::memory_order_acquire))
+            return nullptr;
+        return &image[item_id];
+    }
+
+    void attachImage(const CheckpointItem* items);
+
+    // Make a filled-in item findable, or unlink it. Caller must
+    // hold the lock of the item's shard.
+    void publish(int item_id, Item* item)
+    {
+        cols.carried[item_id].store(true, std::memory_order_relaxed);
+        slots[item_id].store(item, std::memory_order_release);
+    }
+
+    Item* unlink(int item_id)
+    {
+        cols.carried[item_id].store(false, std::memory_order_relaxed);
+        return slots[item_id].exchange(nullptr, std::memory_order_acq_rel);
+    }
+
+    // A new, not yet published item with this id over the columns.
+    Item* newItem(int item_id) { return new Item(item_id, &cols); }
+
+    const ItemColumns& columns() const { return cols; }
+
+    // The lock of the items with this id, and its index in the one
+    // global order in which several of them may be taken.
+    smutex_t* lock(int item_id)
+    {
+        return &locks[item_id % ITEM_LOCK_STRIPES].mtx;
+    }
+
+    static int lockIndex(int item_id) { return item_id % ITEM_LOCK_STRIPES; }
+
+    smutex_t* lockAt(int index) { return &locks[index].mtx; }
+
+    ItemShard* shard(int item_id)
+    {
+        return &shards[item_id % ITEM_TABLE_SHARDS];
+    }
+
+    ItemShard* shardAt(int index) { return &shards[index]; }
+
+    int size() const { return capacity; }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include "ItemTable.h"
+
+/*
+ * ------------------------------------------------------------------
+ * MpmcQueue --
+ *
+ *      A bounded, lock-free queue for any number of producer and
+ *      consumer threads (Vyukov's sequence-numbered ring). SIZE
+ *      must be a power of two. All of its memory is allocated with
+ *      the queue.
+ *
+ *      Each cell carries a sequence number that says whose turn it
+ *      is: a producer may fill the cell for position pos when the
+ *      sequence is pos, a consumer may empty it when it is pos + 1,
+ *      and emptying it sets it to pos + SIZE for the producer one
+ *      lap later. Producers (consumers) claim a position by moving
+ *      tail (head) on with a compare-and-swap, each on its own
+ *      cache line, and only ever wait for each other by retrying.
+ *
+ * ------------------------------------------------------------------
+ */
+template <typename T, unsigned SIZE>
+class MpmcQueue {
+    private:
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) Cell cells[SIZE];
+
+    public:
+    MpmcQueue() : head(0), tail(0)
+    {
+        for (size_t i = 0; i < SIZE; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue &) = delete;
+
+    // Returns false if the queue is full.
+    bool tryPush(const T &value)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & (SIZE - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            long lag = (long) (seq - pos);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    break;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue is empty.
+    bool tryPop(T &value)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & (SIZE - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            long lag = (long) (seq - (pos + 1));
+            if (lag == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    break;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(pos + SIZE, std::memory_order_release);
+        return true;
+    }
+
+    // Tasks claimed by producers and not yet by consumers; only a
+    // hint while either side is running.
+    size_t size()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+};
@@ -11,6 +11,15 @@
 #define MAX_PRICE         1000000
 #define MAX_SHIPPING_COST 10000
 
+// Percentage of customer requests that only ask for a price quote.
+#define QUOTE_PERCENT     25
+
+// With holds on, percentage of customer requests that hold items
+// for HOLD_TTL_NS and then commit the hold, or let it lapse, with
+// equal odds.
+#define HOLD_PERCENT      20
+#define HOLD_TTL_NS       5000000L
+
 // Forward declaration. Do not remove!!
 class EStore;
 
@@ -73,11 +82,14 @@ struct SetStoreDiscountReq {
     double new_discount;
 };
 
+// slo_ns is the longest a buy request may wait, in nanoseconds; 0
+// means it waits as long as it takes.
 struct BuyItemReq {
     EStore* store;
 
     int item_id;
     double budget;
+    long slo_ns;
 };
 
 struct BuyManyItemsReq {
@@ -85,5 +97,19 @@ struct BuyManyItemsReq {
 
     std::vector<int> item_ids;
     double budget;
+    long slo_ns;
+};
+
+struct QuoteReq {
+    EStore* store;
+
+    std::vector<int> item_ids;
+};
+
+struct ReserveReq {
+    EStore* store;
+
+    std::vector<int> item_ids;
+    bool commit;
 };
 
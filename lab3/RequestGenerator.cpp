@@ -9,9 +9,9 @@
 using namespace std;
 
 static int
-rand_id()
+rand_id(int numItems)
 {
-    return sutil_random() % INVENTORY_SIZE;
+    return sutil_random() % numItems;
 }
 
 static int
@@ -39,8 +39,8 @@ rand_request()
 }
 
 RequestGenerator::
-RequestGenerator(TaskQueue* queue)
-    : taskQueue(queue), taskCount(0)
+RequestGenerator(TaskQueue* queue, int itemRange)
+    : taskQueue(queue), taskCount(0), numItems(itemRange)
 { }
 
 RequestGenerator::
@@ -50,12 +50,19 @@ RequestGenerator::
 void RequestGenerator::
 enqueueTasks(int maxTasks, EStore* store)
 {
+    vector<Task> batch;
     taskCount = 0;
     while (taskCount < maxTasks || maxTasks < 0)
     {
-        taskQueue->enqueue(generateTask(store));
-        taskCount++;
-        sthread_sleep(0, 100000000);
+        batch.clear();
+        while (batch.size() < GENERATOR_BATCH &&
+               (taskCount < maxTasks || maxTasks < 0)) {
+            batch.push_back(generateTask(store));
+            taskCount++;
+        }
+        enqueueBatch(batch);
+        long pause = batch.size() * GENERATOR_PAUSE_NS;
+        sthread_sleep(pause / 1000000000, pause % 1000000000);
     }
 }
 
@@ -79,19 +86,37 @@ void RequestGenerator::
 enqueueStops(int num)
 {
     // TODO: Your code here.
-    for (int i = 0; i < num; i++) {
-        Task stopTask;
-        stopTask.handler = stop_handler;
-        stopTask.arg = nullptr;
-        taskQueue->enqueue(stopTask);
-    }
+    Task stopTask;
+    stopTask.handler = stop_handler;
+    stopTask.arg = nullptr;
+    taskQueue->enqueueMany(vector<Task>(num, stopTask));
+}
+
+void RequestGenerator::
+enqueueBatch(const vector<Task>& tasks)
+{
+    taskQueue->enqueueMany(tasks);
 }
 
 SupplierRequestGenerator::
-SupplierRequestGenerator(TaskQueue* queue)
-    : RequestGenerator(queue)
+SupplierRequestGenerator(TaskQueue* queue, int itemRange,
+                         bool coalesceRequests)
+    : RequestGenerator(queue, itemRange), coalesce(coalesceRequests)
 { }
 
+// Coalesced requests are queued one by one, each looking for a
+// queued request to merge into.
+void SupplierRequestGenerator::
+enqueueBatch(const vector<Task>& tasks)
+{
+    if (!coalesce) {
+        RequestGenerator::enqueueBatch(tasks);
+        return;
+    }
+    for (const Task& task : tasks)
+        enqueue_supplier_task(taskQueue, task);
+}
+
 Task SupplierRequestGenerator::
 generateTask(EStore* store)
 {
@@ -112,7 +137,7 @@ generateTask(EStore* store)
         {
             auto req = new AddItemReq();
             req->store    = store;
-            req->item_id  = rand_id();
+            req->item_id  = rand_id(numItems);
             req->price    = rand_price(MAX_PRICE) + 1;
             req->quantity = rand_quantity();
 
@@ -124,7 +149,7 @@ generateTask(EStore* store)
         {
             auto req = new RemoveItemReq();
             req->store   = store;
-            req->item_id = rand_id();
+            req->item_id = rand_id(numItems);
 
             task.handler = remove_item_handler;
             task.arg     = req;
@@ -134,7 +159,7 @@ generateTask(EStore* store)
         {
             auto req = new AddStockReq();
             req->store            = store;
-            req->item_id          = rand_id();
+            req->item_id          = rand_id(numItems);
             req->additional_stock = rand_quantity();
 
             task.handler = add_stock_handler;
@@ -145,7 +170,7 @@ generateTask(EStore* store)
         {
             auto req = new ChangeItemPriceReq();
             req->store = store;
-            req->item_id   = rand_id();
+            req->item_id   = rand_id(numItems);
             req->new_price = rand_price(MAX_PRICE);
 
             task.handler = change_item_price_handler;
@@ -156,7 +181,7 @@ generateTask(EStore* store)
         {
             auto req = new ChangeItemDiscountReq();
             req->store = store;
-            req->item_id      = rand_id();
+            req->item_id      = rand_id(numItems);
             req->new_discount = rand_discount();
 
             task.handler = change_item_discount_handler;
@@ -195,8 +220,11 @@ generateTask(EStore* store)
 }
 
 CustomerRequestGenerator::
-CustomerRequestGenerator(TaskQueue* queue, bool inFineMode)
-    : RequestGenerator(queue), fineMode(inFineMode)
+CustomerRequestGenerator(TaskQueue* queue, bool inFineMode,
+                         int itemRange, long waitLimitNanos,
+                         bool useHolds)
+    : RequestGenerator(queue, itemRange), fineMode(inFineMode),
+      sloNanos(waitLimitNanos), holds(useHolds)
 { }
 
 Task CustomerRequestGenerator::
@@ -204,12 +232,38 @@ generateTask(EStore* store)
 {
     Task task;
 
-    if (!fineMode)
+    if ((int)(sutil_random() % 100) < QUOTE_PERCENT)
+    {
+        auto req = new QuoteReq();
+
+        int num_quote_item = (sutil_random() % MAX_BUY_ITEM) + 1;
+        for (int i = 0; i < num_quote_item; i++)
+            req->item_ids.push_back(rand_id(numItems));
+        req->store = store;
+
+        task.handler = quote_handler;
+        task.arg     = req;
+    }
+    else if (holds && (int)(sutil_random() % 100) < HOLD_PERCENT)
+    {
+        auto req = new ReserveReq();
+
+        int num_hold_item = (sutil_random() % MAX_BUY_ITEM) + 1;
+        for (int i = 0; i < num_hold_item; i++)
+            req->item_ids.push_back(rand_id(numItems));
+        req->store  = store;
+        req->commit = sutil_random() % 2 == 0;
+
+        task.handler = reserve_handler;
+        task.arg     = req;
+    }
+    else if (!fineMode)
     {
         auto req = new BuyItemReq();
         req->store   = store;
-        req->item_id = rand_id();
+        req->item_id = rand_id(numItems);
         req->budget  = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        req->slo_ns  = sloNanos;
 
         task.handler = buy_item_handler;
         task.arg     = req;
@@ -222,11 +276,12 @@ generateTask(EStore* store)
 
         set<int> order;
         for (int i = 0; i < num_buy_item; i++)
-            order.insert(rand_id());
+            order.insert(rand_id(numItems));
 
         req->store  = store;
         req->item_ids.insert(req->item_ids.begin(), order.begin(), order.end());
         req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;;
+        req->slo_ns = sloNanos;
 
         task.handler = buy_many_items_handler;
         task.arg     = req;
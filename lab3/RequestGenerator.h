@@ -4,17 +4,24 @@
 #include "TaskQueue.h"
 #include "Request.h"
 
-class RequestGenerator {
-    private:
-    TaskQueue* taskQueue;
+// Requests a generator queues at once, and how long it pauses per
+// request it generates.
+#define GENERATOR_BATCH    4
+#define GENERATOR_PAUSE_NS 100000000L
 
+class RequestGenerator {
     protected:
+    TaskQueue* taskQueue;
     int taskCount;
 
+    // Requests name item ids in [0, numItems).
+    const int numItems;
+
     virtual Task generateTask(EStore* store) = 0;
+    virtual void enqueueBatch(const std::vector<Task>& tasks);
 
     public:
-    RequestGenerator(TaskQueue* queue);
+    RequestGenerator(TaskQueue* queue, int itemRange = INVENTORY_SIZE);
     virtual ~RequestGenerator();
 
     void enqueueTasks(int maxTasks, EStore* store);
@@ -22,21 +29,33 @@ class RequestGenerator {
 };
 
 class SupplierRequestGenerator : public RequestGenerator {
+    private:
+    // Merge redundant requests while they are queued.
+    bool coalesce;
+
     protected:
     virtual Task generateTask(EStore* store);
+    virtual void enqueueBatch(const std::vector<Task>& tasks);
 
     public:
-    SupplierRequestGenerator(TaskQueue* queue);
+    SupplierRequestGenerator(TaskQueue* queue,
+                             int itemRange = INVENTORY_SIZE,
+                             bool coalesceRequests = false);
 };
 
 class CustomerRequestGenerator : public RequestGenerator {
     private:
     bool fineMode;
+    long sloNanos;
+    bool holds;
 
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode);
+    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode,
+                             int itemRange = INVENTORY_SIZE,
+                             long waitLimitNanos = 0,
+                             bool useHolds = false);
 };
 
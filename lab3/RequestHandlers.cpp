@@ -1,6 +1,7 @@
 #include <cstdio>
 #include "Request.h"  
 #include "EStore.h"
+#include "RequestHandlers.h"
 class Simulation;
 /*
  * ------------------------------------------------------------------
@@ -171,6 +172,235 @@ set_store_discount_handler(void *args)
     delete req;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * batch_supplier_task --
+ *
+ *      If the task is a supplier request for *store (or for any
+ *      store, if *store is null), append it to batch as a
+ *      SupplierOp instead of handling it, set *store to its store,
+ *      and delete the request object, printing what its handler
+ *      would have printed. The caller hands the batch to
+ *      EStore::applyBatch.
+ *
+ * Results:
+ *      true if the task was added to the batch; false if it has to
+ *      be run on its own.
+ *
+ * ------------------------------------------------------------------
+ */
+bool
+batch_supplier_task(Task task, std::vector<SupplierOp> &batch, EStore **store)
+{
+    SupplierOp op = {ADD_ITEM, 0, 0, 0.0, 0.0};
+    EStore *target;
+
+    if (task.handler == add_item_handler) {
+        AddItemReq *req = static_cast<AddItemReq *>(task.arg);
+        target = req->store;
+        op.type = ADD_ITEM;
+        op.item_id = req->item_id;
+        op.count = req->quantity;
+        op.value = req->price;
+        op.discount = req->discount;
+    } else if (task.handler == remove_item_handler) {
+        RemoveItemReq *req = static_cast<RemoveItemReq *>(task.arg);
+        target = req->store;
+        op.type = REMOVE_ITEM;
+        op.item_id = req->item_id;
+    } else if (task.handler == add_stock_handler) {
+        AddStockReq *req = static_cast<AddStockReq *>(task.arg);
+        target = req->store;
+        op.type = ADD_STOCK;
+        op.item_id = req->item_id;
+        op.count = req->additional_stock;
+    } else if (task.handler == change_item_price_handler) {
+        ChangeItemPriceReq *req = static_cast<ChangeItemPriceReq *>(task.arg);
+        target = req->store;
+        op.type = CHANGE_ITEM_PRICE;
+        op.item_id = req->item_id;
+        op.value = req->new_price;
+    } else if (task.handler == change_item_discount_handler) {
+        ChangeItemDiscountReq *req =
+            static_cast<ChangeItemDiscountReq *>(task.arg);
+        target = req->store;
+        op.type = CHANGE_ITEM_DISCOUNT;
+        op.item_id = req->item_id;
+        op.value = req->new_discount;
+    } else if (task.handler == set_shipping_cost_handler) {
+        SetShippingCostReq *req = static_cast<SetShippingCostReq *>(task.arg);
+        target = req->store;
+        op.type = SET_SHIPPING_COST;
+        op.value = req->new_cost;
+    } else if (task.handler == set_store_discount_handler) {
+        SetStoreDiscountReq *req =
+            static_cast<SetStoreDiscountReq *>(task.arg);
+        target = req->store;
+        op.type = SET_STORE_DISCOUNT;
+        op.value = req->new_discount;
+    } else {
+        return false;
+    }
+
+    if (target == nullptr || (*store != nullptr && target != *store)) {
+        return false;
+    }
+    *store = target;
+
+    // Print what the handler would have, and free the request.
+    switch (op.type) {
+    case ADD_ITEM:
+        printf("add_item_handler: item_id=%d, quantity=%d, price=%.2f, discount=%.2f\n",
+               op.item_id, op.count, op.value, op.discount);
+        delete static_cast<AddItemReq *>(task.arg);
+        break;
+    case REMOVE_ITEM:
+        printf("remove_item_handler: item_id=%d\n", op.item_id);
+        delete static_cast<RemoveItemReq *>(task.arg);
+        break;
+    case ADD_STOCK:
+        printf("add_stock_handler: item_id=%d, additional_stock=%d\n", op.item_id, op.count);
+        delete static_cast<AddStockReq *>(task.arg);
+        break;
+    case CHANGE_ITEM_PRICE:
+        printf("change_item_price_handler: item_id=%d, new_price=%.2f\n", op.item_id, op.value);
+        delete static_cast<ChangeItemPriceReq *>(task.arg);
+        break;
+    case CHANGE_ITEM_DISCOUNT:
+        printf("change_item_discount_handler: item_id=%d, new_discount=%.2f\n", op.item_id, op.value);
+        delete static_cast<ChangeItemDiscountReq *>(task.arg);
+        break;
+    case SET_SHIPPING_COST:
+        printf("set_shipping_cost_handler: new_shipping_cost=%.2f\n", op.value);
+        delete static_cast<SetShippingCostReq *>(task.arg);
+        break;
+    default:
+        printf("set_store_discount_handler: new_discount=%.2f\n", op.value);
+        delete static_cast<SetStoreDiscountReq *>(task.arg);
+        break;
+    }
+    batch.push_back(op);
+    return true;
+}
+
+// Merge functions for enqueue_supplier_task. A newer price,
+// discount or pricing request replaces the queued one's value;
+// stock additions add up. Either way the newer request is freed.
+static bool
+merge_price(Task* pending, Task task)
+{
+    ChangeItemPriceReq *old = static_cast<ChangeItemPriceReq *>(pending->arg);
+    ChangeItemPriceReq *req = static_cast<ChangeItemPriceReq *>(task.arg);
+    if (old->store != req->store) {
+        return false;
+    }
+    old->new_price = req->new_price;
+    delete req;
+    return true;
+}
+
+static bool
+merge_discount(Task* pending, Task task)
+{
+    ChangeItemDiscountReq *old =
+        static_cast<ChangeItemDiscountReq *>(pending->arg);
+    ChangeItemDiscountReq *req = static_cast<ChangeItemDiscountReq *>(task.arg);
+    if (old->store != req->store) {
+        return false;
+    }
+    old->new_discount = req->new_discount;
+    delete req;
+    return true;
+}
+
+static bool
+merge_stock(Task* pending, Task task)
+{
+    AddStockReq *old = static_cast<AddStockReq *>(pending->arg);
+    AddStockReq *req = static_cast<AddStockReq *>(task.arg);
+    if (old->store != req->store) {
+        return false;
+    }
+    old->additional_stock += req->additional_stock;
+    delete req;
+    return true;
+}
+
+static bool
+merge_shipping_cost(Task* pending, Task task)
+{
+    SetShippingCostReq *old = static_cast<SetShippingCostReq *>(pending->arg);
+    SetShippingCostReq *req = static_cast<SetShippingCostReq *>(task.arg);
+    if (old->store != req->store) {
+        return false;
+    }
+    old->new_cost = req->new_cost;
+    delete req;
+    return true;
+}
+
+static bool
+merge_store_discount(Task* pending, Task task)
+{
+    SetStoreDiscountReq *old = static_cast<SetStoreDiscountReq *>(pending->arg);
+    SetStoreDiscountReq *req = static_cast<SetStoreDiscountReq *>(task.arg);
+    if (old->store != req->store) {
+        return false;
+    }
+    old->new_discount = req->new_discount;
+    delete req;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue_supplier_task --
+ *
+ *      Enqueue a supplier task, merging it into a queued request it
+ *      makes redundant: price and discount changes of the same item,
+ *      and shipping cost and store discount changes, supersede the
+ *      queued one; stock additions to the same item are summed.
+ *      Adding or removing an item fences off that item's queued
+ *      requests, so the store ends up exactly as if every request
+ *      had been handled in order.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+enqueue_supplier_task(TaskQueue* queue, Task task)
+{
+    if (task.handler == change_item_price_handler) {
+        ChangeItemPriceReq *req = static_cast<ChangeItemPriceReq *>(task.arg);
+        queue->enqueueCoalesced(task, req->item_id, CHANGE_ITEM_PRICE,
+                                merge_price);
+    } else if (task.handler == change_item_discount_handler) {
+        ChangeItemDiscountReq *req =
+            static_cast<ChangeItemDiscountReq *>(task.arg);
+        queue->enqueueCoalesced(task, req->item_id, CHANGE_ITEM_DISCOUNT,
+                                merge_discount);
+    } else if (task.handler == add_stock_handler) {
+        AddStockReq *req = static_cast<AddStockReq *>(task.arg);
+        queue->enqueueCoalesced(task, req->item_id, ADD_STOCK, merge_stock);
+    } else if (task.handler == set_shipping_cost_handler) {
+        // Store-wide requests have no item; use group -1.
+        queue->enqueueCoalesced(task, -1, SET_SHIPPING_COST,
+                                merge_shipping_cost);
+    } else if (task.handler == set_store_discount_handler) {
+        queue->enqueueCoalesced(task, -1, SET_STORE_DISCOUNT,
+                                merge_store_discount);
+    } else if (task.handler == add_item_handler) {
+        queue->enqueueFence(task, static_cast<AddItemReq *>(task.arg)->item_id);
+    } else if (task.handler == remove_item_handler) {
+        queue->enqueueFence(task,
+                            static_cast<RemoveItemReq *>(task.arg)->item_id);
+    } else {
+        queue->enqueue(task);
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * buy_item_handler --
@@ -190,7 +420,14 @@ buy_item_handler(void *args)
     BuyItemReq *req = static_cast<BuyItemReq *>(args);
     printf("buy_item_handler: item_id=%d, budget=%.2f\n", req->item_id, req->budget);
 
-    req->store->buyItem(req->item_id, req->budget);
+    if (req->slo_ns > 0) {
+        struct timespec deadline;
+        sthread_deadline(&deadline, req->slo_ns);
+        req->store->buyItemUntil(req->item_id, req->budget, deadline);
+    }
+    else {
+        req->store->buyItem(req->item_id, req->budget);
+    }
 
     delete req;
 }
@@ -214,8 +451,13 @@ buy_many_items_handler(void *args)
     BuyManyItemsReq *req = static_cast<BuyManyItemsReq *>(args);
     printf("buy_many_items_handler: budget=%.2f\n", req->budget);
 
-    if (req->store != nullptr) {
-        req->store->buyManyItems(&req->item_ids, req->budget);
+    if (req->store != nullptr && req->slo_ns > 0) {
+        struct timespec deadline;
+        sthread_deadline(&deadline, req->slo_ns);
+        req->store->buyManyItemsUntil(&req->item_ids, req->budget, deadline);
+    }
+    else if (req->store != nullptr) {
+        req->store->buyManyItemsBlocking(&req->item_ids, req->budget);
     }
     else {
         printf("buy_many_items_handler: Error - store pointer is null.\n");
@@ -223,6 +465,73 @@ buy_many_items_handler(void *args)
     delete req;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * quote_handler --
+ *
+ *      Handle a QuoteReq.
+ *
+ *      Delete the request object when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+quote_handler(void *args)
+{
+    QuoteReq *req = static_cast<QuoteReq *>(args);
+
+    if (req->store != nullptr) {
+        double cost;
+        if (req->store->quoteMany(req->item_ids, &cost)) {
+            printf("quote_handler: items=%zu cost=%.2f\n",
+                   req->item_ids.size(), cost);
+        }
+        else {
+            printf("quote_handler: items=%zu not carried\n",
+                   req->item_ids.size());
+        }
+    }
+    else {
+        printf("quote_handler: Error - store pointer is null.\n");
+    }
+    delete req;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reserve_handler --
+ *
+ *      Handle a ReserveReq: hold the items, then commit the hold
+ *      or leave it to expire.
+ *
+ *      Delete the request object when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+reserve_handler(void *args)
+{
+    ReserveReq *req = static_cast<ReserveReq *>(args);
+
+    if (req->store != nullptr) {
+        HoldToken token = req->store->reserve(req->item_ids, HOLD_TTL_NS);
+        printf("reserve_handler: items=%zu %s\n", req->item_ids.size(),
+               token == 0 ? "not held" :
+               req->commit && req->store->commit(token) ? "bought" :
+               "left to expire");
+    }
+    else {
+        printf("reserve_handler: Error - store pointer is null.\n");
+    }
+    delete req;
+}
+
 /*
  * ------------------------------------------------------------------
  * stop_handler --
@@ -242,7 +551,6 @@ stop_handler(void* args)
     
     if (stop_flag != nullptr) {
         *stop_flag = true;
-    } else {
-        printf("stop_handler: stop_flag is null.\n");
     }
+    sthread_exit();
 }
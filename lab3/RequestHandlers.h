@@ -1,5 +1,9 @@
 #pragma once
 
+#include <vector>
+#include "EStore.h"
+#include "TaskQueue.h"
+
 void add_item_handler(void *args);
 void remove_item_handler(void *args);
 void add_stock_handler(void *args);
@@ -7,8 +11,13 @@ void change_item_price_handler(void *args);
 void change_item_discount_handler(void *args);
 void set_shipping_cost_handler(void *args);
 void set_store_discount_handler(void *args);
+void enqueue_supplier_task(TaskQueue* queue, Task task);
+bool batch_supplier_task(Task task, std::vector<SupplierOp> &batch,
+                         EStore **store);
 
 void buy_item_handler(void *args);
 void buy_many_items_handler(void *args);
+void quote_handler(void *args);
+void reserve_handler(void *args);
 
 void stop_handler(void *args);
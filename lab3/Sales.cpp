@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Sales.h"
+
+using namespace std;
+
+static long
+currentInterval()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count() /
+           SALES_INTERVAL_NS;
+}
+
+
+SalesCounters::
+SalesCounters(int capacity)
+    : numPages((capacity + SALES_PAGE_ITEMS - 1) / SALES_PAGE_ITEMS),
+      owners(MAX_SALES_THREADS)
+{
+    // Zeroed memory is null pointers; pages never used stay
+    // untouched.
+    pages = static_cast<atomic<SalesEntry*>*>(
+        calloc((size_t) MAX_SALES_THREADS * numPages, sizeof(*pages)));
+    assert(pages != nullptr);
+    for (SalesSlot &s : slots) {
+        for (int b = 0; b < SALES_INTERVALS; b++) {
+            s.interval[b].store(-1, memory_order_relaxed);
+            s.revenue[b].store(0.0, memory_order_relaxed);
+        }
+    }
+}
+
+SalesCounters::
+~SalesCounters()
+{
+    int n = owners.limit();
+    for (int t = 0; t < n; t++) {
+        for (int p = 0; p < numPages; p++) {
+            delete[] pageTable(t)[p].load(memory_order_relaxed);
+        }
+    }
+    free(pages);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * slot --
+ *
+ *      Return the calling thread's slot number, claiming one the
+ *      first time the thread records a sale (see EpochDomain::slot).
+ *
+ * ------------------------------------------------------------------
+ */
+int SalesCounters::slot()
+{
+    int index = owners.claim();
+    if (index < 0) {
+        fprintf(stderr, "SalesCounters: more than %d threads at once\n",
+                MAX_SALES_THREADS);
+        exit(-1);
+    }
+    return index;
+}
+
+SalesEntry* SalesCounters::entry(int t, int item_id)
+{
+    atomic<SalesEntry*> &page = pageTable(t)[item_id / SALES_PAGE_ITEMS];
+    SalesEntry *entries = page.load(memory_order_relaxed);
+    if (entries == nullptr) {
+        entries = new SalesEntry[SALES_PAGE_ITEMS]();
+        page.store(entries, memory_order_release);
+    }
+    return &entries[item_id % SALES_PAGE_ITEMS];
+}
+
+/*
+ * ------------------------------------------------------------------
+ * recordSale / recordFailure --
+ *
+ *      Count units of the item bought for revenue, or a purchase
+ *      attempt including it that was turned down. Ids outside the
+ *      store's capacity are ignored.
+ *
+ * ------------------------------------------------------------------
+ */
+void SalesCounters::recordSale(int item_id, int units, double revenue)
+{
+    if (item_id < 0 || item_id >= numPages * SALES_PAGE_ITEMS) {
+        return;
+    }
+    int t = slot();
+    SalesSlot &s = slots[t];
+    SalesEntry *e = entry(t, item_id);
+    e->units.store(e->units.load(memory_order_relaxed) + units,
+                   memory_order_relaxed);
+    e->revenue.store(e->revenue.load(memory_order_relaxed) + revenue,
+                     memory_order_relaxed);
+
+    long now = currentInterval();
+    int b = now % SALES_INTERVALS;
+    if (s.interval[b].load(memory_order_relaxed) != now) {
+        // The bucket last held SALES_INTERVALS intervals ago.
+        s.revenue[b].store(0.0, memory_order_relaxed);
+        s.interval[b].store(now, memory_order_release);
+    }
+    s.revenue[b].store(s.revenue[b].load(memory_order_relaxed) + revenue,
+                       memory_order_relaxed);
+}
+
+void SalesCounters::recordFailure(int item_id)
+{
+    if (item_id < 0 || item_id >= numPages * SALES_PAGE_ITEMS) {
+        return;
+    }
+    SalesEntry *e = entry(slot(), item_id);
+    e->failed.store(e->failed.load(memory_order_relaxed) + 1,
+                    memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sumPage --
+ *
+ *      Add up every thread's counters for the ids of one page into
+ *      sums, which has SALES_PAGE_ITEMS entries.
+ *
+ * ------------------------------------------------------------------
+ */
+void SalesCounters::sumPage(int page, vector<ItemSales> &sums)
+{
+    for (int i = 0; i < SALES_PAGE_ITEMS; i++) {
+        sums[i] = ItemSales{page * SALES_PAGE_ITEMS + i, 0, 0, 0.0};
+    }
+    int n = owners.limit();
+    for (int t = 0; t < n; t++) {
+        SalesEntry *entries = pageTable(t)[page].load(memory_order_acquire);
+        if (entries == nullptr) {
+            continue;
+        }
+        for (int i = 0; i < SALES_PAGE_ITEMS; i++) {
+            sums[i].units += entries[i].units.load(memory_order_relaxed);
+            sums[i].failed += entries[i].failed.load(memory_order_relaxed);
+            sums[i].revenue += entries[i].revenue.load(memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * item --
+ *
+ *      Return the sales of one item, summed over every thread.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemSales SalesCounters::item(int item_id)
+{
+    ItemSales sales = {item_id, 0, 0, 0.0};
+    if (item_id < 0 || item_id >= numPages * SALES_PAGE_ITEMS) {
+        return sales;
+    }
+    int page = item_id / SALES_PAGE_ITEMS;
+    int n = owners.limit();
+    for (int t = 0; t < n; t++) {
+        SalesEntry *entries = pageTable(t)[page].load(memory_order_acquire);
+        if (entries != nullptr) {
+            SalesEntry &e = entries[item_id % SALES_PAGE_ITEMS];
+            sales.units += e.units.load(memory_order_relaxed);
+            sales.failed += e.failed.load(memory_order_relaxed);
+            sales.revenue += e.revenue.load(memory_order_relaxed);
+        }
+    }
+    return sales;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * top --
+ *
+ *      Return the (at most) n items with the most revenue, most
+ *      first. Only pages some thread recorded a sale in are read.
+ *
+ * ------------------------------------------------------------------
+ */
+vector<ItemSales> SalesCounters::top(int n)
+{
+    auto more = [](const ItemSales &a, const ItemSales &b) {
+        return a.revenue > b.revenue ||
+               (a.revenue == b.revenue && a.item_id < b.item_id);
+    };
+
+    vector<ItemSales> best;
+    vector<ItemSales> sums(SALES_PAGE_ITEMS);
+    int threads = owners.limit();
+    for (int page = 0; page < numPages && n > 0; page++) {
+        bool touched = false;
+        for (int t = 0; t < threads && !touched; t++) {
+            touched = pageTable(t)[page].load(memory_order_acquire) !=
+                      nullptr;
+        }
+        if (!touched) {
+            continue;
+        }
+
+        sumPage(page, sums);
+        for (const ItemSales &s : sums) {
+            if (s.units > 0) {
+                best.push_back(s);
+            }
+        }
+        // Keep the candidates down to the n best so far.
+        if (best.size() > (size_t) 2 * n) {
+            nth_element(best.begin(), best.begin() + n, best.end(), more);
+            best.resize(n);
+        }
+    }
+    sort(best.begin(), best.end(), more);
+    if (best.size() > (size_t) max(n, 0)) {
+        best.resize(max(n, 0));
+    }
+    return best;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * revenue --
+ *
+ *      Return the revenue of each of the last intervals intervals
+ *      (at most SALES_INTERVALS), the current one first.
+ *
+ * ------------------------------------------------------------------
+ */
+vector<double> SalesCounters::revenue(int intervals)
+{
+    intervals = max(0, min(intervals, SALES_INTERVALS));
+    vector<double> totals(intervals, 0.0);
+    long now = currentInterval();
+    int n = owners.limit();
+    for (int k = 0; k < intervals; k++) {
+        long when = now - k;
+        int b = when % SALES_INTERVALS;
+        for (int t = 0; t < n; t++) {
+            if (slots[t].interval[b].load(memory_order_acquire) == when) {
+                totals[k] += slots[t].revenue[b].load(memory_order_relaxed);
+            }
+        }
+    }
+    return totals;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "ItemTable.h"
+#include "ThreadSlots.h"
+
+// Most threads that can record sales in one SalesCounters at once;
+// every buyer also takes an EpochSlot, so the same bound.
+#define MAX_SALES_THREADS 256
+
+// Item ids per lazily allocated page of counters.
+#define SALES_PAGE_ITEMS  1024
+
+// Revenue is kept for the last SALES_INTERVALS intervals of
+// SALES_INTERVAL_NS each.
+#define SALES_INTERVALS   16
+#define SALES_INTERVAL_NS 1000000000L
+
+/*
+ * ------------------------------------------------------------------
+ * ItemSales --
+ *
+ *      What was sold of one item.
+ *
+ *      units   -- units bought.
+ *      revenue -- what they were bought for.
+ *      failed  -- purchase attempts that included the item and
+ *                 were turned down.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemSales {
+    int item_id;
+    long units;
+    long failed;
+    double revenue;
+};
+
+struct SalesEntry {
+    std::atomic<long> units;
+    std::atomic<long> failed;
+    std::atomic<double> revenue;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SalesSlot --
+ *
+ *      The counters of one thread. Only the owning thread writes
+ *      them, with plain loads and stores (no read-modify-write), so
+ *      recording a sale touches no cache line another thread
+ *      writes. interval[b] is the interval whose revenue bucket b
+ *      holds.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) SalesSlot {
+    std::atomic<long> interval[SALES_INTERVALS];
+    std::atomic<double> revenue[SALES_INTERVALS];
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SalesCounters --
+ *
+ *      Per-thread sales counters for the items of one store, merged
+ *      only when they are read. Readers sum every thread's slot
+ *      without taking a lock, so they never hold up a buyer; what
+ *      they return is a close, not an instantaneous, view: a sale
+ *      recorded while they read may or may not be counted.
+ *
+ *      The per-item counters of thread slot t for the ids from
+ *      p * SALES_PAGE_ITEMS on are in the page pages[t * numPages +
+ *      p], which the thread allocates the first time it records one
+ *      of them. A slot outlives its thread: the next thread to
+ *      claim it adds to its counters.
+ *
+ * ------------------------------------------------------------------
+ */
+class SalesCounters {
+    private:
+    const int numPages;
+    SalesSlot slots[MAX_SALES_THREADS];
+    ThreadSlots owners;
+    std::atomic<SalesEntry*>* pages;
+
+    int slot();
+    std::atomic<SalesEntry*>* pageTable(int t) { return pages + t * numPages; }
+    SalesEntry* entry(int t, int item_id);
+    void sumPage(int page, std::vector<ItemSales> &sums);
+
+    public:
+    explicit SalesCounters(int capacity);
+    ~SalesCounters();
+
+    SalesCounters(const SalesCounters&) = delete;
+    SalesCounters& operator=(const SalesCounters &) = delete;
+
+    void recordSale(int item_id, int units, double revenue);
+    void recordFailure(int item_id);
+
+    ItemSales item(int item_id);
+    std::vector<ItemSales> top(int n);
+    std::vector<double> revenue(int intervals);
+};
@@ -0,0 +1,1059 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include "ShardedStore.h"
+
+using namespace std;
+
+
+Shard::
+Shard(ShardedStore* owner, int shardIndex, int numItems)
+    : store(owner), index(shardIndex), items(numItems, ShardItem()),
+      shippingCost(3.0), storeDiscount(0.0), pricingVersion(0), held(0),
+      heldShort(false),
+      generation(0), sleeping(false)
+{
+    smutex_init(&mtx);
+    scond_init(&cond);
+}
+
+Shard::
+~Shard()
+{
+    smutex_destroy(&mtx);
+    scond_destroy(&cond);
+}
+
+
+ShardedStore::
+ShardedStore(int shardCount, int capacity, SalesCounters* salesCounters)
+    : numShards(shardCount), sales(salesCounters),
+      clients(MAX_SHARD_CLIENTS),
+      shippingCost(3.0), storeDiscount(0.0), pricingVersion(0),
+      changeWaiters(0), orderCounters()
+{
+    assert(numShards > 0);
+    smutex_init(&pricingMtx);
+    smutex_init(&changeMtx);
+    scond_init(&changeCond);
+
+    int perShard = (capacity + numShards - 1) / numShards;
+    for (int s = 0; s < numShards; s++) {
+        shards.push_back(new Shard(this, s, perShard));
+    }
+    for (Shard *shard : shards) {
+        sthread_create(&shard->thread, ownerMain, shard);
+    }
+}
+
+ShardedStore::
+~ShardedStore()
+{
+    for (int s = 0; s < numShards; s++) {
+        sendAsync(s, SHARD_STOP, 0, 0, 0.0);
+    }
+    for (Shard *shard : shards) {
+        sthread_join(shard->thread);
+        delete shard;
+    }
+    smutex_destroy(&pricingMtx);
+    smutex_destroy(&changeMtx);
+    scond_destroy(&changeCond);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * clientSlot --
+ *
+ *      Return the calling thread's client number, which picks the
+ *      inbox it uses on every shard. A thread gets a number the
+ *      first time it uses the store and keeps it until it exits;
+ *      the next thread to get it goes on from the messages its
+ *      predecessor left in the inboxes, which the owners handle
+ *      first (see ThreadSlots).
+ *
+ *      More than MAX_SHARD_CLIENTS threads using the store at once
+ *      is fatal.
+ *
+ * ------------------------------------------------------------------
+ */
+int ShardedStore::clientSlot()
+{
+    int slot = clients.claim();
+    if (slot < 0) {
+        fprintf(stderr, "ShardedStore: more than %d clients at once\n",
+                MAX_SHARD_CLIENTS);
+        exit(-1);
+    }
+    return slot;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * send / sendAsync / broadcastPricing / wait --
+ *
+ *      Send a message to the owner of a shard through the calling
+ *      thread's inbox, waiting for room if the inbox is full.
+ *      sendAsync allocates a message nobody will wait for;
+ *      broadcastPricing sends every shard the current store-wide
+ *      pricing (caller holds pricingMtx). wait spins until the
+ *      owner has handled a message.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::send(int s, ShardMsg* msg)
+{
+    Shard &shard = *shards[s];
+    SpscQueue<ShardMsg*, SHARD_QUEUE_SIZE> &inbox = shard.inbox[clientSlot()];
+    while (!inbox.tryPush(msg)) {
+        wake(shard);
+        sthread_yield();
+    }
+    wake(shard);
+}
+
+void ShardedStore::sendAsync(int s, ShardOp op, int item_id, int count,
+                             double value)
+{
+    ShardMsg *msg = new ShardMsg();
+    msg->op = op;
+    msg->async = true;
+    msg->item_id = item_id;
+    msg->count = count;
+    msg->value = value;
+    send(s, msg);
+}
+
+void ShardedStore::broadcastPricing()
+{
+    for (int s = 0; s < numShards; s++) {
+        ShardMsg *msg = new ShardMsg();
+        msg->op = SHARD_PRICING;
+        msg->async = true;
+        msg->value = shippingCost;
+        msg->discount = storeDiscount;
+        msg->version = pricingVersion;
+        send(s, msg);
+    }
+}
+
+void ShardedStore::wait(ShardMsg* msg)
+{
+    while (!msg->done.load(memory_order_acquire)) {
+        sthread_yield();
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wake --
+ *
+ *      Wake the owner of the shard if it went to sleep. Called after
+ *      a message was pushed: the owner sets sleeping before its last
+ *      look at its inboxes, so either it sees the message or we see
+ *      sleeping.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::wake(Shard &shard)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (shard.sleeping.load(memory_order_relaxed)) {
+        smutex_lock(&shard.mtx);
+        scond_signal(&shard.cond, &shard.mtx);
+        smutex_unlock(&shard.mtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ownerMain / runOwner --
+ *
+ *      The owner thread of a shard. Handle the messages in every
+ *      inbox, and sleep when all of them are empty. After a
+ *      SHARD_STOP, exit once the inboxes have been drained.
+ *
+ * ------------------------------------------------------------------
+ */
+void* ShardedStore::ownerMain(void* arg)
+{
+    Shard *shard = static_cast<Shard*>(arg);
+    shard->store->runOwner(*shard);
+    return nullptr;
+}
+
+void ShardedStore::runOwner(Shard &shard)
+{
+    bool stopping = false;
+    while (true) {
+        bool busy = false;
+        int n = clients.limit();
+        for (int c = 0; c < n; c++) {
+            ShardMsg *msg;
+            // Take at most a queue's worth from each client per pass,
+            // so one busy client cannot starve the others.
+            for (int i = 0; i < SHARD_QUEUE_SIZE &&
+                            shard.inbox[c].tryPop(msg); i++) {
+                busy = true;
+                if (!handle(shard, msg)) {
+                    stopping = true;
+                }
+            }
+        }
+        if (busy) {
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+
+        smutex_lock(&shard.mtx);
+        shard.sleeping.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool idle = true;
+        n = clients.limit();
+        for (int c = 0; c < n && idle; c++) {
+            idle = shard.inbox[c].empty();
+        }
+        if (idle) {
+            scond_wait(&shard.cond, &shard.mtx);
+        }
+        shard.sleeping.store(false, memory_order_relaxed);
+        smutex_unlock(&shard.mtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * slot / find --
+ *
+ *      Return the shard's record for an item id it owns, or null if
+ *      the id is out of range. find also returns null unless the
+ *      item was added.
+ *
+ * ------------------------------------------------------------------
+ */
+ShardItem* ShardedStore::slot(Shard &shard, int item_id)
+{
+    if (item_id < 0) {
+        return nullptr;
+    }
+    size_t index = item_id / numShards;
+    return index < shard.items.size() ? &shard.items[index] : nullptr;
+}
+
+ShardItem* ShardedStore::find(Shard &shard, int item_id)
+{
+    ShardItem *item = slot(shard, item_id);
+    return item != nullptr && item->present ? item : nullptr;
+}
+
+double ShardedStore::unitCost(const Shard &shard, const ShardItem &item) const
+{
+    return item.price * (1 - item.discount) * (1 - shard.storeDiscount) +
+           shard.shippingCost;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * priceLines --
+ *
+ *      Price the lines of an order the shard owns.
+ *
+ * Results:
+ *      SHARD_NOT_CARRIED if the shard does not carry one of the
+ *      items, otherwise SHARD_UNAVAILABLE if one is short on stock,
+ *      otherwise SHARD_OK. *cost is what the lines cost either way,
+ *      and lineCosts[i] what line i costs.
+ *
+ * ------------------------------------------------------------------
+ */
+ShardStatus ShardedStore::priceLines(Shard &shard,
+                                     const vector<ShardLine> &lines,
+                                     double* cost, vector<double> &lineCosts)
+{
+    ShardStatus status = SHARD_OK;
+    *cost = 0.0;
+    lineCosts.clear();
+    for (const ShardLine &line : lines) {
+        ShardItem *item = find(shard, line.item_id);
+        if (item == nullptr || !item->valid) {
+            return SHARD_NOT_CARRIED;
+        }
+        if (item->quantity < line.count) {
+            status = SHARD_UNAVAILABLE;
+        }
+        lineCosts.push_back(line.count * unitCost(shard, *item));
+        *cost += lineCosts.back();
+    }
+    return status;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * changed --
+ *
+ *      Called by the owner after a change that could let a blocked
+ *      order through: bump the shard's generation and wake any
+ *      blocked orders so they can check it.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::changed(Shard &shard)
+{
+    shard.generation.fetch_add(1, memory_order_seq_cst);
+    if (changeWaiters.load(memory_order_seq_cst) > 0) {
+        smutex_lock(&changeMtx);
+        scond_broadcast(&changeCond, &changeMtx);
+        smutex_unlock(&changeMtx);
+    }
+}
+
+// The message that carries out a supplier request.
+static ShardOp
+shardOp(SupplierRequestTypes type)
+{
+    switch (type) {
+    case ADD_ITEM:             return SHARD_ADD_ITEM;
+    case REMOVE_ITEM:          return SHARD_REMOVE_ITEM;
+    case ADD_STOCK:            return SHARD_ADD_STOCK;
+    case CHANGE_ITEM_PRICE:    return SHARD_PRICE_ITEM;
+    default:                   return SHARD_DISCOUNT_ITEM;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * update --
+ *
+ *      Carry out one item request (SHARD_ADD_ITEM through
+ *      SHARD_DISCOUNT_ITEM) in the shard's owner thread.
+ *
+ * Results:
+ *      true if the change could let a blocked order through, so the
+ *      caller must call changed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::update(Shard &shard, ShardOp op, int item_id, int count,
+                          double value, double discount)
+{
+    ShardItem *item;
+    switch (op) {
+    case SHARD_ADD_ITEM:
+        item = slot(shard, item_id);
+        if (item != nullptr && !item->present) {
+            item->present = true;
+            item->valid = true;
+            item->quantity = count;
+            item->price = value;
+            item->discount = discount;
+        }
+        break;
+    case SHARD_REMOVE_ITEM:
+        item = find(shard, item_id);
+        if (item != nullptr && item->valid) {
+            item->valid = false;
+            return true;
+        }
+        break;
+    case SHARD_ADD_STOCK:
+        item = find(shard, item_id);
+        if (item != nullptr && item->valid) {
+            item->quantity += count;
+            return true;
+        }
+        break;
+    case SHARD_PRICE_ITEM:
+        item = find(shard, item_id);
+        if (item != nullptr && item->valid) {
+            bool decreased = value < item->price;
+            item->price = value;
+            return decreased;
+        }
+        break;
+    case SHARD_DISCOUNT_ITEM:
+        item = find(shard, item_id);
+        if (item != nullptr && item->valid) {
+            bool increased = value > item->discount;
+            item->discount = value;
+            return increased;
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * updatePricing --
+ *
+ *      Take the store-wide pricing a SHARD_PRICING or SHARD_BATCH
+ *      carries, unless the shard already has that version or a
+ *      newer one (sent by another client, whose inbox the owner
+ *      happened to read first).
+ *
+ * Results:
+ *      true if the change could let a blocked order through, so the
+ *      caller must call changed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::updatePricing(Shard &shard, const ShardMsg* msg)
+{
+    if (msg->version <= shard.pricingVersion) {
+        return false;
+    }
+    bool cheaper = msg->value < shard.shippingCost ||
+                   msg->discount > shard.storeDiscount;
+    shard.shippingCost = msg->value;
+    shard.storeDiscount = msg->discount;
+    shard.pricingVersion = msg->version;
+    return cheaper;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * handle --
+ *
+ *      Carry out one message, in the shard's owner thread, and
+ *      reply to it (or free it, if nobody waits for a reply).
+ *
+ * Results:
+ *      false if the message was SHARD_STOP.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::handle(Shard &shard, ShardMsg* msg)
+{
+    ShardItem *item;
+    int units = 0;
+    if (msg->lines != nullptr) {
+        for (const ShardLine &line : *msg->lines) {
+            units += line.count;
+        }
+    }
+
+    switch (msg->op) {
+    case SHARD_ADD_ITEM:
+    case SHARD_REMOVE_ITEM:
+    case SHARD_ADD_STOCK:
+    case SHARD_PRICE_ITEM:
+    case SHARD_DISCOUNT_ITEM:
+        if (update(shard, msg->op, msg->item_id, msg->count, msg->value,
+                   msg->discount)) {
+            changed(shard);
+        }
+        break;
+    case SHARD_PRICING:
+        if (updatePricing(shard, msg)) {
+            changed(shard);
+        }
+        break;
+    case SHARD_BATCH:
+    {
+        // One generation bump for the whole batch.
+        bool any = msg->version != 0 && updatePricing(shard, msg);
+        for (const SupplierOp &op : *msg->batch) {
+            any |= update(shard, shardOp(op.type), op.item_id, op.count,
+                          op.value, op.discount);
+        }
+        if (any) {
+            changed(shard);
+        }
+        delete msg->batch;
+        break;
+    }
+    case SHARD_DISCOUNT_RANGE:
+    case SHARD_SCALE_PRICES:
+    {
+        // Bulk updates are one message per shard; wake blocked
+        // orders once for all of the shard's items.
+        bool decreased = false;
+        size_t first = 0;
+        size_t last = shard.items.size();
+        if (msg->op == SHARD_DISCOUNT_RANGE) {
+            first = (max(msg->item_id, 0) + numShards - 1 - shard.index) /
+                    numShards;
+            last = msg->count < shard.index
+                       ? 0
+                       : min(last, (size_t) (msg->count - shard.index) /
+                                       numShards + 1);
+        }
+        for (size_t i = first; i < last; i++) {
+            item = &shard.items[i];
+            if (!item->present || !item->valid) {
+                continue;
+            }
+            if (msg->op == SHARD_DISCOUNT_RANGE) {
+                decreased |= msg->value > item->discount;
+                item->discount = msg->value;
+            } else {
+                double price = item->price * msg->value;
+                decreased |= price < item->price;
+                item->price = price;
+            }
+        }
+        if (decreased) {
+            changed(shard);
+        }
+        break;
+    }
+    case SHARD_RESERVE:
+        msg->version = shard.pricingVersion;
+        msg->status = priceLines(shard, *msg->lines, &msg->cost,
+                                 msg->lineCosts);
+        if (msg->status == SHARD_OK && msg->cost > msg->budget) {
+            msg->status = SHARD_UNAVAILABLE;
+        }
+        if (msg->status == SHARD_OK) {
+            for (const ShardLine &line : *msg->lines) {
+                find(shard, line.item_id)->quantity -= line.count;
+            }
+            if (msg->partial) {
+                shard.held += units;
+            }
+        } else if (shard.held > 0) {
+            shard.heldShort = true;
+        }
+        break;
+    case SHARD_COMMIT:
+        units = msg->count;
+        // Fall through.
+    case SHARD_RELEASE:
+        if (msg->op == SHARD_RELEASE) {
+            for (const ShardLine &line : *msg->lines) {
+                find(shard, line.item_id)->quantity += line.count;
+            }
+            if (shard.heldShort) {
+                changed(shard);
+            }
+        }
+        shard.held -= units;
+        if (shard.held == 0) {
+            shard.heldShort = false;
+        }
+        break;
+    case SHARD_QUOTE:
+        msg->version = shard.pricingVersion;
+        msg->status = priceLines(shard, *msg->lines, &msg->cost,
+                                 msg->lineCosts);
+        break;
+    case SHARD_STOP:
+        break;
+    }
+
+    bool stop = msg->op == SHARD_STOP;
+    if (msg->async) {
+        delete msg;
+    } else {
+        msg->done.store(true, memory_order_release);
+    }
+    return !stop;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * splitOrder --
+ *
+ *      Split an order into one list of lines per shard. An id
+ *      listed more than once becomes one line for that many units.
+ *
+ * Results:
+ *      false if one of the ids can never be carried.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::splitOrder(const vector<int> &item_ids,
+                              vector<vector<ShardLine> > &parts)
+{
+    vector<int> ids(item_ids);
+    sort(ids.begin(), ids.end());
+
+    parts.assign(numShards, vector<ShardLine>());
+    for (size_t i = 0; i < ids.size(); i++) {
+        int id = ids[i];
+        if (id < 0) {
+            return false;
+        }
+        vector<ShardLine> &part = parts[id % numShards];
+        if (i > 0 && ids[i - 1] == id) {
+            part.back().count++;
+        } else {
+            part.push_back(ShardLine{id, 1});
+        }
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryOrder --
+ *
+ *      Try once to buy an order that was split with splitOrder.
+ *      Every shard of the order reserves its part in parallel. If
+ *      they all could and the total is within budget, the order is
+ *      bought and the reservations are committed; otherwise the
+ *      parts that were reserved are put back. If the parts were
+ *      priced under different pricing versions, they are put back
+ *      and reserved again, until they agree.
+ *
+ * Results:
+ *      SHARD_OK if the order was bought, SHARD_NOT_CARRIED if the
+ *      store does not carry one of its items, SHARD_UNAVAILABLE if
+ *      it is short on stock or over budget.
+ *
+ * ------------------------------------------------------------------
+ */
+ShardStatus ShardedStore::tryOrder(const vector<vector<ShardLine> > &parts,
+                                   double budget)
+{
+    int involved = 0;
+    for (const vector<ShardLine> &part : parts) {
+        if (!part.empty()) {
+            involved++;
+        }
+    }
+
+    vector<ShardMsg> msgs(numShards);
+    ShardStatus status;
+    bool retry;
+    do {
+        for (int s = 0; s < numShards; s++) {
+            if (!parts[s].empty()) {
+                msgs[s].op = SHARD_RESERVE;
+                msgs[s].partial = involved > 1;
+                msgs[s].lines = &parts[s];
+                msgs[s].budget = budget;
+                msgs[s].done.store(false, memory_order_relaxed);
+                send(s, &msgs[s]);
+            }
+        }
+
+        status = SHARD_OK;
+        double cost = 0.0;
+        for (int s = 0; s < numShards; s++) {
+            if (parts[s].empty()) {
+                continue;
+            }
+            wait(&msgs[s]);
+            if (msgs[s].status == SHARD_NOT_CARRIED || status == SHARD_OK) {
+                status = msgs[s].status;
+            }
+            cost += msgs[s].cost;
+        }
+        if (status == SHARD_OK && cost > budget) {
+            status = SHARD_UNAVAILABLE;
+        }
+        retry = !samePricing(parts, msgs);
+        if (retry) {
+            status = SHARD_UNAVAILABLE;
+        }
+        if (involved > 1) {
+            settleOrder(parts, msgs, status == SHARD_OK);
+        }
+    } while (retry);
+
+    orderCounters.orders++;
+    if (status == SHARD_OK) {
+        recordSales(parts, msgs);
+        orderCounters.commits++;
+    } else {
+        orderCounters.rejected++;
+    }
+    return status;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * settleOrder --
+ *
+ *      Commit (commit set) or put back the parts of a multi-shard
+ *      order that were reserved.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::settleOrder(const vector<vector<ShardLine> > &parts,
+                               vector<ShardMsg> &msgs, bool commit)
+{
+    for (int s = 0; s < numShards; s++) {
+        if (parts[s].empty() || msgs[s].status != SHARD_OK) {
+            continue;
+        }
+        if (commit) {
+            int units = 0;
+            for (const ShardLine &line : parts[s]) {
+                units += line.count;
+            }
+            sendAsync(s, SHARD_COMMIT, 0, units, 0.0);
+        } else {
+            msgs[s].op = SHARD_RELEASE;
+            msgs[s].done.store(false, memory_order_relaxed);
+            send(s, &msgs[s]);
+            wait(&msgs[s]);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * samePricing --
+ *
+ *      Return whether every part of an order was priced under the
+ *      same pricing version.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::samePricing(const vector<vector<ShardLine> > &parts,
+                               const vector<ShardMsg> &msgs)
+{
+    int first = -1;
+    for (int s = 0; s < numShards; s++) {
+        if (parts[s].empty()) {
+            continue;
+        }
+        if (first < 0) {
+            first = s;
+        } else if (msgs[s].version != msgs[first].version) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * recordSales --
+ *
+ *      Count a bought order in sales, each line at the cost its
+ *      owner reserved it for.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::recordSales(const vector<vector<ShardLine> > &parts,
+                               const vector<ShardMsg> &msgs)
+{
+    for (int s = 0; s < numShards; s++) {
+        for (size_t i = 0; i < parts[s].size(); i++) {
+            sales->recordSale(parts[s][i].item_id, parts[s][i].count,
+                              msgs[s].lineCosts[i]);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Supplier operations --
+ *
+ *      Sent to the owner of the item (or to every owner, for the
+ *      store-wide settings) without waiting for them to be done.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::addItem(int item_id, int quantity, double price,
+                           double discount)
+{
+    if (item_id < 0) {
+        return;
+    }
+    ShardMsg *msg = new ShardMsg();
+    msg->op = SHARD_ADD_ITEM;
+    msg->async = true;
+    msg->item_id = item_id;
+    msg->count = quantity;
+    msg->value = price;
+    msg->discount = discount;
+    send(item_id % numShards, msg);
+}
+
+void ShardedStore::removeItem(int item_id)
+{
+    if (item_id >= 0) {
+        sendAsync(item_id % numShards, SHARD_REMOVE_ITEM, item_id, 0, 0.0);
+    }
+}
+
+void ShardedStore::addStock(int item_id, int count)
+{
+    if (item_id >= 0) {
+        sendAsync(item_id % numShards, SHARD_ADD_STOCK, item_id, count, 0.0);
+    }
+}
+
+void ShardedStore::priceItem(int item_id, double price)
+{
+    if (item_id >= 0) {
+        sendAsync(item_id % numShards, SHARD_PRICE_ITEM, item_id, 0, price);
+    }
+}
+
+void ShardedStore::discountItem(int item_id, double discount)
+{
+    if (item_id >= 0) {
+        sendAsync(item_id % numShards, SHARD_DISCOUNT_ITEM, item_id, 0,
+                  discount);
+    }
+}
+
+void ShardedStore::discountRange(int first, int last, double discount)
+{
+    for (int s = 0; s < numShards; s++) {
+        sendAsync(s, SHARD_DISCOUNT_RANGE, first, last, discount);
+    }
+}
+
+void ShardedStore::scalePrices(double factor)
+{
+    for (int s = 0; s < numShards; s++) {
+        sendAsync(s, SHARD_SCALE_PRICES, 0, 0, factor);
+    }
+}
+
+void ShardedStore::setShippingCost(double cost)
+{
+    smutex_lock(&pricingMtx);
+    shippingCost = cost;
+    pricingVersion++;
+    broadcastPricing();
+    smutex_unlock(&pricingMtx);
+}
+
+void ShardedStore::setStoreDiscount(double discount)
+{
+    smutex_lock(&pricingMtx);
+    storeDiscount = discount;
+    pricingVersion++;
+    broadcastPricing();
+    smutex_unlock(&pricingMtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyBatch --
+ *
+ *      Send each shard, in one message, the requests of the batch
+ *      for the items it owns, in batch order. Store-wide pricing
+ *      changes do not depend on the item requests, so if there are
+ *      any, every shard gets the pricing they leave behind, under
+ *      one new version.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedStore::applyBatch(const vector<SupplierOp> &ops)
+{
+    vector<vector<SupplierOp>*> parts(numShards, nullptr);
+    bool repriced = false;
+    smutex_lock(&pricingMtx);
+    for (const SupplierOp &op : ops) {
+        if (op.type == SET_SHIPPING_COST) {
+            shippingCost = op.value;
+            repriced = true;
+            continue;
+        }
+        if (op.type == SET_STORE_DISCOUNT) {
+            storeDiscount = op.value;
+            repriced = true;
+            continue;
+        }
+        if (op.item_id < 0) {
+            continue;
+        }
+        int s = op.item_id % numShards;
+        if (parts[s] == nullptr) {
+            parts[s] = new vector<SupplierOp>();
+        }
+        parts[s]->push_back(op);
+    }
+    if (repriced) {
+        pricingVersion++;
+    }
+
+    for (int s = 0; s < numShards; s++) {
+        if (parts[s] == nullptr && !repriced) {
+            continue;
+        }
+        ShardMsg *msg = new ShardMsg();
+        msg->op = SHARD_BATCH;
+        msg->async = true;
+        msg->batch = parts[s] != nullptr ? parts[s]
+                                         : new vector<SupplierOp>();
+        if (repriced) {
+            msg->value = shippingCost;
+            msg->discount = storeDiscount;
+            msg->version = pricingVersion;
+        }
+        send(s, msg);
+    }
+    smutex_unlock(&pricingMtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItems --
+ *
+ *      Buy the items if the order can be bought right now.
+ *
+ * Results:
+ *      true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::buyManyItems(const vector<int> &item_ids, double budget)
+{
+    vector<vector<ShardLine> > parts;
+    return splitOrder(item_ids, parts) &&
+           tryOrder(parts, budget) == SHARD_OK;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsBlocking --
+ *
+ *      Buy the items, waiting until the order is in stock and
+ *      within budget, or until deadline if it is not null (see
+ *      EStore::buyManyItemsUntil).
+ *
+ *      The generations of the order's shards are read before each
+ *      attempt. An attempt that fails can only succeed once one of
+ *      those shards changed in the order's favor, which bumps its
+ *      generation, so the order sleeps until one of them moves.
+ *
+ * Results:
+ *      PURCHASE_BOUGHT, PURCHASE_NOT_CARRIED if the store does not
+ *      carry one of the items, or PURCHASE_TIMED_OUT.
+ *
+ * ------------------------------------------------------------------
+ */
+PurchaseStatus ShardedStore::buyManyItemsBlocking(
+    const vector<int> &item_ids, double budget,
+    const struct timespec* deadline)
+{
+    vector<vector<ShardLine> > parts;
+    if (!splitOrder(item_ids, parts)) {
+        return PURCHASE_NOT_CARRIED;
+    }
+
+    vector<unsigned> seen(numShards);
+    bool woken = false;
+    bool expired = false;
+    while (true) {
+        for (int s = 0; s < numShards; s++) {
+            seen[s] = shards[s]->generation.load(memory_order_seq_cst);
+        }
+        ShardStatus status = tryOrder(parts, budget);
+        if (status != SHARD_UNAVAILABLE) {
+            return status == SHARD_OK ? PURCHASE_BOUGHT
+                                      : PURCHASE_NOT_CARRIED;
+        }
+        if (expired) {
+            orderCounters.timeouts++;
+            return PURCHASE_TIMED_OUT;
+        }
+
+        if (woken) {
+            orderCounters.spuriousWakeups++;
+        }
+        orderCounters.waits++;
+        smutex_lock(&changeMtx);
+        changeWaiters.fetch_add(1, memory_order_seq_cst);
+        while (!expired) {
+            bool moved = false;
+            for (int s = 0; s < numShards && !moved; s++) {
+                moved = !parts[s].empty() &&
+                        shards[s]->generation.load(memory_order_seq_cst) !=
+                        seen[s];
+            }
+            if (moved) {
+                break;
+            }
+            if (deadline == nullptr) {
+                scond_wait(&changeCond, &changeMtx);
+            } else {
+                expired = !scond_timedwait(&changeCond, &changeMtx,
+                                           deadline);
+            }
+        }
+        changeWaiters.fetch_sub(1, memory_order_seq_cst);
+        smutex_unlock(&changeMtx);
+        if (!expired) {
+            orderCounters.wakeups++;
+        }
+        woken = !expired;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quoteMany / carries --
+ *
+ *      Ask the owners what the order would cost (see
+ *      EStore::quoteMany), and whether the store carries an item.
+ *
+ * ------------------------------------------------------------------
+ */
+bool ShardedStore::quoteMany(const vector<int> &item_ids, double* cost)
+{
+    vector<vector<ShardLine> > parts;
+    if (!splitOrder(item_ids, parts)) {
+        return false;
+    }
+
+    vector<ShardMsg> msgs(numShards);
+    bool carried;
+    double total;
+    do {
+        for (int s = 0; s < numShards; s++) {
+            if (!parts[s].empty()) {
+                msgs[s].op = SHARD_QUOTE;
+                msgs[s].lines = &parts[s];
+                msgs[s].done.store(false, memory_order_relaxed);
+                send(s, &msgs[s]);
+            }
+        }
+
+        carried = true;
+        total = 0.0;
+        for (int s = 0; s < numShards; s++) {
+            if (!parts[s].empty()) {
+                wait(&msgs[s]);
+                carried = carried && msgs[s].status != SHARD_NOT_CARRIED;
+                total += msgs[s].cost;
+            }
+        }
+    } while (!samePricing(parts, msgs));
+    if (carried) {
+        *cost = total;
+    }
+    return carried;
+}
+
+bool ShardedStore::carries(int item_id)
+{
+    double cost;
+    return quoteMany(vector<int>(1, item_id), &cost);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * orderStats --
+ *
+ *      Return a copy of the order counters (see OrderStats).
+ *
+ * ------------------------------------------------------------------
+ */
+OrderStats ShardedStore::orderStats()
+{
+    OrderStats stats = OrderStats();
+    stats.orders = orderCounters.orders;
+    stats.commits = orderCounters.commits;
+    stats.rejected = orderCounters.rejected;
+    stats.waits = orderCounters.waits;
+    stats.wakeups = orderCounters.wakeups;
+    stats.spuriousWakeups = orderCounters.spuriousWakeups;
+    stats.timeouts = orderCounters.timeouts;
+    return stats;
+}
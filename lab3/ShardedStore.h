@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "sthread.h"
+#include "EStore.h"
+#include "SpscQueue.h"
+#include "ThreadSlots.h"
+
+// Most threads that can talk to one ShardedStore at once.
+#define MAX_SHARD_CLIENTS 64
+
+// Messages one client can have in flight to one shard.
+#define SHARD_QUEUE_SIZE  256
+
+class ShardedStore;
+
+enum ShardOp {
+    SHARD_ADD_ITEM,
+    SHARD_REMOVE_ITEM,
+    SHARD_ADD_STOCK,
+    SHARD_PRICE_ITEM,
+    SHARD_DISCOUNT_ITEM,
+    SHARD_DISCOUNT_RANGE,
+    SHARD_SCALE_PRICES,
+    SHARD_BATCH,
+    SHARD_PRICING,
+    SHARD_RESERVE,
+    SHARD_COMMIT,
+    SHARD_RELEASE,
+    SHARD_QUOTE,
+    SHARD_STOP
+};
+
+enum ShardStatus {
+    SHARD_OK,
+    SHARD_NOT_CARRIED,
+    SHARD_UNAVAILABLE
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ShardLine --
+ *
+ *      count units of item item_id, as part of an order.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ShardLine {
+    int item_id;
+    int count;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ShardMsg --
+ *
+ *      A request to the owner of one shard, and its reply.
+ *
+ *      Requests whose sender waits for the reply live on the
+ *      sender's stack; the owner sets done once it has filled in
+ *      status and cost, and never touches the message again.
+ *      Mutations nobody waits for (async) are allocated with new
+ *      and deleted by the owner.
+ *
+ *      A SHARD_RESERVE is partial if the order spans several
+ *      shards, so the owner must hold on to the units until a
+ *      SHARD_COMMIT (count units) or SHARD_RELEASE follows.
+ *
+ *      A SHARD_DISCOUNT_RANGE covers the ids from item_id to count
+ *      (inclusive) that the shard owns.
+ *
+ *      A SHARD_BATCH carries the item requests of a supplier batch
+ *      that concern the shard, in batch, which the owner deletes.
+ *
+ *      A SHARD_PRICING, or a SHARD_BATCH with a nonzero version,
+ *      carries the store-wide pricing as of pricing version
+ *      version: shipping cost in value, store discount in discount.
+ *
+ *      A SHARD_RESERVE or SHARD_QUOTE also reports what each line
+ *      costs in lineCosts, so the sender can count the sale, and
+ *      the pricing version it priced them at in version.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ShardMsg {
+    ShardOp op;
+    bool async;
+    bool partial;
+    int item_id;
+    int count;
+    double value;
+    double discount;
+    double budget;
+    uint64_t version;
+    const std::vector<ShardLine>* lines;
+    std::vector<SupplierOp>* batch;
+
+    ShardStatus status;
+    double cost;
+    std::vector<double> lineCosts;
+    std::atomic<bool> done;
+
+    ShardMsg()
+        : op(SHARD_STOP), async(false), partial(false), item_id(0),
+          count(0), value(0.0), discount(0.0), budget(0.0), version(0),
+          lines(nullptr),
+          batch(nullptr), status(SHARD_OK), cost(0.0), done(false)
+    { }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ShardItem --
+ *
+ *      An item as its owner sees it. Only the owner thread ever
+ *      reads or writes it, so it needs neither locks nor atomics.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ShardItem {
+    bool present;
+    bool valid;
+    int quantity;
+    double price;
+    double discount;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Shard --
+ *
+ *      One partition of the item ids (those equal to index modulo
+ *      the number of shards), the thread that owns it, and the
+ *      queues through which everyone else talks to that thread.
+ *
+ *      inbox[c] carries the messages of client c, the c-th thread
+ *      to use the store, so every queue has one producer and one
+ *      consumer. An owner with nothing to do sets sleeping and
+ *      waits on cond; senders signal it only if sleeping is set.
+ *
+ *      generation is bumped by the owner after every change that
+ *      could let a blocked order through (see
+ *      ShardedStore::buyManyItemsBlocking).
+ *
+ *      held counts units taken by reservations that are part of a
+ *      multi-shard order and not yet committed or released, and
+ *      heldShort records that a reservation was turned down while
+ *      some were held, so releasing them must bump generation.
+ *
+ * ------------------------------------------------------------------
+ */
+class alignas(CACHE_LINE_SIZE) Shard {
+    public:
+    ShardedStore* store;
+    int index;
+    sthread_t thread;
+    std::vector<ShardItem> items;
+    double shippingCost;
+    double storeDiscount;
+    uint64_t pricingVersion;
+    long held;
+    bool heldShort;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> generation;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> sleeping;
+    smutex_t mtx;
+    scond_t cond;
+
+    SpscQueue<ShardMsg*, SHARD_QUEUE_SIZE> inbox[MAX_SHARD_CLIENTS];
+
+    Shard(ShardedStore* owner, int shardIndex, int numItems);
+    ~Shard();
+
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard &) = delete;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ShardedStore --
+ *
+ *      The shared-nothing backend of EStore's sharded mode. Item id
+ *      i is owned by shard i % numShards, and all of its state is
+ *      only ever touched by that shard's owner thread: other
+ *      threads send the owner messages through per-sender SPSC
+ *      queues. Store-wide pricing is copied into every shard, as of
+ *      a pricing version: every change gets the next version and is
+ *      sent to all owners, which keep the newest copy they got.
+ *
+ *      Mutations are asynchronous. A thread's messages to one shard
+ *      are handled in the order it sent them, so a thread always
+ *      sees its own earlier mutations.
+ *
+ *      An order is split by owner. If it touches one shard, the
+ *      owner decides it alone. Otherwise every owner reserves its
+ *      part (taking the units out of stock) and reports what it
+ *      costs; the sender commits if every part was reserved and the
+ *      total is within budget, and releases the reserved parts
+ *      otherwise. Each owner prices its part with its own copy of
+ *      the store-wide pricing and reports its version; parts priced
+ *      under different versions are put back and the order tried
+ *      again, so an order (or a quote) is priced under one pricing
+ *      throughout, as in the other modes. The sender counts a
+ *      bought order in sales, in its own per-thread counters.
+ *
+ * ------------------------------------------------------------------
+ */
+class ShardedStore {
+    private:
+    const int numShards;
+    SalesCounters* const sales;
+    std::vector<Shard*> shards;
+    ThreadSlots clients;
+
+    // The store-wide pricing and its version. Changes take
+    // pricingMtx, so versions reach every owner in the same order.
+    smutex_t pricingMtx;
+    double shippingCost;
+    double storeDiscount;
+    uint64_t pricingVersion;
+
+    // Orders blocked in buyManyItemsBlocking wait here for the
+    // generation of one of their shards to change.
+    smutex_t changeMtx;
+    scond_t changeCond;
+    std::atomic<int> changeWaiters;
+
+    struct {
+        std::atomic<long> orders;
+        std::atomic<long> commits;
+        std::atomic<long> rejected;
+        std::atomic<long> waits;
+        std::atomic<long> wakeups;
+        std::atomic<long> spuriousWakeups;
+        std::atomic<long> timeouts;
+    } orderCounters;
+
+    int clientSlot();
+    void send(int shard, ShardMsg* msg);
+    void sendAsync(int shard, ShardOp op, int item_id, int count,
+                   double value);
+    void broadcastPricing();
+    void wait(ShardMsg* msg);
+    void wake(Shard &shard);
+
+    bool splitOrder(const std::vector<int> &item_ids,
+                    std::vector<std::vector<ShardLine> > &parts);
+    ShardStatus tryOrder(const std::vector<std::vector<ShardLine> > &parts,
+                         double budget);
+    void settleOrder(const std::vector<std::vector<ShardLine> > &parts,
+                     std::vector<ShardMsg> &msgs, bool commit);
+    bool samePricing(const std::vector<std::vector<ShardLine> > &parts,
+                     const std::vector<ShardMsg> &msgs);
+
+    static void* ownerMain(void* arg);
+    void runOwner(Shard &shard);
+    bool handle(Shard &shard, ShardMsg* msg);
+    bool update(Shard &shard, ShardOp op, int item_id, int count,
+                double value, double discount);
+    bool updatePricing(Shard &shard, const ShardMsg* msg);
+    void changed(Shard &shard);
+    ShardItem* slot(Shard &shard, int item_id);
+    ShardItem* find(Shard &shard, int item_id);
+    double unitCost(const Shard &shard, const ShardItem &item) const;
+    ShardStatus priceLines(Shard &shard, const std::vector<ShardLine> &lines,
+                           double* cost, std::vector<double> &lineCosts);
+    void recordSales(const std::vector<std::vector<ShardLine> > &parts,
+                     const std::vector<ShardMsg> &msgs);
+
+    public:
+    ShardedStore(int shardCount, int capacity, SalesCounters* salesCounters);
+    ~ShardedStore();
+
+    ShardedStore(const ShardedStore&) = delete;
+    ShardedStore& operator=(const ShardedStore &) = delete;
+
+    void addItem(int item_id, int quantity, double price, double discount);
+    void removeItem(int item_id);
+    void addStock(int item_id, int count);
+    void priceItem(int item_id, double price);
+    void discountItem(int item_id, double discount);
+    void discountRange(int first, int last, double discount);
+    void scalePrices(double factor);
+    void setShippingCost(double cost);
+    void setStoreDiscount(double discount);
+    void applyBatch(const std::vector<SupplierOp> &ops);
+
+    bool buyManyItems(const std::vector<int> &item_ids, double budget);
+    PurchaseStatus buyManyItemsBlocking(const std::vector<int> &item_ids,
+                                        double budget,
+                                        const struct timespec* deadline);
+    bool quoteMany(const std::vector<int> &item_ids, double* cost);
+    bool carries(int item_id);
+
+    OrderStats orderStats();
+};
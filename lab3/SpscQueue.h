@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include "ItemTable.h"
+
+/*
+ * ------------------------------------------------------------------
+ * SpscQueue --
+ *
+ *      A bounded, lock-free queue for exactly one producer thread and
+ *      one consumer thread. SIZE must be a power of two.
+ *
+ *      head is only written by the consumer and tail only by the
+ *      producer, each on its own cache line. Each side also keeps a
+ *      private copy of the other side's index and only rereads the
+ *      shared one when the copy says the queue is full (empty), so
+ *      in steady state a push or pop touches no cache line the
+ *      other thread is writing except the slot itself.
+ *
+ * ------------------------------------------------------------------
+ */
+template <typename T, unsigned SIZE>
+class SpscQueue {
+    private:
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head;
+    unsigned cachedTail;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail;
+    unsigned cachedHead;
+
+    alignas(CACHE_LINE_SIZE) T ring[SIZE];
+
+    public:
+    SpscQueue() : head(0), cachedTail(0), tail(0), cachedHead(0) { }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue &) = delete;
+
+    // Producer only. Returns false if the queue is full.
+    bool tryPush(const T &value)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead == SIZE) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead == SIZE)
+                return false;
+        }
+        ring[t & (SIZE - 1)] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool tryPop(T &value)
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+                return false;
+        }
+        value = ring[h & (SIZE - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool empty()
+    {
+        return head.load(std::memory_order_relaxed) ==
+               tail.load(std::memory_order_acquire);
+    }
+};
@@ -1,9 +1,12 @@
 
 #include "TaskQueue.h"
+#include <climits>
 #include <queue>
 
 TaskQueue::
-TaskQueue()
+TaskQueue(bool lockFree)
+    : sleepers(0), merged(0),
+      ring(lockFree ? new MpmcQueue<Task, TASK_RING_SIZE>() : nullptr)
 {
     // TODO: Your code here.
     //Initialize mutex
@@ -22,6 +25,8 @@ TaskQueue::
     
     //Initialize condition variable
     scond_destroy(&cond);
+
+    delete ring;
 }
 
 /*
@@ -39,6 +44,9 @@ int TaskQueue::
 size()
 {
     // TODO: Your code here.
+    if (ring != nullptr) {
+        return ring->size();
+    }
     smutex_lock(&mtx);
     int size = taskQueue.size();
     smutex_unlock(&mtx);
@@ -60,6 +68,9 @@ bool TaskQueue::
 empty()
 {
     // TODO: Your code here.
+    if (ring != nullptr) {
+        return ring->size() == 0;
+    }
     smutex_lock(&mtx);
     bool empty = taskQueue.empty();
     smutex_unlock(&mtx);
@@ -81,12 +92,154 @@ void TaskQueue::
 enqueue(Task task)
 {
     // TODO: Your code here.
+    if (ring != nullptr) {
+        ringPush(task);
+        return;
+    }
     smutex_lock(&mtx);
-    taskQueue.push(task);
-    scond_signal(&cond, &mtx);
+    push(task, false, TaskKey(0, 0));
+    wake(1);
     smutex_unlock(&mtx);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * enqueueMany --
+ *
+ *      Insert the tasks at the back of the queue, in order, in one
+ *      critical section, and wake a sleeping consumer for each. In
+ *      a lock-free queue they go into the ring one at a time, each
+ *      waking at most one parked consumer.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueMany(const std::vector<Task>& tasks)
+{
+    if (ring != nullptr) {
+        for (const Task& task : tasks) {
+            ringPush(task);
+        }
+        return;
+    }
+    smutex_lock(&mtx);
+    for (const Task& task : tasks) {
+        push(task, false, TaskKey(0, 0));
+    }
+    wake(tasks.size());
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueCoalesced --
+ *
+ *      Insert the task at the back of the queue under the key
+ *      (group, kind), unless a task with that key is still queued
+ *      and merge folds this one into it.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueCoalesced(Task task, long group, int kind, merge_t merge)
+{
+    if (ring != nullptr) {
+        ringPush(task);
+        return;
+    }
+    TaskKey key(group, kind);
+    smutex_lock(&mtx);
+    auto it = mergeable.find(key);
+    if (it != mergeable.end() && merge(&it->second->task, task)) {
+        merged++;
+    } else {
+        push(task, true, key);
+        wake(1);
+    }
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueFence --
+ *
+ *      Insert the task at the back of the queue, and stop tasks of
+ *      the group enqueued after it from being merged into ones
+ *      before it.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueFence(Task task, long group)
+{
+    if (ring != nullptr) {
+        ringPush(task);
+        return;
+    }
+    smutex_lock(&mtx);
+    mergeable.erase(mergeable.lower_bound(TaskKey(group, INT_MIN)),
+                    mergeable.upper_bound(TaskKey(group, INT_MAX)));
+    push(task, false, TaskKey(0, 0));
+    wake(1);
+    smutex_unlock(&mtx);
+}
+
+// Append a task. Caller holds mtx, and wakes consumers for it.
+void TaskQueue::
+push(Task task, bool keyed, TaskKey key)
+{
+    taskQueue.push(QueuedTask{task, keyed, key});
+    if (keyed) {
+        // std::queue is a deque, so the element stays put.
+        mergeable[key] = &taskQueue.back();
+    }
+}
+
+// Wake a sleeping consumer for each of the tasks just queued, as
+// far as there are any. Caller holds mtx.
+void TaskQueue::
+wake(int tasks)
+{
+    for (int i = 0; i < tasks && i < sleepers; i++) {
+        scond_signal(&cond, &mtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringPush --
+ *
+ *      Append a task to the ring, parking on notFull while it is
+ *      full, and wake a consumer parked on notEmpty.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+ringPush(Task task)
+{
+    while (!ring->tryPush(task)) {
+        unsigned key = notFull.prepareWait();
+        if (ring->tryPush(task)) {
+            notFull.cancelWait();
+            break;
+        }
+        notFull.wait(key);
+    }
+    notEmpty.notify();
+}
+
 /*
  * ------------------------------------------------------------------
  * dequeue --
@@ -103,14 +256,158 @@ Task TaskQueue::
 dequeue()
 {
     // TODO: Your code here.
+    if (ring != nullptr) {
+        return ringPop();
+    }
     smutex_lock(&mtx);
     //Wait until the queue is not empty
     while(taskQueue.empty()){
+        sleepers++;
         scond_wait(&cond, &mtx);
+        sleepers--;
+    }
+    Task task = pop();
+    smutex_unlock(&mtx);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueUpTo --
+ *
+ *      Remove up to max Tasks from the front of the queue and
+ *      append them to tasks, in order. If the queue is empty, block
+ *      until a Task is inserted; then take whatever else is queued
+ *      by then, without waiting for more, but leave one task for
+ *      each other consumer still asleep (or woken and yet to run),
+ *      so that a batch never holds up a task an idle consumer could
+ *      have run.
+ *
+ * Results:
+ *      The number of Tasks removed, at least 1.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+dequeueUpTo(std::vector<Task>& tasks, int max)
+{
+    int n = 1;
+    if (ring != nullptr) {
+        tasks.push_back(ringPop());
+        Task task;
+        while (n < max && ring->size() > (size_t) notEmpty.waiting() &&
+               ring->tryPop(task)) {
+            notFull.notify();
+            tasks.push_back(task);
+            n++;
+        }
+        return n;
+    }
+    smutex_lock(&mtx);
+    while (taskQueue.empty()) {
+        sleepers++;
+        scond_wait(&cond, &mtx);
+        sleepers--;
+    }
+    tasks.push_back(pop());
+    while (n < max && (int) taskQueue.size() > sleepers) {
+        tasks.push_back(pop());
+        n++;
+    }
+    smutex_unlock(&mtx);
+    return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryDequeue --
+ *
+ *      Remove the Task at the front of the queue into *task, if
+ *      there is one. Never blocks.
+ *
+ * Results:
+ *      true if a Task was removed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+tryDequeue(Task* task)
+{
+    if (ring != nullptr) {
+        if (!ring->tryPop(*task)) {
+            return false;
+        }
+        notFull.notify();
+        return true;
+    }
+    smutex_lock(&mtx);
+    bool found = !taskQueue.empty();
+    if (found) {
+        *task = pop();
     }
-    Task task = taskQueue.front();
-    taskQueue.pop();
     smutex_unlock(&mtx);
+    return found;
+}
+
+// Remove the task at the front; once it leaves the queue nothing
+// more can be merged into it. Caller holds mtx, queue is not empty.
+Task TaskQueue::
+pop()
+{
+    QueuedTask &front = taskQueue.front();
+    if (front.keyed) {
+        auto it = mergeable.find(front.key);
+        if (it != mergeable.end() && it->second == &front) {
+            mergeable.erase(it);
+        }
+    }
+    Task task = front.task;
+    taskQueue.pop();
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringPop --
+ *
+ *      Remove the task at the front of the ring, parking on
+ *      notEmpty while it is empty, and wake a producer parked on
+ *      notFull.
+ *
+ * Results:
+ *      The task.
+ *
+ * ------------------------------------------------------------------
+ */
+Task TaskQueue::
+ringPop()
+{
+    Task task;
+    while (!ring->tryPop(task)) {
+        unsigned key = notEmpty.prepareWait();
+        if (ring->tryPop(task)) {
+            notEmpty.cancelWait();
+            break;
+        }
+        notEmpty.wait(key);
+    }
+    notFull.notify();
     return task;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * mergedCount --
+ *
+ *      Return how many tasks were merged into queued ones.
+ *
+ * ------------------------------------------------------------------
+ */
+long TaskQueue::
+mergedCount()
+{
+    smutex_lock(&mtx);
+    long count = merged;
+    smutex_unlock(&mtx);
+    return count;
+}
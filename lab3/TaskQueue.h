@@ -2,7 +2,12 @@
 
 
 #include "sthread.h"
+#include "EventCount.h"
+#include "MpmcQueue.h"
+#include <map>
 #include <queue>
+#include <utility>
+#include <vector>
 
 typedef void (*handler_t) (void *); 
 
@@ -11,6 +16,14 @@ struct Task {
     void* arg;
 };
 
+// Fold task into the queued task *pending (see enqueueCoalesced).
+// Returns false if the two cannot be combined after all.
+typedef bool (*merge_t) (Task* pending, Task task);
+
+// Slots in the ring of a lock-free TaskQueue (a power of two).
+// Producers block while it is full.
+#define TASK_RING_SIZE 1024
+
 /*
  * ------------------------------------------------------------------
  * TaskQueue --
@@ -18,17 +31,62 @@ struct Task {
  *      A thread-safe task queue. This queue should be implemented
  *      as a monitor.
  *
+ *      Tasks enqueued with enqueueCoalesced carry a key, (group,
+ *      kind): a task whose key matches one still in the queue is
+ *      merged into it instead of being queued, so it takes effect
+ *      at the earlier task's place in line. enqueueFence queues a
+ *      task past which no later task of its group is merged.
+ *
+ *      enqueueMany and dequeueUpTo move a batch of tasks per lock
+ *      round-trip; enqueueMany wakes one sleeping consumer per task
+ *      it queued, up to as many as sleep.
+ *
+ *      Constructed with lockFree set, the queue instead keeps its
+ *      tasks in a preallocated MpmcQueue of TASK_RING_SIZE slots:
+ *      producers and consumers claim slots with atomics and no
+ *      lock, and only park on an EventCount when the ring is empty
+ *      (consumers) or full (producers). There is no queued task to
+ *      look up by key in the ring, so enqueueCoalesced and
+ *      enqueueFence are plain enqueues and nothing is merged.
+ *
  * ------------------------------------------------------------------
  */
 class TaskQueue {
     private:
+    typedef std::pair<long, int> TaskKey;
+
+    struct QueuedTask {
+        Task task;
+        bool keyed;
+        TaskKey key;
+    };
+
     // TODO: More needed here.
-    std::queue<Task> taskQueue;
+    std::queue<QueuedTask> taskQueue;
     smutex_t mtx;
     scond_t cond;
+    // Consumers waiting on cond.
+    int sleepers;
+
+    // The queued task of each key that later tasks may still be
+    // merged into, and how many were.
+    std::map<TaskKey, QueuedTask*> mergeable;
+    long merged;
+
+    // The ring and what parks on it, when lock-free; nullptr
+    // otherwise.
+    MpmcQueue<Task, TASK_RING_SIZE>* const ring;
+    EventCount notEmpty;
+    EventCount notFull;
+
+    void push(Task task, bool keyed, TaskKey key);
+    Task pop();
+    void wake(int tasks);
+    void ringPush(Task task);
+    Task ringPop();
     
     public:
-    TaskQueue();
+    explicit TaskQueue(bool lockFree = false);
     ~TaskQueue();
     
     // no default copy constructor and assignment operators. this will prevent some
@@ -37,7 +95,13 @@ class TaskQueue {
     TaskQueue& operator=(const TaskQueue &) = delete;
 
     void enqueue(Task task);
+    void enqueueMany(const std::vector<Task>& tasks);
+    void enqueueCoalesced(Task task, long group, int kind, merge_t merge);
+    void enqueueFence(Task task, long group);
     Task dequeue();
+    int dequeueUpTo(std::vector<Task>& tasks, int max);
+    bool tryDequeue(Task* task);
+    long mergedCount();
 
     private:
     int size();
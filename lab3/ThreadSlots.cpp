@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "ThreadSlots.h"
+#include "sthread.h"
+
+using namespace std;
+
+// Gives every table a distinct id, so that a thread can tell the
+// tables it holds slots in apart even if one is freed and another
+// allocated at the same address.
+static atomic<long> nextTableId(0);
+
+// The tables alive, by id, and the lock that guards them and every
+// claim and release of a slot.
+static smutex_t tablesMtx = PTHREAD_MUTEX_INITIALIZER;
+static map<long, ThreadSlots*> tables;
+
+/*
+ * ------------------------------------------------------------------
+ * SlotClaims --
+ *
+ *      The (table id, slot) pairs a thread holds. Destroyed when
+ *      the thread exits, freeing the slots of the tables still
+ *      alive.
+ *
+ * ------------------------------------------------------------------
+ */
+struct SlotClaims {
+    vector<pair<long, int> > held;
+
+    ~SlotClaims()
+    {
+        smutex_lock(&tablesMtx);
+        for (const pair<long, int> &h : held) {
+            auto found = tables.find(h.first);
+            if (found != tables.end()) {
+                found->second->taken[h.second] = false;
+            }
+        }
+        smutex_unlock(&tablesMtx);
+    }
+};
+
+static thread_local SlotClaims claims;
+
+
+ThreadSlots::
+ThreadSlots(int slotCount)
+    : id(nextTableId++), capacity(slotCount),
+      taken(slotCount, false), highWater(0)
+{
+    smutex_lock(&tablesMtx);
+    tables[id] = this;
+    smutex_unlock(&tablesMtx);
+}
+
+ThreadSlots::
+~ThreadSlots()
+{
+    smutex_lock(&tablesMtx);
+    tables.erase(id);
+    smutex_unlock(&tablesMtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * claim --
+ *
+ *      Return the calling thread's slot, claiming the lowest free
+ *      one the first time the thread asks. A first claim also
+ *      forgets the slots the thread held in tables destroyed since,
+ *      so what it remembers does not grow with every table it ever
+ *      used.
+ *
+ *      A freed slot is handed over under tablesMtx, so whatever
+ *      its last holder did to the slot is visible to the next.
+ *
+ * Results:
+ *      The slot, or -1 if every slot is held by a live thread.
+ *
+ * ------------------------------------------------------------------
+ */
+int ThreadSlots::claim()
+{
+    for (const pair<long, int> &h : claims.held) {
+        if (h.first == id) {
+            return h.second;
+        }
+    }
+
+    smutex_lock(&tablesMtx);
+    claims.held.erase(
+        remove_if(claims.held.begin(), claims.held.end(),
+                  [](const pair<long, int> &h) {
+                      return tables.find(h.first) == tables.end();
+                  }),
+        claims.held.end());
+
+    int slot = -1;
+    for (int i = 0; i < capacity && slot < 0; i++) {
+        if (!taken[i]) {
+            taken[i] = true;
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        claims.held.push_back(make_pair(id, slot));
+        if (slot >= highWater.load(memory_order_relaxed)) {
+            highWater.store(slot + 1, memory_order_release);
+        }
+    }
+    smutex_unlock(&tablesMtx);
+    return slot;
+}
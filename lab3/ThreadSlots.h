@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+/*
+ * ------------------------------------------------------------------
+ * ThreadSlots --
+ *
+ *      Hands out the slots of a fixed-size per-thread table (an
+ *      EpochDomain's epoch slots, a ShardedStore's inboxes): each
+ *      thread that uses the table gets one slot of its own, and
+ *      keeps it until it exits, when the slot is freed for another
+ *      thread. So the table bounds how many threads use it at once,
+ *      not how many ever do.
+ *
+ *      A thread remembers the slots it holds in thread-local
+ *      storage, by table id, so finding its slot again takes no
+ *      lock. Claiming a slot, and freeing the slots of an exiting
+ *      thread, take a lock shared by all tables, which also keeps a
+ *      thread from freeing a slot of a table being destroyed.
+ *
+ * ------------------------------------------------------------------
+ */
+class ThreadSlots {
+    private:
+    const long id;
+    const int capacity;
+    // Guarded by the lock shared by all tables.
+    std::vector<bool> taken;
+    std::atomic<int> highWater;
+
+    friend struct SlotClaims;
+
+    public:
+    explicit ThreadSlots(int slotCount);
+    ~ThreadSlots();
+
+    ThreadSlots(const ThreadSlots&) = delete;
+    ThreadSlots& operator=(const ThreadSlots &) = delete;
+
+    int claim();
+
+    // One past the highest slot ever claimed: the slots that can
+    // be in use.
+    int limit() { return highWater.load(std::memory_order_acquire); }
+};
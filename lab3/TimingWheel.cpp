@@ -0,0 +1,178 @@
+#include <cassert>
+
+#include "TimingWheel.h"
+
+using namespace std;
+
+#define WHEEL_MASK ((uint64_t) WHEEL_SLOTS - 1)
+
+TimingWheel::
+TimingWheel(uint64_t now)
+    : slots(), current(now), count(0)
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * file --
+ *
+ *      Link a timer into the slot its distance from the current
+ *      tick calls for: level l if it expires within the next
+ *      WHEEL_SLOTS^(l + 1) ticks. A timer due now (only while
+ *      cascading) goes into the current tick's slot, which is about
+ *      to fire. One beyond the top level goes into the top-level
+ *      slot that comes around last, to be filed again from there.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimingWheel::file(WheelTimer* timer)
+{
+    uint64_t expires = timer->expires > current ? timer->expires : current;
+    uint64_t delta = expires - current;
+
+    WheelTimer **head = nullptr;
+    for (int level = 0; level < WHEEL_LEVELS && head == nullptr; level++) {
+        int shift = WHEEL_BITS * level;
+        if (delta < ((uint64_t) 1 << (shift + WHEEL_BITS))) {
+            head = &slots[level][(expires >> shift) & WHEEL_MASK];
+        }
+    }
+    if (head == nullptr) {
+        int shift = WHEEL_BITS * (WHEEL_LEVELS - 1);
+        head = &slots[WHEEL_LEVELS - 1][((current >> shift) - 1) & WHEEL_MASK];
+    }
+
+    timer->slot = head;
+    timer->prev = nullptr;
+    timer->next = *head;
+    if (*head != nullptr) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * schedule / cancel --
+ *
+ *      File a timer to expire at the given tick (the next tick if
+ *      that has passed), and take a filed timer out of the wheel
+ *      before it expires.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimingWheel::schedule(WheelTimer* timer, uint64_t expires)
+{
+    timer->expires = expires > current ? expires : current + 1;
+    file(timer);
+    count++;
+}
+
+void TimingWheel::cancel(WheelTimer* timer)
+{
+    assert(timer->slot != nullptr);
+    if (timer->prev != nullptr) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next != nullptr) {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = nullptr;
+    count--;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * cascade --
+ *
+ *      File the timers of the level's slot for the current tick one
+ *      or more levels down. Called when the current tick is the
+ *      first one the slot spans.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimingWheel::cascade(int level)
+{
+    WheelTimer **head =
+        &slots[level][(current >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    WheelTimer *timer = *head;
+    *head = nullptr;
+    while (timer != nullptr) {
+        WheelTimer *next = timer->next;
+        file(timer);
+        timer = next;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * advance --
+ *
+ *      Move the wheel on to tick now, appending every timer that
+ *      expired on the way to expired (no longer filed).
+ *
+ *      Each tick cascades the slots it starts, highest level first,
+ *      then fires its level 0 slot. An empty wheel jumps straight
+ *      to now.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimingWheel::advance(uint64_t now, vector<WheelTimer*> &expired)
+{
+    while (current < now) {
+        if (count == 0) {
+            current = now;
+            return;
+        }
+
+        current++;
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            uint64_t span = ((uint64_t) 1 << (WHEEL_BITS * level)) - 1;
+            if ((current & span) == 0) {
+                cascade(level);
+            }
+        }
+
+        WheelTimer **head = &slots[0][current & WHEEL_MASK];
+        WheelTimer *timer = *head;
+        *head = nullptr;
+        while (timer != nullptr) {
+            WheelTimer *next = timer->next;
+            timer->slot = nullptr;
+            expired.push_back(timer);
+            count--;
+            timer = next;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * nextEvent --
+ *
+ *      Return the next tick at which advance has something to do:
+ *      fire a level 0 slot or cascade a slot of a higher level.
+ *      Nothing happens before it, so whoever drives the wheel can
+ *      sleep until then.
+ *
+ * Results:
+ *      The tick, or UINT64_MAX if the wheel is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t TimingWheel::nextEvent() const
+{
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        uint64_t base = (current >> shift) + 1;
+        for (uint64_t index = 0; index < WHEEL_SLOTS; index++) {
+            if (slots[level][index] != nullptr) {
+                uint64_t tick = (base + ((index - base) & WHEEL_MASK)) << shift;
+                next = tick < next ? tick : next;
+            }
+        }
+    }
+    return next;
+}
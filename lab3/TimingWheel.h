@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Slots per level (a power of two) and levels of a TimingWheel. A
+// timer up to WHEEL_SLOTS^WHEEL_LEVELS ticks away is filed directly;
+// one further out is refiled each time its slot comes around.
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/*
+ * ------------------------------------------------------------------
+ * WheelTimer --
+ *
+ *      A timer filed in a TimingWheel: the tick it expires at, and
+ *      its links in the slot list it is filed in. Embedded in
+ *      whatever is timed, so that filing or cancelling one
+ *      allocates nothing.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WheelTimer {
+    uint64_t expires;
+    WheelTimer* prev;
+    WheelTimer* next;
+    WheelTimer** slot;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * TimingWheel --
+ *
+ *      A hierarchical timing wheel. Level 0 has one slot per tick
+ *      for the next WHEEL_SLOTS ticks; each slot of level l spans
+ *      WHEEL_SLOTS^l ticks. A timer is filed at the coarsest level
+ *      its distance calls for, and moves down a level each time the
+ *      slot it is in comes around (a cascade), so scheduling and
+ *      cancelling are O(1) and each timer is touched at most
+ *      WHEEL_LEVELS times before it fires, however many are filed.
+ *
+ *      Ticks are whatever unit the caller counts time in. The wheel
+ *      takes no lock; callers serialize access to it.
+ *
+ * ------------------------------------------------------------------
+ */
+class TimingWheel {
+    private:
+    WheelTimer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current;
+    size_t count;
+
+    void file(WheelTimer* timer);
+    void cascade(int level);
+
+    public:
+    explicit TimingWheel(uint64_t now);
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel &) = delete;
+
+    void schedule(WheelTimer* timer, uint64_t expires);
+    void cancel(WheelTimer* timer);
+    void advance(uint64_t now, std::vector<WheelTimer*> &expired);
+    uint64_t nextEvent() const;
+
+    size_t size() const { return count; }
+};
@@ -0,0 +1,168 @@
+#include "Waiter.h"
+
+
+Waiter::
+Waiter(size_t numLinks)
+    : signaled(false), links(numLinks)
+{
+    smutex_init(&mtx);
+    scond_init(&cond);
+    for (WaiterLink &link : links) {
+        link.waiter = this;
+        link.unitBudget = 0.0;
+        link.count = 1;
+    }
+}
+
+Waiter::
+~Waiter()
+{
+    smutex_destroy(&mtx);
+    scond_destroy(&cond);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signal --
+ *
+ *      Wake the waiter up. Signaling a waiter that was already
+ *      signaled does nothing.
+ *
+ * ------------------------------------------------------------------
+ */
+void Waiter::
+signal()
+{
+    smutex_lock(&mtx);
+    signaled = true;
+    scond_signal(&cond, &mtx);
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wait --
+ *
+ *      Block until the waiter is signaled, or until deadline (see
+ *      scond_timedwait) if it is not null. The caller clears
+ *      signaled before linking the waiter into any list.
+ *
+ * Results:
+ *      true if the waiter was signaled, false if the deadline
+ *      passed first.
+ *
+ * ------------------------------------------------------------------
+ */
+bool Waiter::
+wait(const struct timespec* deadline)
+{
+    smutex_lock(&mtx);
+    while (!signaled) {
+        if (deadline == nullptr) {
+            scond_wait(&cond, &mtx);
+        } else if (!scond_timedwait(&cond, &mtx, deadline)) {
+            break;
+        }
+    }
+    bool woken = signaled;
+    smutex_unlock(&mtx);
+    return woken;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * linkWaiter / unlinkWaiter --
+ *
+ *      Insert a link into a waiter list, keeping the list sorted by
+ *      unitBudget (highest first), and remove it again. Caller must
+ *      hold the lock protecting the list.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+linkWaiter(WaiterLink** head, WaiterLink* link)
+{
+    WaiterLink* prev = nullptr;
+    WaiterLink* next = *head;
+    while (next != nullptr && next->unitBudget >= link->unitBudget) {
+        prev = next;
+        next = next->next;
+    }
+
+    link->prev = prev;
+    link->next = next;
+    if (prev != nullptr) {
+        prev->next = link;
+    } else {
+        *head = link;
+    }
+    if (next != nullptr) {
+        next->prev = link;
+    }
+}
+
+void
+unlinkWaiter(WaiterLink** head, WaiterLink* link)
+{
+    if (link->prev != nullptr) {
+        link->prev->next = link->next;
+    } else {
+        *head = link->next;
+    }
+    if (link->next != nullptr) {
+        link->next->prev = link->prev;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signalWaiters --
+ *
+ *      Signal every waiter on the list. Caller must hold the lock
+ *      protecting the list.
+ *
+ * Results:
+ *      The number of waiters signaled.
+ *
+ * ------------------------------------------------------------------
+ */
+int
+signalWaiters(WaiterLink* head)
+{
+    int signaled = 0;
+    for (WaiterLink* link = head; link != nullptr; link = link->next) {
+        link->waiter->signal();
+        signaled++;
+    }
+    return signaled;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signalAffordableWaiters --
+ *
+ *      Signal the waiters on an item's list whose unitBudget covers
+ *      the item's new unit cost and who want no more units than are
+ *      in stock. The list is sorted by unitBudget, so the walk stops
+ *      at the first waiter that cannot afford the item. Caller must
+ *      hold the lock protecting the list.
+ *
+ * Results:
+ *      The number of waiters signaled.
+ *
+ * ------------------------------------------------------------------
+ */
+int
+signalAffordableWaiters(WaiterLink* head, double unitCost, int quantity)
+{
+    int signaled = 0;
+    for (WaiterLink* link = head;
+         link != nullptr && link->unitBudget >= unitCost;
+         link = link->next) {
+        if (link->count <= quantity) {
+            link->waiter->signal();
+            signaled++;
+        }
+    }
+    return signaled;
+}
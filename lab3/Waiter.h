@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include "sthread.h"
+
+class Waiter;
+
+/*
+ * ------------------------------------------------------------------
+ * WaiterLink --
+ *
+ *      Links a blocked customer into one waiter list.
+ *
+ *      The waiter list of an item is sorted by unitBudget, highest
+ *      first. unitBudget is the most one unit of the item may cost
+ *      (shipping included) for the customer's purchase to fit its
+ *      budget, given what the rest of the purchase cost when the
+ *      customer went to sleep. count is the number of units of the
+ *      item the customer wants.
+ *
+ *      That threshold goes stale as soon as another item of the
+ *      purchase gets cheaper, and two small cuts can bring the
+ *      purchase within budget although neither item's threshold was
+ *      met. So the unitBudget of a multi-item order is at least just
+ *      under the item's unit cost when the customer went to sleep
+ *      (see EStore::linkOrderWaiter): any cost drop on any of its
+ *      items wakes it, to check the whole order again.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WaiterLink {
+    Waiter* waiter;
+    double unitBudget;
+    int count;
+    WaiterLink* prev;
+    WaiterLink* next;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Waiter --
+ *
+ *      A customer blocked in EStore::buyItem or
+ *      EStore::buyManyItemsBlocking (or their Until variants). The
+ *      waiter sleeps on its own condition variable until signaled
+ *      is set, so whoever signals it wakes exactly one thread.
+ *
+ *      links holds one WaiterLink per list the waiter is linked
+ *      into: one per item it wants, plus (for orders) one for the
+ *      store's global list.
+ *
+ * ------------------------------------------------------------------
+ */
+class Waiter {
+    public:
+    smutex_t mtx;
+    scond_t cond;
+    bool signaled;
+    std::vector<WaiterLink> links;
+
+    explicit Waiter(size_t numLinks);
+    ~Waiter();
+
+    Waiter(const Waiter&) = delete;
+    Waiter& operator=(const Waiter &) = delete;
+
+    void signal();
+    bool wait(const struct timespec* deadline = nullptr);
+};
+
+void linkWaiter(WaiterLink** head, WaiterLink* link);
+void unlinkWaiter(WaiterLink** head, WaiterLink* link);
+int signalWaiters(WaiterLink* head);
+int signalAffordableWaiters(WaiterLink* head, double unitCost, int quantity);
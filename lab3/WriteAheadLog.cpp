@@ -0,0 +1,272 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "WriteAheadLog.h"
+
+using namespace std;
+
+// See nextTableId in ThreadSlots.cpp.
+static atomic<long> nextLogId(0);
+
+// The last LSN the calling thread appended, and to which log.
+static thread_local long lastLog = -1;
+static thread_local uint64_t lastLsn = 0;
+
+/*
+ * ------------------------------------------------------------------
+ * checksum --
+ *
+ *      FNV-1a over the record, with the checksum field zeroed.
+ *
+ * ------------------------------------------------------------------
+ */
+static uint32_t
+checksum(WalRecord record)
+{
+    record.checksum = 0;
+    const unsigned char *bytes = reinterpret_cast<unsigned char *>(&record);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(record); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+WriteAheadLog::
+WriteAheadLog()
+    : id(nextLogId++), fd(-1), appended(0), durable(0), flushing(false),
+      counters()
+{
+    smutex_init(&mtx);
+    scond_init(&flushed);
+}
+
+WriteAheadLog::
+~WriteAheadLog()
+{
+    syncAll();
+    if (fd >= 0) {
+        close(fd);
+    }
+    smutex_destroy(&mtx);
+    scond_destroy(&flushed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * open --
+ *
+ *      Open (or create) the log at path for appending, after reading
+ *      the records it already holds into records, starting after
+ *      the one with LSN from. A torn record at the end, and anything
+ *      after it, is cut off.
+ *
+ * Results:
+ *      false if the file could not be opened, or holds fewer than
+ *      from records.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WriteAheadLog::open(const char* path, uint64_t from,
+                         vector<WalRecord> &records)
+{
+    assert(fd < 0);
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("WriteAheadLog: open failed");
+        return false;
+    }
+
+    off_t start = from * sizeof(WalRecord);
+    if (lseek(fd, 0, SEEK_END) < start || lseek(fd, start, SEEK_SET) < 0) {
+        fprintf(stderr, "WriteAheadLog: %s is missing records\n", path);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    records.clear();
+    WalRecord record;
+    while (read(fd, &record, sizeof(record)) == (ssize_t) sizeof(record) &&
+           record.checksum == checksum(record)) {
+        records.push_back(record);
+    }
+
+    appended = durable = from + records.size();
+    off_t end = appended * sizeof(WalRecord);
+    if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0) {
+        perror("WriteAheadLog: truncate failed");
+        exit(-1);
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * append --
+ *
+ *      Buffer a record for the next flush.
+ *
+ * Results:
+ *      The record's LSN, to pass to sync.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t WriteAheadLog::append(WalRecord record)
+{
+    record.checksum = checksum(record);
+    smutex_lock(&mtx);
+    buffer.push_back(record);
+    uint64_t lsn = ++appended;
+    counters.records++;
+    smutex_unlock(&mtx);
+
+    lastLog = id;
+    lastLsn = lsn;
+    return lsn;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * appendMany --
+ *
+ *      Buffer several records for the next flush, with consecutive
+ *      LSNs and one acquisition of mtx. Fills in their checksums.
+ *
+ * Results:
+ *      The LSN of the first record, or 0 if there are none.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t WriteAheadLog::appendMany(vector<WalRecord> &records)
+{
+    if (records.empty()) {
+        return 0;
+    }
+    for (WalRecord &record : records) {
+        record.checksum = checksum(record);
+    }
+    smutex_lock(&mtx);
+    buffer.insert(buffer.end(), records.begin(), records.end());
+    uint64_t first = appended + 1;
+    appended += records.size();
+    counters.records += records.size();
+    uint64_t last = appended;
+    smutex_unlock(&mtx);
+
+    lastLog = id;
+    lastLsn = last;
+    return first;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sync --
+ *
+ *      Wait until the record with the given LSN, and every record
+ *      before it, is on disk, flushing them if nobody else is.
+ *
+ * ------------------------------------------------------------------
+ */
+void WriteAheadLog::sync(uint64_t lsn)
+{
+    smutex_lock(&mtx);
+    while (durable < lsn) {
+        if (flushing) {
+            scond_wait(&flushed, &mtx);
+            continue;
+        }
+
+        // Lead a flush of everything buffered so far.
+        flushing = true;
+        vector<WalRecord> batch;
+        batch.swap(buffer);
+        uint64_t target = appended;
+        smutex_unlock(&mtx);
+
+        const char *data = reinterpret_cast<const char *>(batch.data());
+        size_t left = batch.size() * sizeof(WalRecord);
+        while (left > 0) {
+            ssize_t n = write(fd, data, left);
+            if (n < 0) {
+                perror("WriteAheadLog: write failed");
+                exit(-1);
+            }
+            data += n;
+            left -= n;
+        }
+        if (fdatasync(fd) < 0) {
+            perror("WriteAheadLog: fdatasync failed");
+            exit(-1);
+        }
+
+        smutex_lock(&mtx);
+        durable = target;
+        flushing = false;
+        counters.syncs++;
+        scond_broadcast(&flushed, &mtx);
+    }
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commit --
+ *
+ *      Wait until every record the calling thread appended to this
+ *      log is on disk.
+ *
+ * ------------------------------------------------------------------
+ */
+void WriteAheadLog::commit()
+{
+    if (lastLog == id) {
+        sync(lastLsn);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * syncAll --
+ *
+ *      Wait until every record appended so far, by any thread, is on
+ *      disk.
+ *
+ * ------------------------------------------------------------------
+ */
+void WriteAheadLog::syncAll()
+{
+    smutex_lock(&mtx);
+    uint64_t lsn = appended;
+    smutex_unlock(&mtx);
+    sync(lsn);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * appendedLsn --
+ *
+ *      Return the LSN of the last record appended so far.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t WriteAheadLog::appendedLsn()
+{
+    smutex_lock(&mtx);
+    uint64_t lsn = appended;
+    smutex_unlock(&mtx);
+    return lsn;
+}
+
+WalStats WriteAheadLog::stats()
+{
+    smutex_lock(&mtx);
+    WalStats stats = counters;
+    smutex_unlock(&mtx);
+    return stats;
+}
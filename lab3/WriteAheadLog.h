@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "sthread.h"
+
+enum WalRecordType {
+    WAL_ADD_ITEM = 1,
+    WAL_REMOVE_ITEM,
+    WAL_ADD_STOCK,
+    WAL_PRICE_ITEM,
+    WAL_DISCOUNT_ITEM,
+    WAL_PRICING,
+    WAL_BUY
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WalRecord --
+ *
+ *      One logged mutation, as it is laid out on disk.
+ *
+ *      WAL_ADD_ITEM       -- item_id, count (quantity), price and
+ *                            discount.
+ *      WAL_REMOVE_ITEM    -- item_id.
+ *      WAL_ADD_STOCK      -- item_id, count.
+ *      WAL_PRICE_ITEM     -- item_id, price.
+ *      WAL_DISCOUNT_ITEM  -- item_id, discount.
+ *      WAL_PRICING        -- price is the shipping cost, discount
+ *                            the store discount.
+ *      WAL_BUY            -- count units of item_id were bought.
+ *
+ *      checksum covers the rest of the record, so a record torn by
+ *      a crash in the middle of a write is recognized on recovery.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WalRecord {
+    uint32_t type;
+    int32_t item_id;
+    int32_t count;
+    uint32_t checksum;
+    double price;
+    double discount;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WalStats --
+ *
+ *      records -- records appended.
+ *      syncs   -- writes + fdatasyncs that made them durable.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WalStats {
+    long records;
+    long syncs;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WriteAheadLog --
+ *
+ *      An append-only file of WalRecords, with group commit. The
+ *      LSN of a record is its position in the file, counting from
+ *      1, so it stays the same across restarts.
+ *
+ *      append only copies a record into an in-memory buffer and
+ *      numbers it (its LSN), so it is cheap enough to call while
+ *      holding the lock that orders the mutation it describes.
+ *      sync(lsn) then waits, outside of any such lock, until the
+ *      record is on disk: the first thread to need a flush becomes
+ *      the leader, writes out everything buffered so far with one
+ *      write and one fdatasync, and wakes every thread whose
+ *      records that covered. Threads arriving meanwhile wait for
+ *      the next flush, which again covers all of them.
+ *
+ * ------------------------------------------------------------------
+ */
+class WriteAheadLog {
+    private:
+    const long id;
+    int fd;
+
+    smutex_t mtx;
+    scond_t flushed;
+    std::vector<WalRecord> buffer;
+    uint64_t appended;
+    uint64_t durable;
+    bool flushing;
+    WalStats counters;
+
+    public:
+    WriteAheadLog();
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog &) = delete;
+
+    bool open(const char* path, uint64_t from,
+              std::vector<WalRecord> &records);
+
+    uint64_t append(WalRecord record);
+    uint64_t appendMany(std::vector<WalRecord> &records);
+    void sync(uint64_t lsn);
+    void commit();
+    void syncAll();
+
+    uint64_t appendedLsn();
+    WalStats stats();
+};
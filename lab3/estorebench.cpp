@@ -0,0 +1,790 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <unistd.h>
+#include "EStore.h"
+#include "TaskQueue.h"
+
+using namespace std;
+
+/*
+ * ------------------------------------------------------------------
+ * MapStore --
+ *
+ *      The inventory as it was kept before the flat item table: a
+ *      std::map from id to item behind one monitor lock, indexed
+ *      with operator[] on every access. Only used as a baseline.
+ *
+ * ------------------------------------------------------------------
+ */
+class MapStore {
+    private:
+    struct MapItem {
+        bool valid;
+        int quantity;
+        double price;
+        double discount;
+    };
+
+    map<int, MapItem> items;
+    double shippingCost;
+    smutex_t mtx;
+
+    public:
+    MapStore() : shippingCost(3.0) { smutex_init(&mtx); }
+    ~MapStore() { smutex_destroy(&mtx); }
+
+    void addItem(int item_id, int quantity, double price, double discount)
+    {
+        smutex_lock(&mtx);
+        if (items.find(item_id) == items.end())
+            items[item_id] = MapItem{true, quantity, price, discount};
+        smutex_unlock(&mtx);
+    }
+
+    bool carries(int item_id)
+    {
+        smutex_lock(&mtx);
+        bool found = items.find(item_id) != items.end() && items[item_id].valid;
+        smutex_unlock(&mtx);
+        return found;
+    }
+
+    void buyItem(int item_id, double budget)
+    {
+        smutex_lock(&mtx);
+        if (items.find(item_id) != items.end() && items[item_id].valid &&
+            items[item_id].quantity > 0 &&
+            items[item_id].price * (1 - items[item_id].discount) +
+                shippingCost <= budget) {
+            items[item_id].quantity--;
+        }
+        smutex_unlock(&mtx);
+    }
+};
+
+static double
+now()
+{
+    return chrono::duration<double>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+report(const char* what, const char* impl, long ops, double secs)
+{
+    printf("%-8s %-9s %10ld ops %8.3f s %12.0f ops/s\n",
+           what, impl, ops, secs, ops / secs);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchFlatTable --
+ *
+ *      Compare item lookups and single-item purchases on a
+ *      coarse-mode EStore (flat item table) against MapStore. Both
+ *      stores carry the same items, and the ids are drawn from the
+ *      same precomputed random sequence.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchFlatTable(long ops)
+{
+    EStore store(false);
+    MapStore mapStore;
+    for (int id = 0; id < INVENTORY_SIZE; id++) {
+        store.addItem(id, 1 << 30, 1.0, 0.0);
+        mapStore.addItem(id, 1 << 30, 1.0, 0.0);
+    }
+
+    int* ids = new int[ops];
+    for (long i = 0; i < ops; i++)
+        ids[i] = rand() % INVENTORY_SIZE;
+
+    long found = 0;
+    double start = now();
+    for (long i = 0; i < ops; i++)
+        found += store.carries(ids[i]);
+    report("lookup", "flat", ops, now() - start);
+
+    start = now();
+    for (long i = 0; i < ops; i++)
+        found += mapStore.carries(ids[i]);
+    report("lookup", "map", ops, now() - start);
+
+    start = now();
+    for (long i = 0; i < ops; i++)
+        store.buyItem(ids[i], MIN_BUDGET);
+    report("buy", "flat", ops, now() - start);
+
+    start = now();
+    for (long i = 0; i < ops; i++)
+        mapStore.buyItem(ids[i], MIN_BUDGET);
+    report("buy", "map", ops, now() - start);
+
+    if (found != 2 * ops)
+        printf("benchFlatTable: lookups missed %ld items\n", 2 * ops - found);
+    delete[] ids;
+}
+
+// Largest catalog benchCatalog fills.
+#define BENCH_CATALOG_SIZE (1 << 21)
+
+/*
+ * ------------------------------------------------------------------
+ * benchCatalog --
+ *
+ *      Fill fine-mode stores of growing capacity with every item
+ *      they can carry, then measure random single-item orders over
+ *      the whole catalog. "fill" counts addItem calls, "orders"
+ *      counts buyManyItems calls.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchCatalog(long ops)
+{
+    for (int size = 1 << 10; size <= BENCH_CATALOG_SIZE; size <<= 5) {
+        EStore store(true, false, false, 0, size);
+        char impl[32];
+        snprintf(impl, sizeof(impl), "%d", size);
+
+        double start = now();
+        for (int id = 0; id < size; id++)
+            store.addItem(id, 1 << 30, 1.0, 0.0);
+        report("fill", impl, size, now() - start);
+
+        unsigned seed = size;
+        vector<int> order(1);
+        start = now();
+        for (long i = 0; i < ops; i++) {
+            order[0] = rand_r(&seed) % size;
+            store.buyManyItems(&order, MIN_BUDGET);
+        }
+        report("catalog", impl, ops, now() - start);
+    }
+}
+
+// Items benchBulk reprices.
+#define BENCH_BULK_SIZE (1 << 16)
+
+/*
+ * ------------------------------------------------------------------
+ * benchBulk --
+ *
+ *      Reprice and discount a full fine-mode catalog, one item per
+ *      call ("item": priceItem, discountItem) and with the bulk
+ *      calls ("bulk": priceItems, discountRange, scalePrices). ops
+ *      counts items updated.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchBulk(long ops)
+{
+    EStore store(true, false, false, 0, BENCH_BULK_SIZE);
+    vector<int> ids(BENCH_BULK_SIZE);
+    vector<double> prices(BENCH_BULK_SIZE);
+    for (int id = 0; id < BENCH_BULK_SIZE; id++) {
+        store.addItem(id, 1, 1.0, 0.0);
+        ids[id] = id;
+        prices[id] = 1.0 + id % 8;
+    }
+    long passes = max(ops / BENCH_BULK_SIZE, 1L);
+    long updates = passes * BENCH_BULK_SIZE;
+
+    double start = now();
+    for (long p = 0; p < passes; p++)
+        for (int id = 0; id < BENCH_BULK_SIZE; id++)
+            store.priceItem(id, prices[id]);
+    report("price", "item", updates, now() - start);
+
+    start = now();
+    for (long p = 0; p < passes; p++)
+        store.priceItems(ids, prices);
+    report("price", "bulk", updates, now() - start);
+
+    start = now();
+    for (long p = 0; p < passes; p++)
+        for (int id = 0; id < BENCH_BULK_SIZE; id++)
+            store.discountItem(id, (p & 7) / 10.0);
+    report("discount", "item", updates, now() - start);
+
+    start = now();
+    for (long p = 0; p < passes; p++)
+        store.discountRange(0, BENCH_BULK_SIZE - 1, (p & 7) / 10.0);
+    report("discount", "bulk", updates, now() - start);
+
+    start = now();
+    for (long p = 0; p < passes; p++)
+        store.scalePrices(p & 1 ? 2.0 : 0.5);
+    report("scale", "bulk", updates, now() - start);
+}
+
+// Supplier requests per applyBatch in benchSuppliers' "batch" runs.
+#define BENCH_SUPPLIER_BATCH 32
+
+struct SupplierArgs {
+    EStore* store;
+    long ops;
+    unsigned seed;
+    bool batched;
+};
+
+static void*
+supplierWorker(void* arg)
+{
+    SupplierArgs* args = static_cast<SupplierArgs*>(arg);
+    vector<SupplierOp> batch;
+    for (long i = 0; i < args->ops; i++) {
+        int id = rand_r(&args->seed) % INVENTORY_SIZE;
+        if (args->batched) {
+            switch (i % 3) {
+                case 0: batch.push_back({ADD_STOCK, id, 1, 0.0, 0.0}); break;
+                case 1: batch.push_back({CHANGE_ITEM_PRICE, id, 0,
+                                         1.0 + (i & 7), 0.0}); break;
+                case 2: batch.push_back({CHANGE_ITEM_DISCOUNT, id, 0,
+                                         (i & 7) / 10.0, 0.0}); break;
+            }
+            if (batch.size() == BENCH_SUPPLIER_BATCH ||
+                i == args->ops - 1) {
+                args->store->applyBatch(batch);
+                batch.clear();
+            }
+            continue;
+        }
+        switch (i % 3) {
+            case 0: args->store->addStock(id, 1); break;
+            case 1: args->store->priceItem(id, 1.0 + (i & 7)); break;
+            case 2: args->store->discountItem(id, (i & 7) / 10.0); break;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchSuppliers --
+ *
+ *      Measure supplier throughput (addStock, priceItem and
+ *      discountItem on random items) with a growing number of
+ *      supplier threads, in coarse and in fine mode: one call per
+ *      request ("supply"), and BENCH_SUPPLIER_BATCH requests per
+ *      applyBatch ("batch").
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchSuppliers(long ops, int maxThreads)
+{
+    for (int batched = 0; batched <= 1; batched++) {
+        for (int fine = 0; fine <= 1; fine++) {
+            for (int threads = 1; threads <= maxThreads; threads *= 2) {
+                EStore store(fine);
+                for (int id = 0; id < INVENTORY_SIZE; id++)
+                    store.addItem(id, 1, 1.0, 0.0);
+
+                sthread_t workers[threads];
+                SupplierArgs args[threads];
+                double start = now();
+                for (int t = 0; t < threads; t++) {
+                    args[t] = SupplierArgs{&store, ops / threads,
+                                           (unsigned) t, batched == 1};
+                    sthread_create(&workers[t], supplierWorker, &args[t]);
+                }
+                for (int t = 0; t < threads; t++)
+                    sthread_join(workers[t]);
+
+                char impl[32];
+                snprintf(impl, sizeof(impl), "%s/%d",
+                         fine ? "fine" : "coarse", threads);
+                report(batched ? "batch" : "supply", impl, ops,
+                       now() - start);
+            }
+        }
+    }
+}
+
+// Tasks per enqueueMany and most per dequeueUpTo in benchTaskQueue's
+// batched runs.
+#define BENCH_TASK_BATCH 16
+
+struct QueueArgs {
+    TaskQueue* queue;
+    long ops;
+    bool batched;
+};
+
+static void
+noopTask(void* arg)
+{
+}
+
+static void*
+producerWorker(void* arg)
+{
+    QueueArgs* args = static_cast<QueueArgs*>(arg);
+    if (args->batched) {
+        for (long i = 0; i < args->ops; i += BENCH_TASK_BATCH) {
+            long n = min((long) BENCH_TASK_BATCH, args->ops - i);
+            args->queue->enqueueMany(vector<Task>(n, Task{noopTask, nullptr}));
+        }
+        return nullptr;
+    }
+    for (long i = 0; i < args->ops; i++)
+        args->queue->enqueue(Task{noopTask, nullptr});
+    return nullptr;
+}
+
+static void*
+consumerWorker(void* arg)
+{
+    QueueArgs* args = static_cast<QueueArgs*>(arg);
+    if (args->batched) {
+        vector<Task> tasks;
+        for (long i = 0; i < args->ops; i += tasks.size()) {
+            tasks.clear();
+            args->queue->dequeueUpTo(tasks,
+                min((long) BENCH_TASK_BATCH, args->ops - i));
+            for (Task& task : tasks)
+                task.handler(task.arg);
+        }
+        return nullptr;
+    }
+    for (long i = 0; i < args->ops; i++) {
+        Task task = args->queue->dequeue();
+        task.handler(task.arg);
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchTaskQueue --
+ *
+ *      Measure TaskQueue throughput (tasks handed from a producer
+ *      to a consumer per second) with a growing number of producer
+ *      and consumer thread pairs: "mutex" is the monitor queue,
+ *      "ring" the lock-free one. "tasks" moves one task per call,
+ *      "taskmany" up to BENCH_TASK_BATCH per enqueueMany and
+ *      dequeueUpTo.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchTaskQueue(long ops, int maxThreads)
+{
+    for (int batched = 0; batched <= 1; batched++) {
+      for (int lockFree = 0; lockFree <= 1; lockFree++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            TaskQueue queue(lockFree);
+
+            sthread_t producers[threads];
+            sthread_t consumers[threads];
+            QueueArgs args{&queue, ops / threads, batched == 1};
+            double start = now();
+            for (int t = 0; t < threads; t++) {
+                sthread_create(&consumers[t], consumerWorker, &args);
+                sthread_create(&producers[t], producerWorker, &args);
+            }
+            for (int t = 0; t < threads; t++) {
+                sthread_join(producers[t]);
+                sthread_join(consumers[t]);
+            }
+
+            char impl[32];
+            snprintf(impl, sizeof(impl), "%s/%d",
+                     lockFree ? "ring" : "mutex", threads);
+            report(batched ? "taskmany" : "tasks", impl, args.ops * threads,
+                   now() - start);
+        }
+      }
+    }
+}
+
+struct BuyerArgs {
+    EStore* store;
+    MapStore* mapStore;
+    long ops;
+    unsigned seed;
+};
+
+static void*
+buyerWorker(void* arg)
+{
+    BuyerArgs* args = static_cast<BuyerArgs*>(arg);
+    for (long i = 0; i < args->ops; i++) {
+        int id = rand_r(&args->seed) % INVENTORY_SIZE;
+        if (args->store != nullptr)
+            args->store->buyItem(id, MIN_BUDGET);
+        else
+            args->mapStore->buyItem(id, MIN_BUDGET);
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchBuyers --
+ *
+ *      Measure buyItem throughput (buys/sec) with a growing number
+ *      of customer threads, all of whose purchases can go through
+ *      right away. "fast" is a coarse-mode EStore, where such buys
+ *      take the lock-free path; "locked" is MapStore, where every
+ *      buy takes the one store lock.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchBuyers(long ops, int maxThreads)
+{
+    for (int locked = 0; locked <= 1; locked++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            EStore store(false);
+            MapStore mapStore;
+            for (int id = 0; id < INVENTORY_SIZE; id++) {
+                store.addItem(id, 1 << 30, 1.0, 0.0);
+                mapStore.addItem(id, 1 << 30, 1.0, 0.0);
+            }
+
+            sthread_t workers[threads];
+            BuyerArgs args[threads];
+            double start = now();
+            for (int t = 0; t < threads; t++) {
+                args[t] = BuyerArgs{locked ? nullptr : &store,
+                                    &mapStore, ops / threads, (unsigned) t};
+                sthread_create(&workers[t], buyerWorker, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                sthread_join(workers[t]);
+
+            char impl[32];
+            snprintf(impl, sizeof(impl), "%s/%d", locked ? "locked" : "fast",
+                     threads);
+            report("buyers", impl, ops, now() - start);
+        }
+    }
+}
+
+// Number of items all of the traffic in benchHotItems goes to.
+#define HOT_ITEMS 4
+
+struct HotArgs {
+    EStore* store;
+    long ops;
+    unsigned seed;
+};
+
+static void*
+hotWorker(void* arg)
+{
+    HotArgs *args = static_cast<HotArgs*>(arg);
+    vector<int> order(1);
+    for (long i = 0; i < args->ops; i++) {
+        int id = rand_r(&args->seed) % HOT_ITEMS;
+        switch (i % 8) {
+        case 0:
+            args->store->addStock(id, 1);
+            break;
+        case 1:
+            args->store->priceItem(id, 1.0 + i % 3);
+            break;
+        default:
+            order[0] = id;
+            args->store->buyManyItems(&order, 10.0);
+            break;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchHotItems --
+ *
+ *      Measure throughput (ops/sec) of single-item buys, addStock
+ *      and priceItem all aimed at HOT_ITEMS items, with a growing
+ *      number of threads. "fine" queues up on the items' locks;
+ *      "combine" flat-combines the operations on hot items;
+ *      "promote" moves items that turn hot to dedicated locks.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchHotItems(long ops, int maxThreads)
+{
+    const char *impls[] = {"fine", "combine", "promote"};
+    for (int impl = 0; impl < 3; impl++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            EStore store(true, false, impl == 1, 0, ITEM_TABLE_SIZE,
+                         impl == 2);
+            for (int id = 0; id < HOT_ITEMS; id++)
+                store.addItem(id, 1 << 30, 1.0, 0.0);
+
+            sthread_t workers[threads];
+            HotArgs args[threads];
+            double start = now();
+            for (int t = 0; t < threads; t++) {
+                args[t] = HotArgs{&store, ops / threads, (unsigned) t};
+                sthread_create(&workers[t], hotWorker, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                sthread_join(workers[t]);
+
+            char name[32];
+            snprintf(name, sizeof(name), "%s/%d", impls[impl], threads);
+            report("hot", name, ops, now() - start);
+        }
+    }
+}
+
+// Shard owner threads in benchSharded.
+#define BENCH_SHARDS 4
+
+static void*
+orderWorker(void* arg)
+{
+    HotArgs *args = static_cast<HotArgs*>(arg);
+    vector<int> order(2);
+    for (long i = 0; i < args->ops; i++) {
+        order[0] = rand_r(&args->seed) % INVENTORY_SIZE;
+        order[1] = rand_r(&args->seed) % INVENTORY_SIZE;
+        if (i % 4 == 0)
+            args->store->addStock(order[0], 2);
+        else
+            args->store->buyManyItems(&order, 1000.0);
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchSharded --
+ *
+ *      Measure throughput (ops/sec) of two-item orders and addStock
+ *      spread over the whole inventory, with a growing number of
+ *      threads. "fine" locks the items in place; "sharded" sends
+ *      every operation to the owner of the items (BENCH_SHARDS
+ *      owner threads).
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchSharded(long ops, int maxThreads)
+{
+    for (int sharded = 0; sharded <= 1; sharded++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            EStore store(true, false, false, sharded ? BENCH_SHARDS : 0);
+            for (int id = 0; id < INVENTORY_SIZE; id++)
+                store.addItem(id, 1 << 20, 1.0, 0.0);
+
+            sthread_t workers[threads];
+            HotArgs args[threads];
+            double start = now();
+            for (int t = 0; t < threads; t++) {
+                args[t] = HotArgs{&store, ops / threads, (unsigned) t};
+                sthread_create(&workers[t], orderWorker, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                sthread_join(workers[t]);
+
+            char impl[32];
+            snprintf(impl, sizeof(impl), "%s/%d",
+                     sharded ? "sharded" : "fine", threads);
+            report("orders", impl, ops, now() - start);
+        }
+    }
+}
+
+// Log file for benchDurable, and how much smaller its runs are:
+// every durable mutation waits for an fdatasync.
+#define BENCH_WAL_PATH "/tmp/estorebench.wal"
+#define DURABLE_OPS_DIVISOR 1000
+
+static void*
+durableWorker(void* arg)
+{
+    HotArgs *args = static_cast<HotArgs*>(arg);
+    for (long i = 0; i < args->ops; i++)
+        args->store->addStock(rand_r(&args->seed) % INVENTORY_SIZE, 1);
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchDurable --
+ *
+ *      Measure throughput (ops/sec) of addStock on a fine-mode store
+ *      with and without a write-ahead log, with a growing number of
+ *      threads, and how many records each fdatasync made durable
+ *      (group commit).
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchDurable(long ops, int maxThreads)
+{
+    ops = max(ops / DURABLE_OPS_DIVISOR, 1L);
+    for (int logged = 0; logged <= 1; logged++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            EStore store(true);
+            unlink(BENCH_WAL_PATH);
+            if (logged && !store.openLog(BENCH_WAL_PATH))
+                exit(-1);
+            for (int id = 0; id < INVENTORY_SIZE; id++)
+                store.addItem(id, 0, 1.0, 0.0);
+            WalStats before = store.walStats();
+
+            sthread_t workers[threads];
+            HotArgs args[threads];
+            double start = now();
+            for (int t = 0; t < threads; t++) {
+                args[t] = HotArgs{&store, ops / threads, (unsigned) t};
+                sthread_create(&workers[t], durableWorker, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                sthread_join(workers[t]);
+
+            char impl[32];
+            snprintf(impl, sizeof(impl), "%s/%d",
+                     logged ? "wal" : "memory", threads);
+            report("durable", impl, ops, now() - start);
+            if (logged) {
+                WalStats after = store.walStats();
+                long syncs = after.syncs - before.syncs;
+                printf("durable  %-9s %10.2f records/sync\n", impl,
+                       syncs ? (double) (after.records - before.records) /
+                               syncs : 0.0);
+            }
+        }
+    }
+    unlink(BENCH_WAL_PATH);
+}
+
+#define BENCH_CHECKPOINT_PATH "/tmp/estorebench.ckpt"
+
+/*
+ * ------------------------------------------------------------------
+ * benchRestart --
+ *
+ *      Fill a logged store with a full item table and ops / 100
+ *      stock updates, then measure how long a new store takes to
+ *      come back from the log alone ("log"), and from a checkpoint
+ *      plus the log tail ("ckpt"). Each run reports the open and
+ *      the first purchase, and ops is the number of log records.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchRestart(long ops)
+{
+    long updates = max(ops / 100, 1L);
+    unlink(BENCH_WAL_PATH);
+    unlink(BENCH_CHECKPOINT_PATH);
+    {
+        EStore store(true);
+        if (!store.openLog(BENCH_WAL_PATH))
+            exit(-1);
+        for (int id = 0; id < ITEM_TABLE_SIZE; id++)
+            store.addItem(id, 1, 1.0, 0.0);
+        for (long i = 0; i < updates / 2; i++)
+            store.addStock(i % ITEM_TABLE_SIZE, 1);
+        store.checkpoint(BENCH_CHECKPOINT_PATH);
+        for (long i = updates / 2; i < updates; i++)
+            store.addStock(i % ITEM_TABLE_SIZE, 1);
+    }
+
+    long records = ITEM_TABLE_SIZE + updates;
+    vector<int> order(1, ITEM_TABLE_SIZE - 1);
+    for (int restored = 0; restored <= 1; restored++) {
+        double start = now();
+        EStore store(true);
+        if (restored && !store.openCheckpoint(BENCH_CHECKPOINT_PATH))
+            exit(-1);
+        if (!store.openLog(BENCH_WAL_PATH))
+            exit(-1);
+        store.buyManyItems(&order, 1000.0);
+        report("restart", restored ? "ckpt" : "log", records, now() - start);
+    }
+    unlink(BENCH_WAL_PATH);
+    unlink(BENCH_CHECKPOINT_PATH);
+}
+
+// Outstanding holds in benchHolds, and the range of their ttls.
+#define BENCH_HOLDS       (1 << 18)
+#define BENCH_HOLD_TTL_NS 2000000000L
+
+/*
+ * ------------------------------------------------------------------
+ * benchHolds --
+ *
+ *      Put BENCH_HOLDS single-item holds on a fine-mode store at
+ *      once, with ttls between one and two times BENCH_HOLD_TTL_NS
+ *      ("reserve"), commit and release a quarter of them each, and
+ *      let the rest expire. "expire" reports how long after the
+ *      last ttl ran out the last hold was given back: how far the
+ *      hold thread lags behind the clock.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchHolds()
+{
+    EStore store(true);
+    for (int id = 0; id < INVENTORY_SIZE; id++)
+        store.addItem(id, BENCH_HOLDS, 1.0, 0.0);
+
+    vector<HoldToken> tokens(BENCH_HOLDS);
+    unsigned seed = 7;
+    double last = 0.0;
+    double start = now();
+    for (int i = 0; i < BENCH_HOLDS; i++) {
+        long ttl = BENCH_HOLD_TTL_NS + rand_r(&seed) % BENCH_HOLD_TTL_NS;
+        last = max(last, now() + ttl / 1e9);
+        tokens[i] = store.reserve(vector<int>(1, i % INVENTORY_SIZE), ttl);
+    }
+    report("reserve", "wheel", BENCH_HOLDS, now() - start);
+
+    start = now();
+    for (int i = 0; i < BENCH_HOLDS / 4; i++)
+        store.commit(tokens[i]);
+    report("commit", "wheel", BENCH_HOLDS / 4, now() - start);
+
+    start = now();
+    for (int i = BENCH_HOLDS / 4; i < BENCH_HOLDS / 2; i++)
+        store.release(tokens[i]);
+    report("release", "wheel", BENCH_HOLDS / 4, now() - start);
+
+    while (store.holdStats().outstanding > 0)
+        sthread_sleep(0, 1000000);
+    printf("%-8s %-9s %10ld ops %8.3f s lag\n", "expire", "wheel",
+           store.holdStats().expired, now() - last);
+}
+
+int main(int argc, char **argv)
+{
+    long ops = 2000000;
+    int maxThreads = 8;
+
+    if (argc > 1)
+        ops = atol(argv[1]);
+    if (argc > 2)
+        maxThreads = atoi(argv[2]);
+    srand(202);
+
+    benchFlatTable(ops);
+    benchCatalog(ops);
+    benchBulk(ops);
+    benchSuppliers(ops, maxThreads);
+    benchTaskQueue(ops, maxThreads);
+    benchBuyers(ops, maxThreads);
+    benchHotItems(ops, maxThreads);
+    benchSharded(ops, maxThreads);
+    benchDurable(ops, maxThreads);
+    benchRestart(ops);
+    benchHolds();
+    return 0;
+}
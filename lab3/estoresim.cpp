@@ -1,10 +1,25 @@
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <cstdlib>
 #include "RequestGenerator.h"
 #include "EStore.h"
 #include "TaskQueue.h"
+#include "RequestHandlers.h"
 #include <cstdio>
 
+// Shard owner threads in --sharded mode.
+#define SIM_SHARDS 4
+
+// Most supplier tasks a supplier thread drains into one batch.
+#define SUPPLIER_BATCH 16
+
+// Time between two checkpoints in --checkpoint mode.
+#define CHECKPOINT_INTERVAL_NS 50000000
+
+// Best sellers listed at the end of a run.
+#define TOP_SELLERS 5
+
 class Simulation {
     public:
     TaskQueue supplierTasks;
@@ -14,9 +29,30 @@ class Simulation {
     int maxTasks;
     int numSuppliers;
     int numCustomers;
+    int numItems;
+    bool coalesce;
     bool stop = false;
 
-    Simulation(bool useFineMode) : store(useFineMode), stop(false) { }
+    // Longest a buy request waits, in nanoseconds, or 0 for as long
+    // as it takes, and whether some customers hold items first.
+    long sloNanos;
+    bool holds;
+
+    // Where checkpointer saves the store, or null, and whether the
+    // workers are still running.
+    const char *checkpointPath;
+    std::atomic<bool> running;
+
+    Simulation(bool useFineMode, bool useOptimistic, bool useCombining,
+               bool usePromotion, int numShards, int itemRange,
+               bool useRing)
+        : supplierTasks(useRing), customerTasks(useRing),
+          store(useFineMode, useOptimistic, useCombining, numShards,
+                std::max(itemRange, ITEM_TABLE_SIZE), usePromotion),
+          numItems(itemRange), coalesce(false), stop(false), sloNanos(0),
+          holds(false),
+          checkpointPath(nullptr),
+          running(true) { }
 };
 
 /*
@@ -45,7 +81,8 @@ supplierGenerator(void* arg)
 {
     // TODO: Your code here.
     Simulation* sim = static_cast<Simulation*>(arg);
-    SupplierRequestGenerator reqGen(&sim->supplierTasks);
+    SupplierRequestGenerator reqGen(&sim->supplierTasks, sim->numItems,
+                                    sim->coalesce);
 
     //enqueue maxTasks
     reqGen.enqueueTasks(sim->maxTasks, &sim->store);
@@ -86,7 +123,10 @@ customerGenerator(void* arg)
 {
     // TODO: Your code here.
     Simulation* sim = static_cast<Simulation*>(arg);
-    CustomerRequestGenerator reqGen(&sim->customerTasks, sim->store.fineModeEnabled());
+    CustomerRequestGenerator reqGen(&sim->customerTasks,
+                                    sim->store.fineModeEnabled(),
+                                    sim->numItems, sim->sloNanos,
+                                    sim->holds);
 
     //enqueue maxTasks
     reqGen.enqueueTasks(sim->maxTasks, &sim->store);
@@ -97,6 +137,16 @@ customerGenerator(void* arg)
     return nullptr;
 }
 
+// Hand the tasks a supplier took after tasks[stop] back to the
+// queue, for the other suppliers (they can only be more stops).
+static void
+requeueAfter(TaskQueue* queue, const std::vector<Task>& tasks, size_t stop)
+{
+    if (stop + 1 < tasks.size())
+        queue->enqueueMany(std::vector<Task>(tasks.begin() + stop + 1,
+                                             tasks.end()));
+}
+
 /*
  * ------------------------------------------------------------------
  * supplier --
@@ -106,6 +156,12 @@ customerGenerator(void* arg)
  *
  *      Dequeue Tasks from the supplier queue and execute them.
  *
+ *      Take up to SUPPLIER_BATCH queued tasks at a time, and apply
+ *      the supplier requests among them as one EStore::applyBatch.
+ *      Any other task runs on its own, after the batch before it
+ *      was applied. A stop exits the thread, handing the tasks
+ *      taken after it back to the queue.
+ *
  * Results:
  *      Does not return.
  *
@@ -116,18 +172,43 @@ supplier(void* arg)
 {
     // TODO: Your code here.
     Simulation* sim = static_cast<Simulation*>(arg);
-    
-    while(true){
+    std::vector<Task> tasks;
+    std::vector<SupplierOp> batch;
+    EStore *store = nullptr;
+    bool stopping = false;
+
+    while(!stopping){
         if (sim->stop) {
             printf("supplier: Stopping the supplier thread\n");
             break;
         }
         
-        Task task = sim->supplierTasks.dequeue();
-        if (task.handler == nullptr) {
-            break;
+        tasks.clear();
+        sim->supplierTasks.dequeueUpTo(tasks, SUPPLIER_BATCH);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            Task task = tasks[i];
+            if (task.handler == nullptr || task.handler == stop_handler) {
+                // stop_handler exits the thread, so hand back the
+                // tasks taken after it first.
+                requeueAfter(&sim->supplierTasks, tasks, i);
+                if (task.handler == nullptr) {
+                    stopping = true;
+                    break;
+                }
+            }
+            if (!batch_supplier_task(task, batch, &store)) {
+                // Keep the order: apply what came before it first.
+                if (!batch.empty())
+                    store->applyBatch(batch);
+                batch.clear();
+                store = nullptr;
+                task.handler(task.arg);
+            }
         }
-        task.handler(task.arg);
+        if (!batch.empty())
+            store->applyBatch(batch);
+        batch.clear();
+        store = nullptr;
     }
     return nullptr;
 }
@@ -139,7 +220,9 @@ supplier(void* arg)
  *      The main customer thread. The argument is a pointer to the
  *      shared Simulation object.
  *
- *      Dequeue Tasks from the customer queue and execute them.
+ *      Dequeue Tasks from the customer queue and execute them, one
+ *      at a time: a buy may block, and must not hold up tasks that
+ *      another customer thread could run meanwhile.
  *
  * Results:
  *      Does not return.
@@ -166,6 +249,32 @@ customer(void* arg)
     return nullptr;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * checkpointer --
+ *
+ *      Checkpoint the store every CHECKPOINT_INTERVAL_NS while the
+ *      workers run, and once more after they are done.
+ *
+ * ------------------------------------------------------------------
+ */
+static void*
+checkpointer(void* arg)
+{
+    Simulation* sim = static_cast<Simulation*>(arg);
+    int taken = 0;
+    bool running;
+    do {
+        running = sim->running;
+        if (running)
+            sthread_sleep(0, CHECKPOINT_INTERVAL_NS);
+        if (sim->store.checkpoint(sim->checkpointPath))
+            taken++;
+    } while (running);
+    printf("checkpoints: taken=%d\n", taken);
+    return nullptr;
+}
+
 /*
  * ------------------------------------------------------------------
  * startSimulation --
@@ -190,15 +299,29 @@ customer(void* arg)
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(int numSuppliers, int numCustomers, int maxTasks,
+                bool useFineMode, bool useOptimistic, bool useCombining,
+                bool usePromotion, int numShards, int numItems,
+                const char *walPath, const char *checkpointPath,
+                bool coalesce, long sloNanos, bool holds, bool useRing)
 {
     // TODO: Your code here.
-    Simulation sim(useFineMode);
+    Simulation sim(useFineMode, useOptimistic, useCombining, usePromotion,
+                   numShards, numItems, useRing);
+    sim.checkpointPath = checkpointPath;
+    sim.coalesce = coalesce;
+    sim.sloNanos = sloNanos;
+    sim.holds = holds;
+    if (checkpointPath != nullptr && sim.store.openCheckpoint(checkpointPath))
+        printf("restored from checkpoint %s\n", checkpointPath);
+    if (walPath != nullptr && !sim.store.openLog(walPath)) {
+        exit(-1);
+    }
     sim.maxTasks = maxTasks;
     sim.numSuppliers = numSuppliers;
     sim.numCustomers = numCustomers;
     
-    sthread_t supplierGenThread, customerGenThread;
+    sthread_t supplierGenThread, customerGenThread, checkpointThread;
     sthread_t supplierThreads[numSuppliers];
     sthread_t customerThreads[numCustomers];
     
@@ -215,6 +338,8 @@ startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMo
     for (int i = 0; i < numCustomers; i++) {
         sthread_create(&customerThreads[i], customer, &sim);
     }
+    if (checkpointPath != nullptr)
+        sthread_create(&checkpointThread, checkpointer, &sim);
     
     sthread_join(supplierGenThread);
     sthread_join(customerGenThread);
@@ -228,20 +353,135 @@ startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMo
     for (int i = 0; i < numCustomers; i++) {
         sthread_join(customerThreads[i]);
     }
+
+    sim.running = false;
+    if (checkpointPath != nullptr)
+        sthread_join(checkpointThread);
+
+    WakeupStats ws = sim.store.wakeupStats();
+    printf("wakeups: waits=%ld, wakeups=%ld, spurious=%ld, avoided=%ld\n",
+           ws.waits, ws.wakeups, ws.spuriousWakeups, ws.avoidedWakeups);
+
+    OrderStats os = sim.store.orderStats();
+    if (useFineMode) {
+        printf("order waits: waits=%ld, wakeups=%ld, spurious=%ld\n",
+               os.waits, os.wakeups, os.spuriousWakeups);
+    }
+    if (sloNanos > 0) {
+        printf("abandoned waits: buys=%ld, orders=%ld (slo %ldms)\n",
+               ws.timeouts, os.timeouts, sloNanos / 1000000);
+    }
+    if (useOptimistic) {
+        long attempts = os.orders + os.aborts;
+        printf("orders: orders=%ld, commits=%ld, rejected=%ld, aborts=%ld, "
+               "fallbacks=%ld, abort rate=%.2f%%, retries/order=%.2f\n",
+               os.orders, os.commits, os.rejected, os.aborts, os.fallbacks,
+               attempts ? 100.0 * os.aborts / attempts : 0.0,
+               os.orders ? (double) os.aborts / os.orders : 0.0);
+    }
+    if (useCombining) {
+        CombineStats cs = sim.store.combineStats();
+        printf("combining: published=%ld, passes=%ld, applied=%ld, "
+               "ops/pass=%.2f\n",
+               cs.published, cs.passes, cs.applied,
+               cs.passes ? (double) cs.applied / cs.passes : 0.0);
+    }
+    if (coalesce) {
+        printf("coalescing: merged=%ld\n", sim.supplierTasks.mergedCount());
+    }
+    if (holds) {
+        HoldStats hs = sim.store.holdStats();
+        printf("holds: reserved=%ld, committed=%ld, released=%ld, "
+               "expired=%ld, outstanding=%ld\n", hs.reserved, hs.committed,
+               hs.released, hs.expired, hs.outstanding);
+    }
+    if (usePromotion) {
+        HotItemStats hs = sim.store.hotItemStats();
+        printf("hot items: promotions=%ld, demotions=%ld, hot now=%zu\n",
+               hs.promotions, hs.demotions, sim.store.hotItems().size());
+    }
+
+    std::vector<double> revenue = sim.store.revenueByInterval(SALES_INTERVALS);
+    double total = 0.0;
+    for (double r : revenue) {
+        total += r;
+    }
+    printf("sales: revenue=%.2f (last %ds), this interval=%.2f\n", total,
+           (int) (SALES_INTERVALS * SALES_INTERVAL_NS / 1000000000L),
+           revenue[0]);
+    for (const ItemSales &top : sim.store.topSellers(TOP_SELLERS)) {
+        printf("  item %d: units=%ld, revenue=%.2f, failed=%ld\n",
+               top.item_id, top.units, top.revenue, top.failed);
+    }
+    if (walPath != nullptr) {
+        WalStats wals = sim.store.walStats();
+        printf("log: records=%ld, syncs=%ld, records/sync=%.2f\n",
+               wals.records, wals.syncs,
+               wals.syncs ? (double) wals.records / wals.syncs : 0.0);
+    }
 }
 
 int main(int argc, char **argv)
 {
     bool useFineMode = false;
+    bool useOptimistic = false;
+    bool useCombining = false;
+    bool usePromotion = false;
+    int numShards = 0;
+    const char *walPath = nullptr;
+    const char *checkpointPath = nullptr;
+    int numItems = INVENTORY_SIZE;
+    bool coalesce = false;
+    long sloNanos = 0;
+    bool holds = false;
+    bool useRing = false;
 
     // Seed the random number generator.
     // You can remove this line or set it to some constant to get deterministic
     // results, but make sure you put it back before turning in.
     srand(time(NULL));
 
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fine") == 0)
+            useFineMode = true;
+        else if (strcmp(argv[i], "--optimistic") == 0)
+            useFineMode = useOptimistic = true;
+        else if (strcmp(argv[i], "--combining") == 0)
+            useFineMode = useCombining = true;
+        else if (strcmp(argv[i], "--sharded") == 0) {
+            useFineMode = true;
+            numShards = SIM_SHARDS;
+        }
+        else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc)
+            walPath = argv[++i];
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+            checkpointPath = argv[++i];
+        else if (strcmp(argv[i], "--items") == 0 && i + 1 < argc)
+            numItems = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--coalesce") == 0)
+            coalesce = true;
+        else if (strcmp(argv[i], "--promote") == 0)
+            usePromotion = true;
+        else if (strcmp(argv[i], "--slo") == 0 && i + 1 < argc)
+            sloNanos = std::max(atol(argv[++i]), 0L) * 1000000;
+        else if (strcmp(argv[i], "--holds") == 0)
+            holds = true;
+        else if (strcmp(argv[i], "--ring") == 0)
+            useRing = true;
+    }
+    if ((walPath != nullptr || checkpointPath != nullptr || holds) &&
+        numShards > 0) {
+        fprintf(stderr, "--wal, --checkpoint and --holds are not supported "
+                "with --sharded\n");
+        return -1;
+    }
+    if (coalesce && useRing) {
+        fprintf(stderr, "--coalesce is not supported with --ring\n");
+        return -1;
+    }
+    startSimulation(10, 10, 100, useFineMode, useOptimistic, useCombining,
+                    usePromotion, numShards, numItems, walPath,
+                    checkpointPath, coalesce, sloNanos, holds, useRing);
     return 0;
 }
 
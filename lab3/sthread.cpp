@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sched.h>
 #include <iostream>
 
 
@@ -48,15 +49,38 @@ void smutex_unlock(smutex_t *mutex)
     }
 }
 
+int smutex_trylock(smutex_t *mutex)
+{
+    int err = pthread_mutex_trylock(mutex);
+    if (err == EBUSY)
+    {
+        return 0;
+    }
+    if (err)
+    {
+        perror("pthread_mutex_trylock failed");
+        exit(-1);
+    }
+    return 1;
+}
+
 
 
+/*
+ * Condition variables time out on the monotonic clock, so that
+ * setting the wall clock cannot stretch or cut short a timed wait.
+ */
 void scond_init(scond_t *cond)
 {
-    if (pthread_cond_init(cond, NULL))
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(cond, &attr))
     {
         perror("pthread_cond_init failed");
         exit(-1);
     }
+    pthread_condattr_destroy(&attr);
 }
 
 void scond_destroy(scond_t *cond)
@@ -107,6 +131,26 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
     }
 }
 
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    const struct timespec *deadline)
+{
+    //
+    // assert(mutex is held by this thread);
+    //
+
+    int err = pthread_cond_timedwait(cond, mutex, deadline);
+    if (err == ETIMEDOUT)
+    {
+        return 0;
+    }
+    if (err)
+    {
+        perror("pthread_cond_timedwait failed");
+        exit(-1);
+    }
+    return 1;
+}
+
 
 
 void sthread_create(sthread_t *thread,
@@ -169,6 +213,31 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
 
 
 
+void sthread_deadline(struct timespec *deadline, long nanoseconds)
+{
+    if (clock_gettime(CLOCK_MONOTONIC, deadline))
+    {
+        perror("clock_gettime failed");
+        exit(-1);
+    }
+    deadline->tv_sec  += nanoseconds / 1000000000;
+    deadline->tv_nsec += nanoseconds % 1000000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+
+
+void sthread_yield(void)
+{
+    sched_yield();
+}
+
+
+
 /*
  * random() in stdlib.h is not MT-safe, so we need to lock
  * it.
@@ -9,6 +9,7 @@ nanosleep}.
 */
 
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef pthread_mutex_t smutex_t;
@@ -19,6 +20,8 @@ void smutex_init(smutex_t *mutex);
 void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
+/* Returns nonzero if the mutex was acquired, 0 if it is held. */
+int smutex_trylock(smutex_t *mutex);
 
 void scond_init(scond_t *cond);
 void scond_destroy(scond_t *cond);
@@ -35,6 +38,16 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Like scond_wait, but give up at deadline, an absolute time on
+ * the CLOCK_MONOTONIC clock (see sthread_deadline). Returns nonzero
+ * if woken up, 0 if the deadline passed first. Either way the mutex
+ * is held again on return, and, as with scond_wait, the caller must
+ * recheck its predicate.
+ */
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    const struct timespec *deadline);
+
 
 
 void sthread_create(sthread_t *thrd,
@@ -60,6 +73,18 @@ void sthread_join(sthread_t thrd);
  */
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * Set *deadline to the CLOCK_MONOTONIC time the given number of
+ * nanoseconds from now, for scond_timedwait.
+ */
+void sthread_deadline(struct timespec *deadline, long nanoseconds);
+
+/*
+ * Give up the CPU to another runnable thread. For spin loops that
+ * wait on a thread that may have been preempted.
+ */
+void sthread_yield(void);
+
 
 /*
  * The normal random() library is not thread safe,
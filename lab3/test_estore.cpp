@@ -0,0 +1,1845 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "EStore.h"
+#include "RequestHandlers.h"
+
+using namespace std;
+
+#define STRESS_ITEMS      16
+#define STRESS_THREADS    8
+#define STRESS_ORDERS     20000
+#define STRESS_STOCK      60000
+
+// Drain the item one unit at a time and return how many units were left.
+static int
+remaining_stock(EStore *store, int item_id)
+{
+    vector<int> one(1, item_id);
+    int left = 0;
+    while (store->buyManyItems(&one, MAX_BUDGET))
+        left++;
+    return left;
+}
+
+void test_buy_many_duplicates() {
+    EStore store(true);
+    store.addItem(1, 4, 10.0, 0.0);
+    store.addItem(2, 1, 10.0, 0.0);
+
+    vector<int> order = {2, 1, 1};
+    assert(store.buyManyItems(&order, 1000.0));
+    // Item 2 is now out of stock.
+    assert(!store.buyManyItems(&order, 1000.0));
+
+    vector<int> twice = {1, 1};
+    // Two units at 10 + 3 shipping each.
+    assert(!store.buyManyItems(&twice, 25.0));
+    assert(store.buyManyItems(&twice, 26.0));
+    assert(remaining_stock(&store, 1) == 0);
+}
+
+void test_buy_many_store_pricing() {
+    EStore store(true);
+    store.addItem(1, 10, 100.0, 0.0);
+    store.addItem(2, 10, 100.0, 0.5);
+    store.setStoreDiscount(0.5);
+    store.setShippingCost(1.0);
+
+    // 100 * 0.5 + 1 and 100 * 0.5 * 0.5 + 1.
+    vector<int> order = {1, 2};
+    assert(!store.buyManyItems(&order, 76.0));
+    assert(store.buyManyItems(&order, 77.0));
+}
+
+void test_quote() {
+    EStore store(true);
+    store.addItem(1, 0, 100.0, 0.5);
+    store.addItem(2, 3, 10.0, 0.0);
+    store.setShippingCost(2.0);
+
+    // Quotes price items even when they are out of stock.
+    double cost = 0;
+    assert(store.quote(1, &cost));
+    assert(cost == 52.0);
+    vector<int> order = {2, 1, 2};
+    assert(store.quoteMany(order, &cost));
+    assert(cost == 52.0 + 2 * 12.0);
+
+    order.push_back(3);
+    assert(!store.quoteMany(order, &cost));
+    assert(!store.quote(3, &cost));
+    // Quoting buys nothing.
+    assert(remaining_stock(&store, 2) == 3);
+}
+
+struct BlockingArgs {
+    EStore *store;
+    vector<int> order;
+    double budget;
+    bool bought;
+};
+
+static void*
+blocking_customer(void *arg)
+{
+    BlockingArgs *args = static_cast<BlockingArgs *>(arg);
+    args->bought = args->store->buyManyItemsBlocking(&args->order, args->budget);
+    return nullptr;
+}
+
+// Wait until the store has seen the given number of blocked orders.
+static void
+wait_for_waits(EStore *store, long waits)
+{
+    while (store->orderStats().waits < waits)
+        sthread_sleep(0, 1000000);
+}
+
+void test_buy_many_blocking() {
+    EStore store(true);
+    store.addItem(1, 0, 10.0, 0.0);
+    store.addItem(2, 5, 10.0, 0.0);
+    store.addItem(3, 5, 10.0, 0.0);
+
+    BlockingArgs args = {&store, {1, 2}, 100.0, false};
+    sthread_t customer;
+    sthread_create(&customer, blocking_customer, &args);
+    wait_for_waits(&store, 1);
+
+    // Changes to an item outside the order must not wake it up.
+    store.priceItem(3, 1.0);
+    store.addStock(3, 1);
+    sthread_sleep(0, 10000000);
+    assert(store.orderStats().wakeups == 0);
+
+    // A price cut on an out-of-stock item cannot help either.
+    store.priceItem(1, 5.0);
+    sthread_sleep(0, 10000000);
+    assert(store.orderStats().wakeups == 0);
+
+    store.addStock(1, 1);
+    sthread_join(customer);
+    assert(args.bought);
+    assert(store.orderStats().wakeups == 1);
+    assert(remaining_stock(&store, 1) == 0);
+
+    // A blocked order gives up when one of its items is removed.
+    args.bought = true;
+    sthread_create(&customer, blocking_customer, &args);
+    wait_for_waits(&store, 2);
+    store.removeItem(1);
+    sthread_join(customer);
+    assert(!args.bought);
+}
+
+void test_buy_many_split_cuts() {
+    // Two cuts that are each too small to bring the order within
+    // budget, but are enough together, must wake it.
+    EStore store(true);
+    store.setShippingCost(0.0);
+    store.addItem(1, 5, 6.0, 0.0);
+    store.addItem(2, 5, 6.0, 0.0);
+
+    BlockingArgs args = {&store, {1, 2}, 10.0, false};
+    sthread_t customer;
+    sthread_create(&customer, blocking_customer, &args);
+    wait_for_waits(&store, 1);
+
+    store.priceItem(1, 5.0);
+    store.priceItem(2, 5.0);
+    sthread_join(customer);
+    assert(args.bought);
+    assert(remaining_stock(&store, 1) == 4);
+    assert(remaining_stock(&store, 2) == 4);
+}
+
+struct BuyItemArgs {
+    EStore *store;
+    int item_id;
+    double budget;
+};
+
+static void*
+item_customer(void *arg)
+{
+    BuyItemArgs *args = static_cast<BuyItemArgs *>(arg);
+    args->store->buyItem(args->item_id, args->budget);
+    return nullptr;
+}
+
+void test_buy_item_budget_wakeups() {
+    EStore store(false);
+    store.addItem(1, 10, 100.0, 0.0);
+
+    // Unit cost is price + 3 shipping.
+    BuyItemArgs rich = {&store, 1, 60.0};
+    BuyItemArgs poor = {&store, 1, 30.0};
+    sthread_t richThread, poorThread;
+    sthread_create(&richThread, item_customer, &rich);
+    sthread_create(&poorThread, item_customer, &poor);
+    while (store.wakeupStats().waits < 2)
+        sthread_sleep(0, 1000000);
+
+    // Still too expensive for both.
+    store.priceItem(1, 80.0);
+    sthread_sleep(0, 10000000);
+    assert(store.wakeupStats().wakeups == 0);
+
+    // Only the richer customer can afford it now.
+    store.priceItem(1, 50.0);
+    sthread_join(richThread);
+    assert(store.wakeupStats().wakeups == 1);
+
+    store.setShippingCost(0.0);
+    sthread_sleep(0, 10000000);
+    assert(store.wakeupStats().wakeups == 1);
+
+    store.discountItem(1, 0.5);
+    sthread_join(poorThread);
+    WakeupStats stats = store.wakeupStats();
+    assert(stats.wakeups == 2);
+    assert(stats.spuriousWakeups == 0);
+}
+
+// Deadlines of timed purchases that are meant to expire, and of
+// those that are meant to be met.
+#define SHORT_SLO_NS      20000000L
+#define LONG_SLO_NS       10000000000L
+
+struct TimedArgs {
+    EStore *store;
+    vector<int> order;
+    double budget;
+    PurchaseStatus status;
+};
+
+// Buy the one item of the order with buyItemUntil in coarse mode,
+// the whole order with buyManyItemsUntil in fine mode.
+static void*
+timed_customer(void *arg)
+{
+    TimedArgs *args = static_cast<TimedArgs *>(arg);
+    struct timespec deadline;
+    sthread_deadline(&deadline, LONG_SLO_NS);
+    if (args->store->fineModeEnabled())
+        args->status = args->store->buyManyItemsUntil(&args->order,
+                                                      args->budget, deadline);
+    else
+        args->status = args->store->buyItemUntil(args->order[0],
+                                                 args->budget, deadline);
+    return nullptr;
+}
+
+// Whether the monotonic clock has reached the deadline.
+static bool
+passed(const struct timespec &deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+void test_timed_buy_item() {
+    EStore store(false);
+    store.addItem(1, 0, 10.0, 0.0);
+
+    struct timespec deadline;
+    sthread_deadline(&deadline, SHORT_SLO_NS);
+    assert(store.buyItemUntil(1, 100.0, deadline) == PURCHASE_TIMED_OUT);
+    assert(passed(deadline));
+    assert(store.buyItemUntil(2, 100.0, deadline) == PURCHASE_NOT_CARRIED);
+    WakeupStats stats = store.wakeupStats();
+    assert(stats.waits == 1 && stats.timeouts == 1 && stats.wakeups == 0);
+
+    // A deadline in the past still buys what can be bought at once.
+    store.addStock(1, 1);
+    assert(store.buyItemUntil(1, 100.0, deadline) == PURCHASE_BOUGHT);
+
+    // A waiter woken before its deadline buys the item.
+    TimedArgs args = {&store, {1}, 100.0, PURCHASE_TIMED_OUT};
+    sthread_t customer;
+    sthread_create(&customer, timed_customer, &args);
+    while (store.wakeupStats().waits < 2)
+        sthread_sleep(0, 1000000);
+    store.addStock(1, 1);
+    sthread_join(customer);
+    assert(args.status == PURCHASE_BOUGHT);
+
+    // And gives up when the item is removed.
+    sthread_create(&customer, timed_customer, &args);
+    while (store.wakeupStats().waits < 3)
+        sthread_sleep(0, 1000000);
+    store.removeItem(1);
+    sthread_join(customer);
+    assert(args.status == PURCHASE_NOT_CARRIED);
+    assert(store.wakeupStats().timeouts == 1);
+}
+
+void test_timed_buy_many() {
+    // Fine, optimistic and sharded stores.
+    for (int mode = 0; mode < 3; mode++) {
+        EStore store(true, mode == 1, false, mode == 2 ? 4 : 0);
+        store.addItem(1, 0, 10.0, 0.0);
+        store.addItem(2, 5, 10.0, 0.0);
+
+        vector<int> order = {1, 2};
+        struct timespec deadline;
+        sthread_deadline(&deadline, SHORT_SLO_NS);
+        assert(store.buyManyItemsUntil(&order, 100.0, deadline) ==
+               PURCHASE_TIMED_OUT);
+        assert(passed(deadline));
+        vector<int> missing = {1, 3};
+        assert(store.buyManyItemsUntil(&missing, 100.0, deadline) ==
+               PURCHASE_NOT_CARRIED);
+        OrderStats stats = store.orderStats();
+        assert(stats.waits >= 1 && stats.timeouts == 1);
+
+        TimedArgs args = {&store, order, 100.0, PURCHASE_TIMED_OUT};
+        sthread_t customer;
+        sthread_create(&customer, timed_customer, &args);
+        wait_for_waits(&store, stats.waits + 1);
+        store.addStock(1, 1);
+        sthread_join(customer);
+        assert(args.status == PURCHASE_BOUGHT);
+        assert(store.orderStats().timeouts == 1);
+        // Only the order that got through took stock.
+        assert(remaining_stock(&store, 2) == 4);
+    }
+}
+
+#define FAST_BUYERS       4
+#define FAST_BUYS         50000
+
+static void*
+fast_buyer(void *arg)
+{
+    BuyItemArgs *args = static_cast<BuyItemArgs *>(arg);
+    for (int i = 0; i < FAST_BUYS; i++)
+        args->store->buyItem(args->item_id, args->budget);
+    return nullptr;
+}
+
+void test_buy_item_fast_path_stock() {
+    EStore store(false);
+    store.addItem(1, FAST_BUYERS * FAST_BUYS, 1.0, 0.0);
+
+    // Every buyer can afford the item, so all of them take the
+    // lock-free path while a supplier reprices it under mtx.
+    sthread_t buyers[FAST_BUYERS];
+    BuyItemArgs args = {&store, 1, 10.0};
+    for (int t = 0; t < FAST_BUYERS; t++)
+        sthread_create(&buyers[t], fast_buyer, &args);
+    for (int i = 0; i < FAST_BUYS; i++)
+        store.priceItem(1, 1.0 + i % 5);
+    for (int t = 0; t < FAST_BUYERS; t++)
+        sthread_join(buyers[t]);
+    assert(store.wakeupStats().waits == 0);
+
+    // The stock must be exactly used up: one more buyer has to wait.
+    sthread_t last;
+    sthread_create(&last, item_customer, &args);
+    while (store.wakeupStats().waits < 1)
+        sthread_sleep(0, 1000000);
+    store.addStock(1, 1);
+    sthread_join(last);
+}
+
+struct StressArgs {
+    EStore *store;
+    unsigned seed;
+    long bought[STRESS_ITEMS];
+};
+
+static void*
+stress_customer(void *arg)
+{
+    StressArgs *args = static_cast<StressArgs *>(arg);
+    vector<int> ids;
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        ids.push_back(id);
+
+    for (int i = 0; i < STRESS_ORDERS; i++) {
+        // Every order overlaps every other one, in a random order
+        // and sometimes with the same item listed twice.
+        for (int j = STRESS_ITEMS - 1; j > 0; j--)
+            swap(ids[j], ids[rand_r(&args->seed) % (j + 1)]);
+        int n = 2 + rand_r(&args->seed) % (MAX_BUY_ITEM - 1);
+        vector<int> order(ids.begin(), ids.begin() + n);
+        if (i % 4 == 0)
+            order.push_back(order[0]);
+
+        if (args->store->buyManyItems(&order, MAX_BUDGET)) {
+            for (int id : order)
+                args->bought[id]++;
+        }
+    }
+    return nullptr;
+}
+
+static void*
+stress_supplier(void *arg)
+{
+    StressArgs *args = static_cast<StressArgs *>(arg);
+    for (int i = 0; i < STRESS_ORDERS; i++) {
+        int id = rand_r(&args->seed) % STRESS_ITEMS;
+        args->store->priceItem(id, 1.0 + i % 10);
+        args->store->discountItem(id, (i % 10) / 10.0);
+    }
+    return nullptr;
+}
+
+void test_buy_many_overlapping_stress(bool optimistic) {
+    EStore store(true, optimistic);
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        store.addItem(id, STRESS_STOCK, 1.0, 0.0);
+
+    sthread_t customers[STRESS_THREADS], supplier;
+    StressArgs args[STRESS_THREADS + 1] = {};
+    for (int t = 0; t <= STRESS_THREADS; t++) {
+        args[t].store = &store;
+        args[t].seed = t;
+    }
+    for (int t = 0; t < STRESS_THREADS; t++)
+        sthread_create(&customers[t], stress_customer, &args[t]);
+    sthread_create(&supplier, stress_supplier, &args[STRESS_THREADS]);
+
+    for (int t = 0; t < STRESS_THREADS; t++)
+        sthread_join(customers[t]);
+    sthread_join(supplier);
+
+    for (int id = 0; id < STRESS_ITEMS; id++) {
+        long bought = 0;
+        for (int t = 0; t < STRESS_THREADS; t++)
+            bought += args[t].bought[id];
+        assert(bought > 0);
+        assert(remaining_stock(&store, id) == STRESS_STOCK - bought);
+    }
+
+    OrderStats stats = store.orderStats();
+    if (optimistic)
+        assert(stats.orders > 0);
+    assert(stats.commits + stats.rejected == stats.orders);
+}
+
+struct HotArgs {
+    EStore *store;
+    long added;
+    long bought;
+};
+
+static void*
+hot_worker(void *arg)
+{
+    HotArgs *args = static_cast<HotArgs *>(arg);
+    vector<int> order(1, 0);
+    for (int i = 0; i < STRESS_ORDERS; i++) {
+        if (i % 4 == 0) {
+            args->store->addStock(0, 1);
+            args->added++;
+        } else if (i % 4 == 1) {
+            args->store->priceItem(0, 1.0 + i % 3);
+        } else if (args->store->buyManyItems(&order, MAX_BUDGET)) {
+            args->bought++;
+        }
+    }
+    return nullptr;
+}
+
+void test_hot_item_combining() {
+    EStore store(false, false, true);
+    assert(store.fineModeEnabled());
+    store.addItem(0, 0, 1.0, 0.0);
+
+    // Everyone hammers the one item, so whatever gets published is
+    // applied by another thread's lock pass.
+    sthread_t workers[STRESS_THREADS];
+    HotArgs args[STRESS_THREADS] = {};
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        args[t].store = &store;
+        sthread_create(&workers[t], hot_worker, &args[t]);
+    }
+    long added = 0, bought = 0;
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        sthread_join(workers[t]);
+        added += args[t].added;
+        bought += args[t].bought;
+    }
+
+    assert(bought > 0);
+    assert(remaining_stock(&store, 0) == added - bought);
+    CombineStats stats = store.combineStats();
+    assert(stats.applied == stats.published);
+}
+
+void test_sharded_store() {
+    EStore store(false, false, false, 4);
+    assert(store.fineModeEnabled());
+    store.addItem(1, 4, 10.0, 0.0);
+    store.addItem(2, 1, 10.0, 0.5);
+    store.addItem(6, 0, 1.0, 0.0);
+    store.setShippingCost(1.0);
+
+    // Items 1 and 2 live on different shards; 2 is out of stock
+    // after the first order, which must not keep units of 1.
+    vector<int> order = {2, 1, 1};
+    double cost = 0;
+    assert(store.quoteMany(order, &cost));
+    assert(cost == 2 * 11.0 + 6.0);
+    assert(!store.buyManyItems(&order, 27.0));
+    assert(store.buyManyItems(&order, 28.0));
+    assert(!store.buyManyItems(&order, 1000.0));
+    assert(remaining_stock(&store, 1) == 2);
+
+    assert(store.carries(6));
+    assert(!store.carries(3));
+    vector<int> missing = {1, 3};
+    assert(!store.buyManyItemsBlocking(&missing, 1000.0));
+
+    // A blocked cross-shard order goes through once its last item
+    // is restocked.
+    store.addStock(1, 1);
+    BlockingArgs args = {&store, {1, 6}, 100.0, false};
+    sthread_t buyer;
+    sthread_create(&buyer, blocking_customer, &args);
+    wait_for_waits(&store, 1);
+    store.addStock(6, 1);
+    sthread_join(buyer);
+    assert(args.bought);
+    assert(remaining_stock(&store, 6) == 0);
+}
+
+void test_sharded_stress() {
+    EStore store(false, false, false, 4);
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        store.addItem(id, STRESS_STOCK, 1.0, 0.0);
+
+    sthread_t customers[STRESS_THREADS], supplier;
+    StressArgs args[STRESS_THREADS + 1] = {};
+    for (int t = 0; t <= STRESS_THREADS; t++) {
+        args[t].store = &store;
+        args[t].seed = t;
+    }
+    for (int t = 0; t < STRESS_THREADS; t++)
+        sthread_create(&customers[t], stress_customer, &args[t]);
+    sthread_create(&supplier, stress_supplier, &args[STRESS_THREADS]);
+    for (int t = 0; t < STRESS_THREADS; t++)
+        sthread_join(customers[t]);
+    sthread_join(supplier);
+
+    for (int id = 0; id < STRESS_ITEMS; id++) {
+        long bought = 0;
+        for (int t = 0; t < STRESS_THREADS; t++)
+            bought += args[t].bought[id];
+        assert(bought > 0);
+        assert(remaining_stock(&store, id) == STRESS_STOCK - bought);
+    }
+    OrderStats stats = store.orderStats();
+    assert(stats.commits + stats.rejected == stats.orders);
+}
+
+struct ChurnArgs {
+    EStore *store;
+    volatile bool *done;
+    long quotes;
+};
+
+static void*
+churn_reader(void *arg)
+{
+    ChurnArgs *args = static_cast<ChurnArgs *>(arg);
+    vector<int> order = {0, 1, 2, 3};
+    double cost;
+    while (!*args->done) {
+        if (args->store->quoteMany(order, &cost))
+            args->quotes++;
+        args->store->buyManyItems(&order, MAX_BUDGET);
+    }
+    return nullptr;
+}
+
+static volatile bool pricing_done;
+
+#define PRICING_ORDERS    2000
+
+static void*
+shipping_flipper(void *arg)
+{
+    EStore *store = static_cast<EStore *>(arg);
+    for (int i = 0; !pricing_done; i++) {
+        double cost = i % 2 == 0 ? 1000.0 : 0.0;
+        if (i % 4 < 2) {
+            store->setShippingCost(cost);
+        } else {
+            vector<SupplierOp> batch = {{ADD_STOCK, 0, 1, 0.0, 0.0},
+                                        {SET_SHIPPING_COST, -1, 0, cost, 0.0}};
+            store->applyBatch(batch);
+        }
+        sthread_yield();
+    }
+    return nullptr;
+}
+
+void test_sharded_pricing() {
+    // Orders and quotes spanning every shard are priced under one
+    // shipping cost throughout, however it changes meanwhile.
+    EStore store(false, false, false, 4);
+    for (int id = 0; id < 4; id++)
+        store.addItem(id, 1 << 20, 1.0, 0.0);
+    store.setShippingCost(0.0);
+    pricing_done = false;
+    sthread_t flipper;
+    sthread_create(&flipper, shipping_flipper, &store);
+
+    vector<int> order = {0, 1, 2, 3};
+    for (int i = 0; i < PRICING_ORDERS; i++) {
+        double cost = 0;
+        assert(store.quoteMany(order, &cost));
+        assert(cost == 4.0 || cost == 4.0 * 1001.0);
+        assert(store.buyManyItems(&order, MAX_BUDGET));
+    }
+    pricing_done = true;
+    sthread_join(flipper);
+
+    // Every order paid the same for each of its lines.
+    for (int id = 1; id < 4; id++)
+        assert(store.itemSales(id).revenue == store.itemSales(0).revenue);
+}
+
+void test_removed_items_reclaimed() {
+    EStore store(true);
+    volatile bool done = false;
+    long peak = 0;
+
+    sthread_t readers[4];
+    ChurnArgs args[4];
+    for (int t = 0; t < 4; t++) {
+        args[t] = ChurnArgs{&store, &done, 0};
+        sthread_create(&readers[t], churn_reader, &args[t]);
+    }
+    for (int i = 0; i < STRESS_ORDERS; i++) {
+        for (int id = 0; id < 4; id++)
+            store.addItem(id, 10, 1.0, 0.0);
+        for (int id = 0; id < 4; id++)
+            store.removeItem(id);
+
+        ReclaimStats stats = store.reclaimStats();
+        assert(stats.retired == 4L * (i + 1));
+        peak = max(peak, stats.retired - stats.freed);
+    }
+    done = true;
+    for (int t = 0; t < 4; t++)
+        sthread_join(readers[t]);
+
+    // Memory stays flat: only removals a preempted reader might
+    // still see wait to be freed, and without readers, everything
+    // but the last two epochs' worth is.
+    assert(peak < 4L * STRESS_ORDERS / 8);
+    for (int i = 0; i < 3; i++) {
+        store.addItem(9, 1, 1.0, 0.0);
+        store.removeItem(9);
+    }
+    ReclaimStats stats = store.reclaimStats();
+    assert(stats.retired - stats.freed <= 2);
+
+    // A removed id can be carried again.
+    assert(!store.carries(0));
+    store.addItem(0, 1, 1.0, 0.0);
+    assert(store.carries(0));
+    assert(remaining_stock(&store, 0) == 1);
+}
+
+#define TURNOVER_THREADS  (4 * MAX_EPOCH_THREADS)
+
+static void*
+turnover_buyer(void *arg)
+{
+    EStore *store = static_cast<EStore *>(arg);
+    vector<int> one(1, 0);
+    assert(store->buyManyItems(&one, MAX_BUDGET));
+    return nullptr;
+}
+
+void test_thread_turnover() {
+    // Threads that come and go give their epoch and sales slots
+    // back, so a store outlives many more of them than it has slots
+    // for, and still counts every sale.
+    EStore store(true);
+    store.addItem(0, TURNOVER_THREADS, 1.0, 0.0);
+    for (int i = 0; i < TURNOVER_THREADS; i += 8) {
+        sthread_t buyers[8];
+        for (int t = 0; t < 8; t++)
+            sthread_create(&buyers[t], turnover_buyer, &store);
+        for (int t = 0; t < 8; t++)
+            sthread_join(buyers[t]);
+    }
+    assert(store.itemSales(0).units == TURNOVER_THREADS);
+    assert(remaining_stock(&store, 0) == 0);
+
+    // Retired items are still freed.
+    store.addItem(1, 1, 1.0, 0.0);
+    store.removeItem(1);
+    for (int i = 0; i < 3; i++) {
+        store.addItem(9, 1, 1.0, 0.0);
+        store.removeItem(9);
+    }
+    ReclaimStats stats = store.reclaimStats();
+    assert(stats.retired - stats.freed <= 2);
+
+    // Likewise the client inboxes of a sharded store.
+    EStore sharded(true, false, false, 4);
+    sharded.addItem(0, TURNOVER_THREADS, 1.0, 0.0);
+    for (int i = 0; i < TURNOVER_THREADS; i += 8) {
+        sthread_t buyers[8];
+        for (int t = 0; t < 8; t++)
+            sthread_create(&buyers[t], turnover_buyer, &sharded);
+        for (int t = 0; t < 8; t++)
+            sthread_join(buyers[t]);
+    }
+    assert(remaining_stock(&sharded, 0) == 0);
+}
+
+#define TEST_WAL_PATH "/tmp/test_estore.wal"
+
+static void*
+durable_supplier(void *arg)
+{
+    EStore *store = static_cast<EStore *>(arg);
+    for (int i = 0; i < STRESS_ORDERS / 100; i++)
+        store->addStock(i % STRESS_ITEMS, 1);
+    return nullptr;
+}
+
+void test_wal_recovery() {
+    unlink(TEST_WAL_PATH);
+    double cost1, cost2;
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        store.addItem(1, 5, 10.0, 0.0);
+        store.addItem(2, 3, 4.0, 0.5);
+        store.addItem(3, 1, 1.0, 0.0);
+        store.removeItem(3);
+        store.addStock(1, 2);
+        store.priceItem(1, 8.0);
+        store.discountItem(2, 0.25);
+        store.setShippingCost(1.0);
+        store.setStoreDiscount(0.5);
+        vector<int> one(1, 1);
+        assert(store.buyManyItems(&one, MAX_BUDGET));
+        vector<int> order = {1, 2};
+        assert(store.buyManyItems(&order, MAX_BUDGET));
+        assert(store.quote(1, &cost1));
+        assert(store.quote(2, &cost2));
+        assert(store.walStats().records == 12);
+    }
+
+    // Everything that returned is recovered.
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        double cost;
+        assert(store.quote(1, &cost) && cost == cost1);
+        assert(store.quote(2, &cost) && cost == cost2);
+        assert(!store.carries(3));
+        assert(remaining_stock(&store, 1) == 5);
+        assert(remaining_stock(&store, 2) == 2);
+    }
+
+    // A record torn by a crash is dropped, and the log continues
+    // after the last good one.
+    FILE *file = fopen(TEST_WAL_PATH, "ab");
+    assert(file != nullptr);
+    fwrite("torn", 1, 4, file);
+    fclose(file);
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        struct stat st;
+        assert(stat(TEST_WAL_PATH, &st) == 0);
+        assert(st.st_size % sizeof(WalRecord) == 0);
+        assert(remaining_stock(&store, 1) == 0);
+        store.addStock(1, 1);
+    }
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        assert(remaining_stock(&store, 1) == 1);
+    }
+
+    // Concurrent suppliers share fdatasyncs.
+    unlink(TEST_WAL_PATH);
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        for (int id = 0; id < STRESS_ITEMS; id++)
+            store.addItem(id, 0, 1.0, 0.0);
+        sthread_t suppliers[STRESS_THREADS];
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_create(&suppliers[t], durable_supplier, &store);
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_join(suppliers[t]);
+
+        WalStats stats = store.walStats();
+        assert(stats.records ==
+               STRESS_ITEMS + STRESS_THREADS * (STRESS_ORDERS / 100));
+        assert(stats.syncs < stats.records);
+    }
+    unlink(TEST_WAL_PATH);
+}
+
+#define TEST_CHECKPOINT_PATH "/tmp/test_estore.ckpt"
+
+struct CheckpointArgs {
+    EStore *store;
+    volatile bool *done;
+    int taken;
+};
+
+static void*
+checkpoint_taker(void *arg)
+{
+    CheckpointArgs *args = static_cast<CheckpointArgs *>(arg);
+    while (!*args->done) {
+        assert(args->store->checkpoint(TEST_CHECKPOINT_PATH));
+        args->taken++;
+    }
+    return nullptr;
+}
+
+void test_checkpoint_recovery() {
+    unlink(TEST_WAL_PATH);
+    unlink(TEST_CHECKPOINT_PATH);
+
+    // Checkpoints taken while suppliers and buyers run, plus the
+    // log tail, add up to the store exactly: nothing is lost and
+    // nothing is applied twice.
+    // What durable_supplier adds to item id, over all threads.
+    int supplied[STRESS_ITEMS] = {0};
+    for (int i = 0; i < STRESS_ORDERS / 100; i++)
+        supplied[i % STRESS_ITEMS] += STRESS_THREADS;
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        for (int id = 0; id < STRESS_ITEMS; id++)
+            store.addItem(id, 0, 1.0, 0.0);
+        store.addItem(STRESS_ITEMS, 1, 1.0, 0.0);
+
+        volatile bool done = false;
+        CheckpointArgs args = {&store, &done, 0};
+        sthread_t taker;
+        sthread_create(&taker, checkpoint_taker, &args);
+        sthread_t suppliers[STRESS_THREADS];
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_create(&suppliers[t], durable_supplier, &store);
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_join(suppliers[t]);
+        done = true;
+        sthread_join(taker);
+        assert(args.taken > 0);
+
+        vector<int> order = {0, 1};
+        assert(store.buyManyItems(&order, MAX_BUDGET));
+        store.removeItem(STRESS_ITEMS);
+        store.setShippingCost(2.0);
+    }
+    {
+        EStore store(true);
+        assert(store.openCheckpoint(TEST_CHECKPOINT_PATH));
+        assert(store.openLog(TEST_WAL_PATH));
+        assert(!store.carries(STRESS_ITEMS));
+        double cost;
+        assert(store.quote(2, &cost) && cost == 3.0);
+        assert(remaining_stock(&store, 0) == supplied[0] - 1);
+        assert(remaining_stock(&store, 1) == supplied[1] - 1);
+        for (int id = 2; id < STRESS_ITEMS; id++)
+            assert(remaining_stock(&store, id) == supplied[id]);
+
+        // A quiescent checkpoint covers the whole log.
+        store.addStock(3, 2);
+        assert(store.checkpoint(TEST_CHECKPOINT_PATH));
+    }
+
+    // Restoring from the checkpoint alone, items are loaded as they
+    // are looked up, and removed ones stay removed.
+    {
+        EStore store(true);
+        assert(store.openCheckpoint(TEST_CHECKPOINT_PATH));
+        double cost;
+        assert(store.quote(3, &cost) && cost == 3.0);
+        assert(store.carries(4));
+        store.removeItem(4);
+        assert(!store.carries(4));
+        store.addItem(4, 7, 1.0, 0.0);
+        assert(remaining_stock(&store, 4) == 7);
+        assert(remaining_stock(&store, 3) == 2);
+        assert(!store.carries(STRESS_ITEMS));
+        assert(store.checkpoint(TEST_CHECKPOINT_PATH));
+    }
+
+    // That checkpoint was taken without a log, so it cannot be
+    // combined with one.
+    {
+        EStore store(true);
+        assert(store.openCheckpoint(TEST_CHECKPOINT_PATH));
+        assert(!store.openLog(TEST_WAL_PATH));
+    }
+
+    // A checkpoint for a store of another size is refused.
+    {
+        EStore store(true);
+        FILE *file = fopen(TEST_CHECKPOINT_PATH, "ab");
+        assert(file != nullptr);
+        fwrite("x", 1, 1, file);
+        fclose(file);
+        assert(!store.openCheckpoint(TEST_CHECKPOINT_PATH));
+    }
+    unlink(TEST_WAL_PATH);
+    unlink(TEST_CHECKPOINT_PATH);
+}
+
+#define LARGE_CATALOG (1 << 20)
+
+struct StripeArgs {
+    EStore *store;
+    int first;
+};
+
+// Two-item orders whose items share a lock stripe, bought while
+// the other item of the pair gets restocked.
+static void*
+stripe_customer(void *arg)
+{
+    StripeArgs *args = static_cast<StripeArgs *>(arg);
+    vector<int> order = {args->first, args->first + ITEM_LOCK_STRIPES};
+    for (int i = 0; i < STRESS_ORDERS / 10; i++) {
+        assert(args->store->buyManyItems(&order, MAX_BUDGET));
+        args->store->addStock(order[i % 2], 0);
+    }
+    return nullptr;
+}
+
+void test_large_catalog() {
+    EStore store(true, false, true, 0, LARGE_CATALOG);
+    store.addItem(0, 1, 1.0, 0.0);
+    store.addItem(LARGE_CATALOG / 2, 2, 2.0, 0.0);
+    store.addItem(LARGE_CATALOG - 1, 3, 3.0, 0.5);
+    store.addItem(LARGE_CATALOG, 1, 1.0, 0.0);
+    assert(!store.carries(LARGE_CATALOG));
+    assert(!store.carries(1));
+
+    double cost;
+    vector<int> far = {0, LARGE_CATALOG / 2, LARGE_CATALOG - 1};
+    assert(store.quoteMany(far, &cost) && cost == 1.0 + 2.0 + 1.5 + 3 * 3.0);
+    assert(store.buyManyItems(&far, MAX_BUDGET));
+    assert(remaining_stock(&store, LARGE_CATALOG - 1) == 2);
+
+    // Items that share a lock stripe, in one order and across
+    // overlapping orders, neither deadlock nor lose units. For base
+    // 10 and 11, a quarter of the threads buy base and base + one
+    // stripe count, another quarter that and base + two.
+    int stock = STRESS_THREADS * STRESS_ORDERS / 10;
+    for (int base = 10; base < 12; base++)
+        for (int k = 0; k < 3; k++)
+            store.addItem(base + k * ITEM_LOCK_STRIPES, stock, 1.0, 0.0);
+
+    sthread_t customers[STRESS_THREADS];
+    StripeArgs args[STRESS_THREADS];
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        int first = 10 + t % 2 + (t / 2 % 2) * ITEM_LOCK_STRIPES;
+        args[t] = StripeArgs{&store, first};
+        sthread_create(&customers[t], stripe_customer, &args[t]);
+    }
+    for (int t = 0; t < STRESS_THREADS; t++)
+        sthread_join(customers[t]);
+
+    int bought = STRESS_THREADS / 4 * (STRESS_ORDERS / 10);
+    for (int base = 10; base < 12; base++) {
+        assert(remaining_stock(&store, base) == stock - bought);
+        assert(remaining_stock(&store, base + ITEM_LOCK_STRIPES) ==
+               stock - 2 * bought);
+        assert(remaining_stock(&store, base + 2 * ITEM_LOCK_STRIPES) ==
+               stock - bought);
+    }
+}
+
+#define BULK_ITEMS 1024
+
+// Check the unit cost of every id against price * (1 - discount) + 3,
+// the default shipping cost; ids with a zero price must not be carried.
+static void
+check_costs(EStore &store, const vector<double> &price,
+            const vector<double> &discount)
+{
+    for (int id = 0; id < BULK_ITEMS; id++) {
+        double cost;
+        if (price[id] == 0.0) {
+            assert(!store.quote(id, &cost));
+            continue;
+        }
+        assert(store.quote(id, &cost));
+        assert(cost == price[id] * (1 - discount[id]) + 3.0);
+    }
+}
+
+static void
+bulk_repricing(EStore &store, vector<double> &price,
+               vector<double> &discount)
+{
+    // Ids below 512 fill whole chunks; above, only every third id is
+    // carried.
+    for (int id = 0; id < BULK_ITEMS; id++) {
+        if (id < 512 || id % 3 == 0) {
+            store.addItem(id, 1, 8.0 + id % 7, 0.0);
+            price[id] = 8.0 + id % 7;
+        }
+    }
+
+    store.scalePrices(0.5);
+    for (int id = 0; id < BULK_ITEMS; id++)
+        price[id] *= 0.5;
+
+    store.discountRange(100, 600, 0.25);
+    store.discountRange(1000, 5000, 0.5);
+    for (int id = 0; id < BULK_ITEMS; id++) {
+        if (price[id] != 0.0 && id >= 100 && id <= 600)
+            discount[id] = 0.25;
+        if (price[id] != 0.0 && id >= 1000)
+            discount[id] = 0.5;
+    }
+
+    // The last price of a repeated id counts; ids not carried are
+    // skipped.
+    vector<int> ids = {700, 5, 300, 5, 1, 1022};
+    vector<double> prices = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+    store.priceItems(ids, prices);
+    price[5] = 4.0;
+    price[300] = 3.0;
+    price[1] = 5.0;
+}
+
+void test_bulk_repricing() {
+    vector<double> price(BULK_ITEMS), discount(BULK_ITEMS);
+    EStore fine(true, false, true, 0, BULK_ITEMS);
+    bulk_repricing(fine, price, discount);
+    check_costs(fine, price, discount);
+
+    vector<double> shardPrice(BULK_ITEMS), shardDiscount(BULK_ITEMS);
+    EStore sharded(true, false, false, 4, BULK_ITEMS);
+    bulk_repricing(sharded, shardPrice, shardDiscount);
+    check_costs(sharded, shardPrice, shardDiscount);
+
+    // Bulk updates are logged item by item and recovered.
+    unlink(TEST_WAL_PATH);
+    {
+        EStore store(true, false, false, 0, BULK_ITEMS);
+        assert(store.openLog(TEST_WAL_PATH));
+        fill(price.begin(), price.end(), 0.0);
+        fill(discount.begin(), discount.end(), 0.0);
+        bulk_repricing(store, price, discount);
+    }
+    {
+        EStore store(true, false, false, 0, BULK_ITEMS);
+        assert(store.openLog(TEST_WAL_PATH));
+        check_costs(store, price, discount);
+    }
+    unlink(TEST_WAL_PATH);
+
+    // Only waiters that can afford the new cost are woken.
+    EStore store(false);
+    store.addItem(1, 10, 100.0, 0.0);
+    store.addItem(2, 10, 100.0, 0.0);
+    BuyItemArgs rich = {&store, 1, 60.0};
+    BuyItemArgs poor = {&store, 2, 30.0};
+    sthread_t richThread, poorThread;
+    sthread_create(&richThread, item_customer, &rich);
+    sthread_create(&poorThread, item_customer, &poor);
+    while (store.wakeupStats().waits < 2)
+        sthread_sleep(0, 1000000);
+
+    store.scalePrices(0.75);
+    sthread_sleep(0, 10000000);
+    assert(store.wakeupStats().wakeups == 0);
+
+    store.priceItems(vector<int>{1, 2}, vector<double>{50.0, 50.0});
+    sthread_join(richThread);
+    assert(store.wakeupStats().wakeups == 1);
+
+    store.discountRange(0, 10, 0.5);
+    sthread_join(poorThread);
+    WakeupStats stats = store.wakeupStats();
+    assert(stats.wakeups == 2);
+    assert(stats.spuriousWakeups == 0);
+}
+
+// A supplier batch that exercises every request type; see
+// test_apply_batch for the expected outcome.
+static vector<SupplierOp>
+supplier_batch()
+{
+    return {
+        {ADD_ITEM, 1, 5, 10.0, 0.0},
+        {ADD_ITEM, 2, 3, 4.0, 0.5},
+        {ADD_STOCK, 1, 2, 0.0, 0.0},
+        {CHANGE_ITEM_PRICE, 1, 0, 8.0, 0.0},
+        {CHANGE_ITEM_DISCOUNT, 2, 0, 0.25, 0.0},
+        {ADD_ITEM, 3, 1, 1.0, 0.0},
+        {REMOVE_ITEM, 3, 0, 0.0, 0.0},
+        {ADD_STOCK, 3, 1, 0.0, 0.0},
+        {SET_SHIPPING_COST, 0, 0, 1.0, 0.0},
+        {SET_STORE_DISCOUNT, 0, 0, 0.5, 0.0},
+        {CHANGE_ITEM_PRICE, 1, 0, 6.0, 0.0},
+    };
+}
+
+static void
+check_supplier_batch(EStore &store)
+{
+    double cost;
+    assert(store.quote(1, &cost) && cost == 6.0 * 0.5 + 1.0);
+    assert(store.quote(2, &cost) && cost == 4.0 * 0.75 * 0.5 + 1.0);
+    assert(!store.carries(3));
+    // Only fine mode can take stock without blocking.
+    if (store.fineModeEnabled()) {
+        assert(remaining_stock(&store, 1) == 7);
+        assert(remaining_stock(&store, 2) == 3);
+    }
+}
+
+void test_apply_batch() {
+    // Same effect as the calls one by one, in every mode.
+    for (int mode = 0; mode < 4; mode++) {
+        EStore store(mode > 0, false, mode == 2, mode == 3 ? 4 : 0);
+        store.applyBatch(supplier_batch());
+        check_supplier_batch(store);
+    }
+
+    unlink(TEST_WAL_PATH);
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        store.applyBatch(supplier_batch());
+    }
+    {
+        EStore store(true);
+        assert(store.openLog(TEST_WAL_PATH));
+        check_supplier_batch(store);
+    }
+    unlink(TEST_WAL_PATH);
+
+    // A restock storm wakes each waiter that can buy once, and
+    // nobody else.
+    EStore store(false);
+    store.addItem(1, 0, 10.0, 0.0);
+    store.addItem(2, 0, 100.0, 0.0);
+    BuyItemArgs rich = {&store, 1, 20.0};
+    BuyItemArgs poor = {&store, 2, 20.0};
+    sthread_t richThread, poorThread;
+    sthread_create(&richThread, item_customer, &rich);
+    sthread_create(&poorThread, item_customer, &poor);
+    while (store.wakeupStats().waits < 2)
+        sthread_sleep(0, 1000000);
+
+    vector<SupplierOp> restock;
+    for (int i = 0; i < 10; i++) {
+        restock.push_back({ADD_STOCK, 1, 1, 0.0, 0.0});
+        restock.push_back({ADD_STOCK, 2, 1, 0.0, 0.0});
+    }
+    store.applyBatch(restock);
+    sthread_join(richThread);
+    sthread_sleep(0, 10000000);
+    assert(store.wakeupStats().wakeups == 1);
+
+    store.applyBatch({{CHANGE_ITEM_PRICE, 2, 0, 50.0, 0.0},
+                      {SET_SHIPPING_COST, 0, 0, 0.0, 0.0},
+                      {CHANGE_ITEM_PRICE, 2, 0, 10.0, 0.0}});
+    sthread_join(poorThread);
+    WakeupStats stats = store.wakeupStats();
+    assert(stats.wakeups == 2);
+    assert(stats.spuriousWakeups == 0);
+
+    // Blocked orders in fine mode are woken too.
+    EStore fine(true);
+    fine.addItem(1, 0, 10.0, 0.0);
+    BlockingArgs args = {&fine, {1}, 5.0, false};
+    sthread_t customer;
+    sthread_create(&customer, blocking_customer, &args);
+    wait_for_waits(&fine, 1);
+    fine.applyBatch({{ADD_STOCK, 1, 1, 0.0, 0.0},
+                     {CHANGE_ITEM_PRICE, 1, 0, 2.0, 0.0}});
+    sthread_join(customer);
+    assert(args.bought);
+}
+
+#define COALESCE_ITEMS 8
+#define COALESCE_TASKS 2000
+
+// A random supplier request on one of COALESCE_ITEMS items.
+static Task
+random_supplier_task(EStore *store, unsigned *seed)
+{
+    int id = rand_r(seed) % COALESCE_ITEMS;
+    double value = 1 + rand_r(seed) % 50;
+    switch (rand_r(seed) % 10) {
+    case 0:
+        return Task{add_item_handler,
+                    new AddItemReq{store, id, 5, value, 0.0}};
+    case 1:
+        return Task{remove_item_handler, new RemoveItemReq{store, id}};
+    case 2:
+    case 3:
+        return Task{add_stock_handler, new AddStockReq{store, id, 1}};
+    case 4:
+    case 5:
+        return Task{change_item_price_handler,
+                    new ChangeItemPriceReq{store, id, value}};
+    case 6:
+    case 7:
+        return Task{change_item_discount_handler,
+                    new ChangeItemDiscountReq{store, id, value / 100}};
+    case 8:
+        return Task{set_shipping_cost_handler,
+                    new SetShippingCostReq{store, value / 10}};
+    default:
+        return Task{set_store_discount_handler,
+                    new SetStoreDiscountReq{store, value / 100}};
+    }
+}
+
+// Carry out a supplier task like its handler, without the printing.
+static void
+apply_task(Task task)
+{
+    if (task.handler == add_item_handler) {
+        AddItemReq *req = static_cast<AddItemReq *>(task.arg);
+        req->store->addItem(req->item_id, req->quantity, req->price,
+                            req->discount);
+        delete req;
+    } else if (task.handler == remove_item_handler) {
+        RemoveItemReq *req = static_cast<RemoveItemReq *>(task.arg);
+        req->store->removeItem(req->item_id);
+        delete req;
+    } else if (task.handler == add_stock_handler) {
+        AddStockReq *req = static_cast<AddStockReq *>(task.arg);
+        req->store->addStock(req->item_id, req->additional_stock);
+        delete req;
+    } else if (task.handler == change_item_price_handler) {
+        ChangeItemPriceReq *req = static_cast<ChangeItemPriceReq *>(task.arg);
+        req->store->priceItem(req->item_id, req->new_price);
+        delete req;
+    } else if (task.handler == change_item_discount_handler) {
+        ChangeItemDiscountReq *req =
+            static_cast<ChangeItemDiscountReq *>(task.arg);
+        req->store->discountItem(req->item_id, req->new_discount);
+        delete req;
+    } else if (task.handler == set_shipping_cost_handler) {
+        SetShippingCostReq *req = static_cast<SetShippingCostReq *>(task.arg);
+        req->store->setShippingCost(req->new_cost);
+        delete req;
+    } else {
+        SetStoreDiscountReq *req = static_cast<SetStoreDiscountReq *>(task.arg);
+        req->store->setStoreDiscount(req->new_discount);
+        delete req;
+    }
+}
+
+void test_supplier_coalescing() {
+    // Queued behind each other, redundant requests are merged; the
+    // store ends up the same as if each had been handled in turn.
+    EStore direct(true), coalesced(true);
+    TaskQueue queue;
+    unsigned seedA = 7, seedB = 7;
+    for (int i = 0; i < COALESCE_TASKS; i++) {
+        apply_task(random_supplier_task(&direct, &seedA));
+        enqueue_supplier_task(&queue, random_supplier_task(&coalesced, &seedB));
+    }
+    long handled = 0;
+    Task task;
+    while (queue.tryDequeue(&task)) {
+        apply_task(task);
+        handled++;
+    }
+    assert(handled + queue.mergedCount() == COALESCE_TASKS);
+    assert(queue.mergedCount() > COALESCE_TASKS / 4);
+
+    for (int id = 0; id < COALESCE_ITEMS; id++) {
+        double a, b;
+        bool carried = direct.quote(id, &a);
+        assert(coalesced.quote(id, &b) == carried);
+        if (carried) {
+            assert(a == b);
+            assert(remaining_stock(&direct, id) ==
+                   remaining_stock(&coalesced, id));
+        }
+    }
+
+    // A price change is merged into the queued one, not past a
+    // removal of the item.
+    TaskQueue fenced;
+    enqueue_supplier_task(&fenced,
+        Task{change_item_price_handler, new ChangeItemPriceReq{&direct, 1, 2.0}});
+    enqueue_supplier_task(&fenced,
+        Task{change_item_price_handler, new ChangeItemPriceReq{&direct, 1, 3.0}});
+    enqueue_supplier_task(&fenced, Task{remove_item_handler,
+                                        new RemoveItemReq{&direct, 1}});
+    enqueue_supplier_task(&fenced,
+        Task{change_item_price_handler, new ChangeItemPriceReq{&direct, 1, 4.0}});
+    assert(fenced.mergedCount() == 1);
+    double prices[] = {3.0, -1.0, 4.0};
+    for (double price : prices) {
+        assert(fenced.tryDequeue(&task));
+        if (price < 0) {
+            assert(task.handler == remove_item_handler);
+            delete static_cast<RemoveItemReq *>(task.arg);
+            continue;
+        }
+        ChangeItemPriceReq *req = static_cast<ChangeItemPriceReq *>(task.arg);
+        assert(req->new_price == price);
+        delete req;
+    }
+    assert(!fenced.tryDequeue(&task));
+}
+
+#define RING_THREADS      4
+#define RING_TASKS        (4 * TASK_RING_SIZE)
+
+struct RingArgs {
+    TaskQueue *queue;
+    long first;
+    // Tasks taken and how many were out of their producer's order.
+    vector<int> *seen;
+    long disordered;
+};
+
+static void
+ring_task(void *arg)
+{
+}
+
+static void*
+ring_producer(void *arg)
+{
+    RingArgs *args = static_cast<RingArgs *>(arg);
+    for (long i = 0; i < RING_TASKS; i++)
+        args->queue->enqueue(Task{ring_task, (void *) (args->first + i)});
+    return nullptr;
+}
+
+static void*
+ring_consumer(void *arg)
+{
+    RingArgs *args = static_cast<RingArgs *>(arg);
+    long last[RING_THREADS];
+    fill(last, last + RING_THREADS, -1L);
+    for (long i = 0; i < RING_TASKS; i++) {
+        Task task = args->queue->dequeue();
+        assert(task.handler == ring_task);
+        long n = (long) task.arg;
+        if (n <= last[n / RING_TASKS])
+            args->disordered++;
+        last[n / RING_TASKS] = n;
+        (*args->seen)[n]++;
+    }
+    return nullptr;
+}
+
+void test_task_ring() {
+    // Producers fill the ring and park until consumers make room;
+    // every task comes out exactly once, and each consumer sees a
+    // producer's tasks in the order they went in.
+    TaskQueue queue(true);
+    Task task;
+    assert(!queue.tryDequeue(&task));
+
+    vector<int> seen[RING_THREADS];
+    RingArgs producers[RING_THREADS], consumers[RING_THREADS];
+    sthread_t threads[2 * RING_THREADS];
+    for (int t = 0; t < RING_THREADS; t++) {
+        producers[t] = RingArgs{&queue, (long) t * RING_TASKS, nullptr, 0};
+        sthread_create(&threads[t], ring_producer, &producers[t]);
+    }
+    for (int t = 0; t < RING_THREADS; t++) {
+        seen[t].assign(RING_THREADS * RING_TASKS, 0);
+        consumers[t] = RingArgs{&queue, 0, &seen[t], 0};
+        sthread_create(&threads[RING_THREADS + t], ring_consumer,
+                       &consumers[t]);
+    }
+    for (int t = 0; t < 2 * RING_THREADS; t++)
+        sthread_join(threads[t]);
+
+    for (long n = 0; n < RING_THREADS * RING_TASKS; n++) {
+        int count = 0;
+        for (int t = 0; t < RING_THREADS; t++)
+            count += seen[t][n];
+        assert(count == 1);
+    }
+    for (int t = 0; t < RING_THREADS; t++)
+        assert(consumers[t].disordered == 0);
+    assert(!queue.tryDequeue(&task));
+
+    // Fill the ring and drain it without blocking.
+    for (long n = 0; n < TASK_RING_SIZE; n++)
+        queue.enqueue(Task{ring_task, (void *) n});
+    for (long n = 0; n < TASK_RING_SIZE; n++) {
+        assert(queue.tryDequeue(&task));
+        assert((long) task.arg == n);
+    }
+    assert(!queue.tryDequeue(&task));
+}
+
+static void*
+batch_consumer(void *arg)
+{
+    vector<Task> tasks;
+    int n = static_cast<TaskQueue *>(arg)->dequeueUpTo(tasks, 1);
+    assert(n == 1 && tasks.size() == 1 && tasks[0].handler == ring_task);
+    return nullptr;
+}
+
+void test_task_batches() {
+    for (int lockFree = 0; lockFree <= 1; lockFree++) {
+        // A batch goes in and comes out in order, max at a time.
+        TaskQueue queue(lockFree);
+        vector<Task> in, out;
+        for (long n = 0; n < 10; n++)
+            in.push_back(Task{ring_task, (void *) n});
+        queue.enqueueMany(in);
+        assert(queue.dequeueUpTo(out, 4) == 4);
+        assert(queue.dequeueUpTo(out, 100) == 6);
+        for (long n = 0; n < 10; n++)
+            assert((long) out[n].arg == n);
+        Task task;
+        assert(!queue.tryDequeue(&task));
+
+        // One batch wakes every consumer sleeping on the queue.
+        sthread_t consumers[RING_THREADS];
+        for (int t = 0; t < RING_THREADS; t++)
+            sthread_create(&consumers[t], batch_consumer, &queue);
+        sthread_sleep(0, 10000000);
+        queue.enqueueMany(vector<Task>(RING_THREADS, Task{ring_task, nullptr}));
+        for (int t = 0; t < RING_THREADS; t++)
+            sthread_join(consumers[t]);
+        assert(!queue.tryDequeue(&task));
+    }
+}
+
+#define SALES_THREADS     4
+#define SALES_ORDERS      2000
+
+struct SalesArgs {
+    EStore *store;
+    unsigned seed;
+    // Item STRESS_ITEMS is never carried.
+    long bought[STRESS_ITEMS + 1];
+    long failed[STRESS_ITEMS + 1];
+};
+
+static void*
+sales_customer(void *arg)
+{
+    SalesArgs *args = static_cast<SalesArgs *>(arg);
+    for (int i = 0; i < SALES_ORDERS; i++) {
+        vector<int> order;
+        int n = 1 + rand_r(&args->seed) % 3;
+        for (int j = 0; j < n; j++)
+            order.push_back(rand_r(&args->seed) % (STRESS_ITEMS + 1));
+
+        bool bought = args->store->buyManyItems(&order, MAX_BUDGET);
+        sort(order.begin(), order.end());
+        for (size_t j = 0; j < order.size(); j++) {
+            if (bought)
+                args->bought[order[j]]++;
+            else if (j == 0 || order[j] != order[j - 1])
+                args->failed[order[j]]++;
+        }
+    }
+    return nullptr;
+}
+
+static bool
+close_to(double a, double b)
+{
+    return a - b < 1e-6 * (1 + b) && b - a < 1e-6 * (1 + b);
+}
+
+static void
+check_sales(EStore *store)
+{
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        store->addItem(id, STRESS_STOCK, id + 1.0, 0.0);
+
+    sthread_t customers[SALES_THREADS];
+    SalesArgs args[SALES_THREADS] = {};
+    for (int t = 0; t < SALES_THREADS; t++) {
+        args[t].store = store;
+        args[t].seed = t;
+        sthread_create(&customers[t], sales_customer, &args[t]);
+    }
+    for (int t = 0; t < SALES_THREADS; t++)
+        sthread_join(customers[t]);
+
+    // Every item sells at its price plus 3 shipping.
+    double total = 0.0, best = 0.0;
+    for (int id = 0; id <= STRESS_ITEMS; id++) {
+        long bought = 0, failed = 0;
+        for (int t = 0; t < SALES_THREADS; t++) {
+            bought += args[t].bought[id];
+            failed += args[t].failed[id];
+        }
+        ItemSales sales = store->itemSales(id);
+        assert(sales.item_id == id);
+        assert(sales.units == bought);
+        assert(sales.failed == failed && failed > 0);
+        assert(close_to(sales.revenue, bought * (id + 4.0)));
+        total += sales.revenue;
+        best = max(best, sales.revenue);
+    }
+    assert(store->itemSales(STRESS_ITEMS).units == 0);
+
+    vector<ItemSales> top = store->topSellers(3);
+    assert(top.size() == 3);
+    assert(top[0].revenue == best);
+    assert(top[0].revenue >= top[1].revenue &&
+           top[1].revenue >= top[2].revenue);
+
+    vector<double> revenue = store->revenueByInterval(SALES_INTERVALS);
+    assert(revenue.size() == SALES_INTERVALS);
+    double recent = 0.0;
+    for (double r : revenue)
+        recent += r;
+    assert(close_to(recent, total));
+}
+
+void test_sales_counters() {
+    EStore fine(true), optimistic(true, true), sharded(false, false, false, 4);
+    check_sales(&fine);
+    check_sales(&optimistic);
+    check_sales(&sharded);
+
+    // Single-item buys in coarse mode, at 10 * 0.5 + 3 each.
+    EStore coarse(false);
+    coarse.addItem(1, 2, 10.0, 0.5);
+    coarse.buyItem(1, 8.0);
+    coarse.buyItem(1, 8.0);
+    coarse.buyItem(2, 100.0);
+    ItemSales one = coarse.itemSales(1);
+    assert(one.units == 2 && one.revenue == 16.0 && one.failed == 0);
+    assert(coarse.itemSales(2).failed == 1);
+    assert(coarse.topSellers(5).size() == 1);
+}
+
+struct FlipArgs {
+    EStore *store;
+    volatile bool *done;
+    long flips;
+};
+
+static void*
+hot_flipper(void *arg)
+{
+    FlipArgs *args = static_cast<FlipArgs *>(arg);
+    unsigned seed = 11;
+    while (!*args->done) {
+        int id = rand_r(&seed) % STRESS_ITEMS;
+        if (args->flips % 2 == 0)
+            args->store->promoteItem(id);
+        else
+            args->store->demoteItem(id);
+        if (args->flips % 64 == 0)
+            args->store->discountRange(0, STRESS_ITEMS - 1, 0.0);
+        args->flips++;
+        sthread_yield();
+    }
+    return nullptr;
+}
+
+static void
+check_promotion_cooling(bool fine)
+{
+    EStore store(fine, false, false, 0, ITEM_TABLE_SIZE, true);
+    store.addItem(1, HOT_ITEM_PROMOTE, 1.0, 0.0);
+    store.promoteItem(1);
+    store.promoteItem(2);
+    assert(store.hotItems() == vector<int>(1, 1));
+
+    // Every uncontended purchase cools the item a little.
+    vector<int> one(1, 1);
+    for (int i = 0; i < HOT_ITEM_PROMOTE; i++) {
+        assert(store.hotItems().size() == 1);
+        if (fine)
+            assert(store.buyManyItems(&one, 10.0));
+        else
+            store.buyItem(1, 10.0);
+    }
+    assert(store.hotItems().empty());
+    assert(store.itemSales(1).units == HOT_ITEM_PROMOTE);
+
+    HotItemStats stats = store.hotItemStats();
+    assert(stats.promotions == 1 && stats.demotions == 1);
+    vector<HotItemEvent> events = store.hotItemEvents();
+    assert(events.size() == 2);
+    assert(events[0].item_id == 1 && events[0].promoted);
+    assert(events[1].item_id == 1 && !events[1].promoted);
+    assert(events[0].when <= events[1].when);
+}
+
+void test_hot_item_promotion() {
+    // Promotion is forced here: on one CPU, locks are rarely found
+    // busy often enough to promote anything on their own.
+    check_promotion_cooling(false);
+    check_promotion_cooling(true);
+
+    // Items move between their stripes and dedicated locks under
+    // multi-item orders, single-item updates and bulk updates.
+    for (int combining = 0; combining <= 1; combining++) {
+        EStore store(true, false, combining, 0, ITEM_TABLE_SIZE, true);
+        for (int id = 0; id < STRESS_ITEMS; id++)
+            store.addItem(id, STRESS_STOCK, 1.0, 0.0);
+
+        volatile bool done = false;
+        FlipArgs flip = {&store, &done, 0};
+        sthread_t flipper, customers[STRESS_THREADS], supplier;
+        sthread_create(&flipper, hot_flipper, &flip);
+        StressArgs args[STRESS_THREADS + 1] = {};
+        for (int t = 0; t <= STRESS_THREADS; t++) {
+            args[t].store = &store;
+            args[t].seed = t;
+        }
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_create(&customers[t], stress_customer, &args[t]);
+        sthread_create(&supplier, stress_supplier, &args[STRESS_THREADS]);
+        for (int t = 0; t < STRESS_THREADS; t++)
+            sthread_join(customers[t]);
+        sthread_join(supplier);
+        done = true;
+        sthread_join(flipper);
+
+        for (int id = 0; id < STRESS_ITEMS; id++) {
+            long bought = 0;
+            for (int t = 0; t < STRESS_THREADS; t++)
+                bought += args[t].bought[id];
+            assert(remaining_stock(&store, id) == STRESS_STOCK - bought);
+        }
+        HotItemStats stats = store.hotItemStats();
+        assert(stats.promotions > 0 && stats.demotions > 0);
+        assert(store.hotItemEvents().size() <= HOT_ITEM_EVENTS);
+    }
+}
+
+// Long enough for a buyer to block on the held units first.
+#define TEST_HOLD_TTL_NS  200000000L
+#define MANY_HOLDS        100000
+#define HOLD_STOCK        (MANY_HOLDS / STRESS_ITEMS)
+
+// Units of the item for sale: bought up one at a time in coarse
+// mode, where buyManyItems does not work.
+static int
+units_for_sale(EStore *store, int item_id)
+{
+    if (store->fineModeEnabled())
+        return remaining_stock(store, item_id);
+    struct timespec past = {0, 0};
+    int left = 0;
+    while (store->buyItemUntil(item_id, MAX_BUDGET, past) == PURCHASE_BOUGHT)
+        left++;
+    return left;
+}
+
+static void
+check_holds(bool fine)
+{
+    EStore store(fine);
+    store.addItem(1, 2, 10.0, 0.0);
+    store.addItem(2, 5, 10.0, 0.0);
+
+    // Held units are not for sale, and come back when released.
+    HoldToken token = store.reserve({1, 2, 1}, LONG_SLO_NS);
+    assert(token != 0);
+    assert(store.reserve({1}, LONG_SLO_NS) == 0);
+    assert(store.reserve({2, 3}, LONG_SLO_NS) == 0);
+    assert(store.release(token));
+    assert(!store.release(token) && !store.commit(token));
+
+    // A committed hold is sold.
+    token = store.reserve({1, 2}, LONG_SLO_NS);
+    assert(store.commit(token));
+    assert(!store.release(token));
+    assert(store.itemSales(1).units == 1 && store.itemSales(2).units == 1);
+
+    // A hold on an item removed since cannot be committed.
+    store.addItem(3, 1, 10.0, 0.0);
+    token = store.reserve({3}, LONG_SLO_NS);
+    store.removeItem(3);
+    assert(!store.commit(token));
+
+    // An expiring hold wakes the buyer waiting for its unit, and
+    // nobody else.
+    token = store.reserve({1}, TEST_HOLD_TTL_NS);
+    assert(token != 0);
+    BlockingArgs many = {&store, {1}, 100.0, false};
+    BuyItemArgs one = {&store, 1, 100.0};
+    sthread_t customer;
+    if (fine) {
+        sthread_create(&customer, blocking_customer, &many);
+        wait_for_waits(&store, 1);
+    } else {
+        sthread_create(&customer, item_customer, &one);
+        while (store.wakeupStats().waits < 1)
+            sthread_sleep(0, 1000000);
+    }
+    sthread_join(customer);
+    assert(!fine || many.bought);
+    long wakeups = fine ? store.orderStats().wakeups
+                        : store.wakeupStats().wakeups;
+    assert(wakeups == 1);
+    assert(units_for_sale(&store, 1) == 0);
+    assert(units_for_sale(&store, 2) == 4);
+
+    HoldStats stats = store.holdStats();
+    assert(stats.reserved == 4 && stats.committed == 1);
+    assert(stats.released == 2 && stats.expired == 1);
+    assert(stats.outstanding == 0);
+}
+
+void test_holds() {
+    check_holds(false);
+    check_holds(true);
+
+    // Many holds at once: some committed, some released, and the
+    // rest left to expire over a few ticks.
+    EStore store(true);
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        store.addItem(id, HOLD_STOCK, 1.0, 0.0);
+    unsigned seed = 5;
+    long committed[STRESS_ITEMS] = {0};
+    for (int i = 0; i < MANY_HOLDS; i++) {
+        int id = i % STRESS_ITEMS;
+        long ttl = i % 4 < 2 ? LONG_SLO_NS : rand_r(&seed) % SHORT_SLO_NS;
+        HoldToken token = store.reserve({id}, ttl);
+        assert(token != 0);
+        if (i % 4 == 0) {
+            assert(store.commit(token));
+            committed[id]++;
+        } else if (i % 4 == 1) {
+            assert(store.release(token));
+        }
+    }
+    assert(store.reserve({0}, LONG_SLO_NS) == 0);
+
+    // Held units are saved as stock.
+    assert(store.checkpoint(TEST_CHECKPOINT_PATH));
+    {
+        EStore restored(true);
+        assert(restored.openCheckpoint(TEST_CHECKPOINT_PATH));
+        assert(remaining_stock(&restored, 0) == HOLD_STOCK - committed[0]);
+    }
+    unlink(TEST_CHECKPOINT_PATH);
+
+    while (store.holdStats().outstanding > 0)
+        sthread_sleep(0, 1000000);
+    HoldStats stats = store.holdStats();
+    assert(stats.reserved == MANY_HOLDS);
+    assert(stats.expired == MANY_HOLDS / 2);
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        assert(remaining_stock(&store, id) == HOLD_STOCK - committed[id]);
+}
+
+#define RACE_BUYERS       4
+#define RACE_HOLDERS      2
+#define RACE_ORDERS       20000
+#define RACE_STOCK        (RACE_ORDERS / 4)
+
+struct HoldRaceArgs {
+    EStore *store;
+    unsigned seed;
+    bool holder;
+    // Units bought or held of each item.
+    long taken[STRESS_ITEMS];
+};
+
+static void*
+hold_racer(void *arg)
+{
+    HoldRaceArgs *args = static_cast<HoldRaceArgs *>(arg);
+    struct timespec past = {0, 0};
+    for (int i = 0; i < RACE_ORDERS; i++) {
+        int a = rand_r(&args->seed) % STRESS_ITEMS;
+        int b = rand_r(&args->seed) % STRESS_ITEMS;
+        if (!args->holder) {
+            if (args->store->buyItemUntil(a, MAX_BUDGET, past) ==
+                PURCHASE_BOUGHT)
+                args->taken[a]++;
+        } else if (args->store->reserve({a, b}, LONG_SLO_NS) != 0) {
+            args->taken[a]++;
+            args->taken[b]++;
+        }
+    }
+    return nullptr;
+}
+
+void test_holds_against_buyers() {
+    // In coarse mode, holds are taken while lock-free buyers empty
+    // the same items: no unit is both sold and held, and stock never
+    // goes below zero.
+    EStore store(false);
+    for (int id = 0; id < STRESS_ITEMS; id++)
+        store.addItem(id, RACE_STOCK, 1.0, 0.0);
+
+    HoldRaceArgs args[RACE_BUYERS + RACE_HOLDERS];
+    sthread_t threads[RACE_BUYERS + RACE_HOLDERS];
+    for (int t = 0; t < RACE_BUYERS + RACE_HOLDERS; t++) {
+        args[t] = HoldRaceArgs{&store, (unsigned) t + 1, t >= RACE_BUYERS, {0}};
+        sthread_create(&threads[t], hold_racer, &args[t]);
+    }
+    for (int t = 0; t < RACE_BUYERS + RACE_HOLDERS; t++)
+        sthread_join(threads[t]);
+
+    for (int id = 0; id < STRESS_ITEMS; id++) {
+        long taken = 0;
+        for (int t = 0; t < RACE_BUYERS + RACE_HOLDERS; t++)
+            taken += args[t].taken[id];
+        assert(taken <= RACE_STOCK);
+        assert(units_for_sale(&store, id) == RACE_STOCK - taken);
+    }
+}
+
+int main() {
+    // A deadlock fails the test instead of hanging it.
+    alarm(120);
+
+    test_buy_many_duplicates();
+    test_buy_many_store_pricing();
+    test_quote();
+    test_buy_many_blocking();
+    test_buy_many_split_cuts();
+    test_buy_item_budget_wakeups();
+    test_timed_buy_item();
+    test_timed_buy_many();
+    test_buy_item_fast_path_stock();
+    test_buy_many_overlapping_stress(false);
+    test_buy_many_overlapping_stress(true);
+    test_hot_item_combining();
+    test_hot_item_promotion();
+    test_sharded_store();
+    test_sharded_stress();
+    test_sharded_pricing();
+    test_removed_items_reclaimed();
+    test_thread_turnover();
+    test_large_catalog();
+    test_bulk_repricing();
+    test_apply_batch();
+    test_supplier_coalescing();
+    test_task_ring();
+    test_task_batches();
+    test_sales_counters();
+    test_holds();
+    test_holds_against_buyers();
+    test_wal_recovery();
+    test_checkpoint_recovery();
+    printf("Pass\n");
+}